@@ -0,0 +1,49 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checksums used to protect records */
+
+#ifndef PBLOG_CHECKSUM_H
+#define PBLOG_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Computes the 8-bit sum of a buffer, used by RECORD_FORMAT_SUM8 records.
+ * Uses SIMD instructions when available.
+ */
+unsigned char record_checksum(const void *buf, size_t len);
+/* Scalar 8-bit sum, same results as record_checksum(). */
+unsigned char record_checksum_portable(const void *buf, size_t len);
+
+/* Computes the CRC32C (Castagnoli) of a buffer.  Uses the CPU CRC32C
+ * instructions when available.
+ * Args:
+ *   crc: 0, or the result of a previous call to continue a checksum
+ */
+uint32_t pblog_crc32c(uint32_t crc, const void *buf, size_t len);
+/* Table based CRC32C, same results as pblog_crc32c(). */
+uint32_t pblog_crc32c_portable(uint32_t crc, const void *buf, size_t len);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* PBLOG_CHECKSUM_H */
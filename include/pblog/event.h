@@ -34,6 +34,45 @@ int event_decode(const void *buf, size_t len, pblog_Event *event);
 /* Returns the encoded length of the event or <0 on error. */
 int event_size(const pblog_Event *event);
 
+/* Bump allocator in a caller-provided buffer for the key/value strings of
+   decoded events.  The strings of an event take at most its encoded
+   length, so a buffer of PBLOG_MAX_EVENT_SIZE bytes holds any event. */
+typedef struct event_arena {
+  char *buf;
+  size_t size;
+  size_t used;
+} event_arena;
+
+void event_arena_init(event_arena *arena, void *buf, size_t size);
+/* Releases every string allocated from the arena at once. */
+void event_arena_reset(event_arena *arena);
+
+/* Like event_decode, but allocates the key/value strings from the arena
+   rather than with malloc.  They stay valid until the arena is reset, and
+   event_free leaves them alone.  Strings that event held from
+   event_decode or event_add_kv_data are freed.
+   Returns: 0 on success, PBLOG_ERR_NO_SPACE if the arena is full or
+   another <0 error if the event cannot be decoded. */
+int event_decode_arena(const void *buf, size_t len, pblog_Event *event,
+                       event_arena *arena);
+
+/* Leading scalar fields of an encoded event. */
+typedef struct event_header {
+  pblog_Event_Vendor vendor;
+  bool has_type;
+  pblog_event_type type;
+  bool has_timestamp;
+  uint32_t timestamp;
+  bool has_boot_number;
+  uint32_t boot_number;
+} event_header;
+
+/* Reads the vendor, type, timestamp and boot_number fields of an encoded
+   event without decoding the rest of it.  Stops at the first later field,
+   as encoders write the fields in field number order.
+   Returns: 0 on success or <0 if the fields cannot be parsed. */
+int event_peek(const void *buf, size_t len, event_header *header);
+
 /* Initializes/destroys an event structure. */
 void event_init(pblog_Event *event);
 void event_free(pblog_Event *event);
@@ -28,8 +28,49 @@
 extern "C" {
 #endif
 
+/* Shared operations.  Their priv must point at the file name, so they can
+ * back a single log at a time; prefer pblog_file_ops_init().
+ */
 extern struct pblog_flash_ops pblog_file_ops;
 
+/* Initializes flash operations backed by a file.  The name is copied, and
+ * each initialized instance is independent of the others.
+ * Returns:
+ *   0 on success, <0 on failure
+ */
+int pblog_file_ops_init(struct pblog_flash_ops *ops, const char *filename);
+
+/* Flags for pblog_file_ops_open(). */
+#define PBLOG_FILE_MMAP 0x1 /* map the file, reads and writes copy memory */
+/* Bypass the page cache with O_DIRECT.  Transfers go through an aligned
+ * bounce buffer in whole blocks, which get_geometry() reports.
+ */
+#define PBLOG_FILE_DIRECT 0x2
+
+/* Initializes flash operations backed by a file that stays open until
+ * pblog_file_ops_free(), avoiding an open() and close() per operation.
+ * Writes reach the file's page cache; call ops->sync() to make them durable.
+ * Args:
+ *   filename: file to use, created if missing
+ *   size: size of the flash.  A shorter file is extended with erased
+ *     (0xff) bytes.  0 uses the current file size.
+ *   flags: PBLOG_FILE_* flags
+ * Returns:
+ *   0 on success, <0 on failure
+ */
+int pblog_file_ops_open(struct pblog_flash_ops *ops, const char *filename,
+                        size_t size, int flags);
+
+/* Returns the descriptor held by operations set up by pblog_file_ops_open(),
+ * or -1 for other operations.
+ */
+int pblog_file_ops_fd(const struct pblog_flash_ops *ops);
+
+/* Releases operations set up by pblog_file_ops_init() or
+ * pblog_file_ops_open().
+ */
+void pblog_file_ops_free(struct pblog_flash_ops *ops);
+
 #ifdef __cplusplus
 }  /* extern "C" */
 #endif
@@ -26,6 +26,26 @@
 extern "C" {
 #endif
 
+/* Data buffer for pblog_flash_ops.writev(). */
+typedef struct pblog_flash_iovec {
+  const void *data;
+  size_t len;
+} pblog_flash_iovec;
+
+/* Physical layout of a flash device, for pblog_flash_ops.get_geometry(). */
+typedef struct pblog_flash_geometry {
+  /* Smallest unit programmed at once, in bytes.  Writes of part of a unit
+   * cost as much as writing the whole unit.
+   */
+  uint32_t program_size;
+  /* Smallest unit erased at once, in bytes.  A multiple of program_size. */
+  uint32_t erase_block_size;
+  /* Alignment of offsets and lengths the device transfers directly.  The
+   * operations still accept any offset and length.
+   */
+  uint32_t alignment;
+} pblog_flash_geometry;
+
 typedef struct pblog_flash_ops {
   /* Read/write operations.  Returns number of bytes read/written. */
   int (*read)(struct pblog_flash_ops *ops, int offset, size_t len, void *data);
@@ -33,6 +53,26 @@ typedef struct pblog_flash_ops {
                const void *data);
   /* Erase region.  Returns 0 on success */
   int (*erase)(struct pblog_flash_ops *ops, int offset, size_t len);
+  /* Optional.  Writes the buffers back to back starting at offset, in a
+   * single program operation where the device allows.  Returns number of
+   * bytes written.  When NULL, callers fall back to write().
+   */
+  int (*writev)(struct pblog_flash_ops *ops, int offset,
+                const struct pblog_flash_iovec *iov, int iovcnt);
+  /* Optional.  Makes all completed writes and erases durable.  Returns 0 on
+   * success.  When NULL, writes are durable once they return.
+   */
+  int (*sync)(struct pblog_flash_ops *ops);
+  /* Optional.  Hints that [offset, offset + len) is about to be read, so
+   * that the backend can start reading it in the background.  Returns 0 on
+   * success.
+   */
+  int (*prefetch)(struct pblog_flash_ops *ops, int offset, size_t len);
+  /* Optional.  Describes the device.  Returns 0 on success.  When NULL, the
+   * device is byte addressable.
+   */
+  int (*get_geometry)(struct pblog_flash_ops *ops,
+                      struct pblog_flash_geometry *geometry);
 
   void *priv;
 } pblog_flash_ops;
@@ -28,8 +28,20 @@
 extern "C" {
 #endif
 
+/* Shared operations.  Their priv must point at the memory, so they can back
+ * a single log at a time; prefer pblog_mem_ops_init().
+ */
 extern struct pblog_flash_ops pblog_mem_ops;
 
+/* Initializes flash operations backed by the memory at addr.  Each
+ * initialized instance is independent, so several logs can use their own
+ * memory concurrently.  The memory must outlive the operations.
+ * Returns:
+ *   0 on success, <0 on failure
+ */
+int pblog_mem_ops_init(struct pblog_flash_ops *ops, void *addr);
+void pblog_mem_ops_free(struct pblog_flash_ops *ops);
+
 #ifdef __cplusplus
 }  /* extern "C" */
 #endif
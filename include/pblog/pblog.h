@@ -32,6 +32,7 @@ extern "C" {
 #define PBLOG_MAX_EVENT_SIZE 4096
 
 struct record_intf;
+struct record_intf_options;
 
 /* Args:
  *   valid: 1 if event is considered valid, 0 otherwise
@@ -41,22 +42,73 @@ struct record_intf;
 typedef enum pblog_status (*pblog_event_cb)(int valid, const pblog_Event *event,
                                             void *priv);
 
+/* Selects events for for_each_matching_event.  An event matches if it
+ * meets every criterion that is set.
+ */
+typedef struct pblog_filter {
+  /* Types to match, or NULL for events of any type. */
+  const pblog_event_type *types;
+  size_t num_types;
+  /* Inclusive ranges of timestamps and boot numbers, if set.  Events
+   * without the field do not match.
+   */
+  int has_time_range;
+  uint32_t time_min;
+  uint32_t time_max;
+  int has_boot_range;
+  uint32_t boot_min;
+  uint32_t boot_max;
+  int has_vendor;
+  pblog_Event_Vendor vendor;
+} pblog_filter;
+
 typedef struct pblog {
   /* Adds a single event to the log.  event may be modified to add timestamp
    * and/or bootnum values.
    */
   enum pblog_status (*add_event)(struct pblog *pblog, pblog_Event *event);
 
+  /* Adds count events to the log, as a loop of add_event would.  The events
+   * are encoded into one buffer and appended to each log as a batch of
+   * records, and a full log is compacted when the batch does not fit rather
+   * than checked for every event.  On failure the events before the failing
+   * one may have been added.
+   */
+  enum pblog_status (*add_events)(struct pblog *pblog, pblog_Event *events,
+                                  size_t count);
+
   /* Calls provided callback for every event in the log.
    * Args:
    *   callback: will be called in order of oldest to most recent entry.
    *   event: event struct to use for unserializing each event, must be non-NULL
    *   priv: opaque pointer that is passed to callback
+   * The key/value strings of the event are decoded into a buffer on the
+   * stack, see event_decode_arena(), and are only valid during the callback.
    */
   enum pblog_status (*for_each_event)(struct pblog *pblog,
                                       pblog_event_cb callback,
                                       pblog_Event *event, void *priv);
 
+  /* Like for_each_event, but calls the callback from the most recent to the
+   * oldest entry.  Stop early by returning non-zero from the callback, the
+   * cost is then proportional to the number of events visited.
+   */
+  enum pblog_status (*for_each_event_reverse)(struct pblog *pblog,
+                                              pblog_event_cb callback,
+                                              pblog_Event *event, void *priv);
+
+  /* Like for_each_event, but only calls the callback for the valid events
+   * matching a filter.  The fields used by the filter are read from the
+   * encoded events, and only matching events are decoded.  Regions whose
+   * summary of event types, timestamps and boot numbers rules out a match
+   * are skipped without reading them, see pblog_summary_options().
+   */
+  enum pblog_status (*for_each_matching_event)(struct pblog *pblog,
+                                               const pblog_filter *filter,
+                                               pblog_event_cb callback,
+                                               pblog_Event *event,
+                                               void *priv);
+
   /* Clears the entire log. */
   enum pblog_status (*clear)(struct pblog *pblog);
 
@@ -69,6 +121,62 @@ typedef struct pblog {
   void *priv;
 } pblog;
 
+/* Behaviors of add_event when the queue of an asynchronous log is full. */
+enum pblog_async_overflow {
+  /* The caller writes the queued events and its own to flash, as
+   * add_event does without a queue.
+   */
+  PBLOG_ASYNC_OVERFLOW_WRITE = 0,
+  /* The event is only added to the memory log and the next pblog_flush()
+   * returns PBLOG_ERR_NO_SPACE.
+   */
+  PBLOG_ASYNC_OVERFLOW_DROP = 1,
+};
+
+/* Options for pblog_init_options(). */
+typedef struct pblog_options {
+  /* As for pblog_init(). */
+  int allow_clear_on_add;
+  void *mem_addr;
+  size_t mem_size;
+  /* Splits the memory log into one region per flash region that takes
+   * records, each the size of the largest, and keeps the events of each
+   * flash region in the memory region with the same index.  Compaction then
+   * drops the oldest memory region instead of copying the flash log back to
+   * memory.  Requires mem_size to hold all the regions, and cannot be
+   * combined with async_queue_size.
+   */
+  int mem_mirror_regions;
+  /* Lets a memory log that survived a warm reboot be used as is.  The
+   * first bytes of the memory hold a stamp with the ends of both logs and
+   * the sequence numbers of the flash regions, updated whenever events are
+   * added.  At init the memory log is adopted if the stamp is intact and
+   * matches the flash log, otherwise it is copied from flash again.  Takes
+   * the size of the stamp from mem_size, and cannot be combined with
+   * async_queue_size.
+   */
+  int mem_reuse;
+  /* Size in bytes of a queue of events waiting to be written to flash by a
+   * background thread.  add_event then only adds events to the memory log
+   * and the queue, and reads see them at once.  Failures to write events to
+   * flash are reported by pblog_flush().  Requires a memory log and
+   * PBLOG_USE_PTHREADS.  0 writes events to flash in add_event.
+   */
+  size_t async_queue_size;
+  /* Number of queued events that wakes the background thread, which then
+   * writes out the whole queue.  Fewer events wait for pblog_flush().  0 is
+   * the same as 1.
+   */
+  int async_batch;
+  enum pblog_async_overflow async_overflow;
+  /* Makes pblog_init() stop reading a log without a memory log at its first
+   * valid event, instead of reading the whole flash log to count them.
+   * pblog_init() then returns 1 for a log holding events, and
+   * pblog_event_count() counts them when first called.
+   */
+  int fast_init;
+} pblog_options;
+
 /* Initialize the log.
  * Args:
  *   allow_clear_on_add: if the log should allow reclaiming space if full
@@ -82,6 +190,43 @@ typedef struct pblog {
  */
 int pblog_init(struct pblog *pblog, int allow_clear_on_add,
                struct record_intf *flash_ri, void *mem_addr, size_t mem_size);
+/* Initialize the log like pblog_init() with explicit options.
+ * Returns:
+ *   number of events found in the log on success, or 1 for a log holding
+ *   events with fast_init, PBLOG_ERR_INVALID if the asynchronous mode is
+ *   requested without its requirements, <0 on failure
+ * pblog_free() may be called whatever the result.  If the log could not be
+ * set up, nothing is left allocated and it does nothing.
+ */
+int pblog_init_options(struct pblog *pblog, struct record_intf *flash_ri,
+                       const struct pblog_options *options);
+/* Returns the number of valid events in the log.  The count is kept up to
+ * date as events are added, and found by reading the log without decoding
+ * the events when it is not known: after pblog_init() with fast_init, or
+ * after a full log without a memory log copied from flash was compacted.
+ * An event then counts as valid if its vendor, type, timestamp and
+ * boot_number fields parse, as event_peek() reads them.  A stored event
+ * whose later fields are corrupt is counted, although for_each_event
+ * passes it as invalid.  Records pass their checksum before they are
+ * counted, so such an event was stored corrupt in the first place.
+ * Returns:
+ *   number of events on success, <0 on failure
+ */
+int pblog_event_count(struct pblog *pblog);
+/* Sets the region summary options of a flash record interface, so that
+ * for_each_matching_event skips its regions without matching events when it
+ * reads the flash log.  The memory log always keeps region summaries.
+ */
+void pblog_summary_options(struct record_intf_options *options);
+/* Writes the queued events to flash and flushes the flash record interface.
+ * Returns:
+ *   PBLOG_SUCCESS, or the first error since the last flush, including
+ *   PBLOG_ERR_NO_SPACE for events that were dropped from flash
+ */
+enum pblog_status pblog_flush(struct pblog *pblog);
+/* Writes out the queued events as pblog_flush() does and frees the log.
+ * Does nothing for a log that pblog_init_options() could not set up.
+ */
 void pblog_free(struct pblog *pblog);
 
 #ifdef __cplusplus
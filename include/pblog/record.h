@@ -27,6 +27,7 @@ extern "C" {
 #endif
 
 struct pblog_flash_ops;
+struct pblog_flash_geometry;
 
 /* Header used for each record */
 typedef struct record_header {
@@ -35,6 +36,20 @@ typedef struct record_header {
   uint8_t checksum;
 } __attribute__((packed)) record_header;
 
+/* Header used for each record in RECORD_FORMAT_CRC32C regions */
+typedef struct record_header_crc32c {
+  uint8_t length_msb;
+  uint8_t length_lsb;
+  /* CRC32C of the length bytes and the record data, LSB in crc[0]. */
+  uint8_t crc[4];
+} __attribute__((packed)) record_header_crc32c;
+
+/* Record formats.  The format of each region is given by its magic. */
+enum record_format {
+  RECORD_FORMAT_SUM8 = 0,   /* record_header, 8-bit additive checksum */
+  RECORD_FORMAT_CRC32C = 1, /* record_header_crc32c */
+};
+
 /* Header used on each erase block region */
 typedef struct region_header {
   /* Magic value used to recognize this as a valid region. */
@@ -45,6 +60,25 @@ typedef struct region_header {
   uint8_t sequence[4];
 } __attribute__((packed)) region_header;
 
+/* Position of a record in the log.  Used to step through records without
+ * locating the containing region from the start of the log on every read.
+ * Initialized by record_intf.seek().  Cursors follow their record when
+ * regions are cleared: generation changes whenever that happens, so a scan
+ * can tell that older records were dropped under it.
+ */
+typedef struct record_cursor {
+  int offset;          /* byte offset of the record, as used by read_record */
+  int region;          /* index of the containing region, from the head */
+  int region_offset;   /* byte offset of the record within its region */
+  uint32_t generation; /* region layout the position was computed for */
+  uint32_t dropped;    /* bytes cleared from the log before the position */
+} record_cursor;
+
+/* Decides from the summary of a region whether a reader can skip all of its
+ * records.  Returns non-zero to skip the region.
+ */
+typedef int (*record_skip_fn)(const void *summary, void *priv);
+
 typedef struct record_intf {
   /* Reads a record.
    * Args:
@@ -59,6 +93,64 @@ typedef struct record_intf {
   int (*read_record)(struct record_intf *ri, int offset, int *next_offset,
                      size_t *len, void *data);
 
+  /* Positions a cursor at a record.
+   * Args:
+   *   cursor: cursor to initialize
+   *   offset: byte offset of record
+   * Returns:
+   *   0 on success, <0 on failure
+   */
+  int (*seek)(struct record_intf *ri, struct record_cursor *cursor,
+              int offset);
+
+  /* Reads the record at the cursor and advances the cursor to the next one.
+   * If regions were cleared since the cursor was positioned, the cursor is
+   * moved to the new offset of its record first, or to the oldest record if
+   * its own record was cleared.
+   * Args:
+   *   cursor: cursor positioned by seek
+   *   next_offset: set to the offset of the next record relative to this one
+   *   len: maximum data length to read, updated with actual read data length
+   *   data: data buffer to write
+   * Returns:
+   *   0 on success, <0 on failure
+   *   next_offset set to '0' on end of log
+   */
+  int (*read_next)(struct record_intf *ri, struct record_cursor *cursor,
+                   int *next_offset, size_t *len, void *data);
+
+  /* Moves a cursor past the regions that skip() rejects, judging each from
+   * its summary, see record_intf_options.summarize.  Only the region of the
+   * next record, if the cursor is at the first record of that region, and
+   * the regions following it are checked, so a scan calls this before every
+   * read_next.  Summaries of regions found on flash at init are built from
+   * their records the first time they are needed.  Clears are handled as in
+   * read_next.
+   * Returns:
+   *   number of regions skipped, 0 without summaries, <0 on failure
+   */
+  int (*skip_regions)(struct record_intf *ri, struct record_cursor *cursor,
+                      record_skip_fn skip, void *priv);
+
+  /* Positions a cursor at the end of the log, after the newest record. */
+  int (*seek_end)(struct record_intf *ri, struct record_cursor *cursor);
+
+  /* Moves the cursor back to the previous record and reads it.  Used to walk
+   * the log from the newest record.  The record offsets of a region are
+   * indexed in memory the first time the region is read backwards.
+   * Args:
+   *   cursor: cursor positioned by seek or seek_end
+   *   prev_offset: set to the number of bytes the cursor moved back
+   *   len: maximum data length to read, updated with actual read data length
+   *   data: data buffer to write
+   * Returns:
+   *   0 on success, <0 on failure
+   *   prev_offset set to '0' at the start of the log
+   * Clears are handled as in read_next.
+   */
+  int (*read_prev)(struct record_intf *ri, struct record_cursor *cursor,
+                   int *prev_offset, size_t *len, void *data);
+
   /* Appends a record.
    * Args:
    *   len: length of data to append in bytes
@@ -68,6 +160,30 @@ typedef struct record_intf {
    */
   int (*append)(struct record_intf *ri, size_t len, const void *data);
 
+  /* Appends several records, as a loop of append() would, but hands
+   * consecutive records of a region to the flash in a single write.
+   * Args:
+   *   count: number of records
+   *   lens: length of each record in bytes
+   *   data: record data of all records, back to back
+   * Returns:
+   *   number of records appended on success, less than count if they filled
+   *   the tail region, the log is full or a write failed after the first
+   *   record
+   *   <0 on failure to append the first record
+   */
+  int (*append_batch)(struct record_intf *ri, int count, const size_t *lens,
+                      const void *data);
+
+  /* Moves the tail of the log to a region, given by its index from the head
+   * region as in record_cursor, leaving the rest of the regions before it
+   * unused.  Lets a copy of a log keep the records of each region of the
+   * original in the same region.  Does nothing if the tail is already there.
+   * Returns:
+   *   0 on success, PBLOG_ERR_NO_SPACE if the log has no such region
+   */
+  int (*skip_to_region)(struct record_intf *ri, int region);
+
   /* Returns the number of free bytes for storing records. */
   int (*get_free_space)(struct record_intf *ri);
 
@@ -79,6 +195,24 @@ typedef struct record_intf {
    */
   int (*clear)(struct record_intf *ri, int num_regions);
 
+  /* Writes out the records held in the write buffer, if any, and syncs the
+   * flash if it implements sync().  Call this periodically to bound the
+   * records lost on power failure when a write buffer or a caching backend
+   * is used.  Records that cannot be written are dropped.
+   * Returns:
+   *   0 on success, <0 on failure
+   */
+  int (*flush)(struct record_intf *ri);
+
+  /* Erases regions dropped from the log by clear() when spare regions are
+   * configured.  Call this from a background thread or a periodic task.
+   * Args:
+   *   max_chunks: maximum number of erase_chunk_size chunks to erase
+   * Returns:
+   *   number of regions still waiting to be erased, <0 on failure
+   */
+  int (*erase_pending)(struct record_intf *ri, int max_chunks);
+
   void *priv;
 } record_intf;
 
@@ -90,14 +224,131 @@ typedef struct record_region {
   uint32_t sequence;  /* sequence number */
 } __attribute__((packed)) record_region;
 
+/* Default for record_intf_options.scan_buffer_size. */
+#define RECORD_DEFAULT_SCAN_BUFFER_SIZE 4096
+/* Default for record_intf_options.read_ahead_size. */
+#define RECORD_DEFAULT_READ_AHEAD_SIZE 4096
+
+/* Optional settings for record_intf_init_options(). */
+typedef struct record_intf_options {
+  /* Size of the temporary buffer used to find the end of the records in each
+   * region at init.  Regions are read in chunks of this size and the record
+   * headers are walked in memory.  0 reads one record header at a time.
+   */
+  size_t scan_buffer_size;
+  /* Number of threads used to scan the regions at init.  Values below 2 scan
+   * on the calling thread.  Requires the flash read operation to be safe to
+   * call concurrently.  Ignored unless built with PBLOG_USE_PTHREADS.
+   */
+  int init_threads;
+  /* Record format of regions created from now on.  Regions already holding
+   * records keep their format until they are cleared.
+   */
+  enum record_format format;
+  /* Size of the read-ahead window used by read_next and read_prev.  Cursor
+   * reads load this much of the region's records in one flash read and
+   * parse records from memory until they leave the window.  seek() drops the
+   * window, so a scan never sees data cached before it started.  read_record
+   * always reads the flash directly.  0 disables read-ahead, as does
+   * thread_safe.
+   */
+  size_t read_ahead_size;
+  /* Size of the write buffer.  Appended records are collected in memory and
+   * programmed to flash in one operation when the buffer fills, a flush
+   * policy below triggers, the tail moves to another region, or on flush(),
+   * clear() and record_intf_free().  Buffered records are visible to reads
+   * but are lost on power failure.  Records larger than the buffer are
+   * written directly.  0 writes every record immediately.
+   * If the flash reports a geometry, flushes program whole units, padded
+   * with erased bytes that the next flush programs again, and 0 means a
+   * buffer of one unit flushed after every record.
+   */
+  size_t write_buffer_size;
+  /* Flush once this many bytes are buffered.  0 for no limit. */
+  size_t flush_bytes;
+  /* Flush once this many records are buffered.  0 for no limit. */
+  int flush_records;
+  /* Number of erased regions kept ahead of the tail.  Appends return
+   * PBLOG_ERR_NO_SPACE rather than fill them, and clear() of part of the log
+   * only drops the oldest regions, leaving the erase to erase_pending().  An
+   * append that reaches a region still waiting to be erased finishes the
+   * erase first.  0 erases regions synchronously in clear().  Must be less
+   * than the number of regions, init fails with PBLOG_ERR_INVALID otherwise.
+   */
+  int spare_regions;
+  /* Size of the chunks erased by erase_pending(), a multiple of the erase
+   * block size.  Rounded up to the erase block size of the flash geometry.
+   * 0 erases whole regions.
+   */
+  size_t erase_chunk_size;
+  /* Number of chunks erased by each successful append.  0 leaves the erase
+   * to erase_pending().
+   */
+  int erase_chunks_per_append;
+  /* Makes the interface safe to use from several threads: any number of
+   * threads may read through their own cursors while one thread appends,
+   * flushes, erases and clears.  Cursor reads then go to the flash
+   * directly rather than through the read-ahead window, which readers in
+   * different regions would keep evicting.  Requires PBLOG_USE_PTHREADS,
+   * init fails with PBLOG_ERR_INVALID otherwise.
+   */
+  int thread_safe;
+  /* Summary of the records of each region, kept in memory for skip_regions.
+   * Every region has summary_size bytes, zeroed while it is empty, and
+   * summarize() adds each valid record to the summary of its region as it is
+   * appended or read back to rebuild the summary.  0 keeps no summaries.
+   */
+  size_t summary_size;
+  void (*summarize)(void *summary, const void *data, size_t len, void *priv);
+  void *summary_priv;
+} record_intf_options;
+
 /* Initializes a record interface
  * Args:
  *   regions: array of regions to use (will be copied into internal structures)
+ *     If the flash reports a geometry, they must be made of whole erase
+ *     blocks, see record_regions_from_geometry().
+ * A reported geometry without an erase block size, or whose erase block
+ * size is not a multiple of the program size, fails with PBLOG_ERR_INVALID.
+ * A program size of 0 counts as 1.
  */
 int record_intf_init(record_intf *ri, const struct record_region *regions,
                      int num_regions, struct pblog_flash_ops *flash);
+/* Initializes a record interface like record_intf_init() with explicit
+ * options.  Unset (zero) options disable the corresponding feature.
+ */
+int record_intf_init_options(record_intf *ri,
+                             const struct record_region *regions,
+                             int num_regions, struct pblog_flash_ops *flash,
+                             const struct record_intf_options *options);
+/* Returns the number of regions that take records, not counting spare
+ * regions, and sets max_region_size to the size of the largest region.
+ */
+int record_intf_num_regions(const record_intf *ri,
+                            uint32_t *max_region_size);
+/* Sets sequence to the sequence number of a used region, given by its index
+ * from the head region as in record_cursor.
+ * Returns:
+ *   PBLOG_SUCCESS, PBLOG_ERR_INVALID if there is no such used region
+ */
+int record_intf_region_sequence(const record_intf *ri, int region,
+                                uint32_t *sequence);
+/* Flushes the write buffer and frees the record interface. */
 void record_intf_free(record_intf *ri);
 
+/* Splits size bytes of flash at offset into num_regions equal regions made
+ * of whole erase blocks of the flash geometry, as required by
+ * record_intf_init() for flash reporting one.  Bytes that do not fill an
+ * erase block of every region are left unused.
+ * Returns:
+ *   PBLOG_SUCCESS, PBLOG_ERR_NO_SPACE if a region would be smaller than an
+ *   erase block
+ */
+int record_regions_from_geometry(const struct pblog_flash_geometry *geometry,
+                                 uint32_t offset, uint32_t size,
+                                 int num_regions,
+                                 struct record_region *regions);
+
 #ifdef __cplusplus
 }  /* extern "C" */
 #endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Simulated flash operations for tests and benchmarks */
+
+#ifndef PBLOG_SIM_H
+#define PBLOG_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pblog/flash.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Description of the simulated device for pblog_sim_ops_init(). */
+typedef struct pblog_sim_options {
+  /* Size of the device in bytes, a multiple of erase_block_size. */
+  uint32_t size;
+  /* Program unit (page) and erase block sizes, as reported by
+   * get_geometry().  0 selects 1 byte units and 4 KiB blocks.
+   */
+  uint32_t program_size;
+  uint32_t erase_block_size;
+  /* Simulated latencies in nanoseconds: per read operation plus per byte
+   * read, per program unit touched by a write, and per erase block.
+   */
+  uint32_t read_ns;
+  uint32_t read_ns_per_byte;
+  uint32_t program_ns;
+  uint32_t erase_ns;
+  /* Number of times a program unit may be programmed between erases, as
+   * NAND partial page programming limits (NOP).  Further programs count as
+   * write disturbs.  0 for no limit, as for NOR.
+   */
+  uint32_t max_programs;
+  /* Fail writes that would program bits from 0 to 1 instead of only
+   * counting them.
+   */
+  int strict;
+} pblog_sim_options;
+
+/* Counters of a simulated device. */
+typedef struct pblog_sim_stats {
+  uint64_t time_ns;          /* simulated time spent in operations */
+  uint64_t reads;            /* read operations */
+  uint64_t bytes_read;
+  uint64_t programs;         /* program units touched by writes */
+  uint64_t bytes_programmed; /* bytes passed to writes */
+  uint64_t erases;           /* erase blocks erased */
+  /* Bytes written with bits set that were already programmed to 0.  Flash
+   * can only clear bits, so these bytes keep their old zero bits.
+   */
+  uint64_t program_errors;
+  /* Programs of a unit beyond max_programs since its last erase. */
+  uint64_t disturbs;
+  /* Highest erase count of any block, a measure of wear. */
+  uint32_t max_erase_count;
+} pblog_sim_stats;
+
+/* Initializes flash operations backed by a simulated device that starts
+ * out erased.  Writes only clear bits, erases must cover whole erase
+ * blocks and every operation adds its latency to the simulated time;
+ * nothing actually waits.
+ * Returns:
+ *   0 on success, PBLOG_ERR_INVALID for an inconsistent geometry,
+ *   PBLOG_ERR_NO_SPACE if the device cannot be allocated
+ */
+int pblog_sim_ops_init(struct pblog_flash_ops *ops,
+                       const struct pblog_sim_options *options);
+void pblog_sim_ops_free(struct pblog_flash_ops *ops);
+
+/* Reads the counters of a simulated device. */
+void pblog_sim_get_stats(struct pblog_flash_ops *ops,
+                         struct pblog_sim_stats *stats);
+/* Resets the counters, except for the erase counts of the blocks and
+ * max_erase_count, which track the wear of the device.
+ */
+void pblog_sim_reset_stats(struct pblog_flash_ops *ops);
+/* Returns the number of times an erase block was erased. */
+uint32_t pblog_sim_erase_count(struct pblog_flash_ops *ops, uint32_t block);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* PBLOG_SIM_H */
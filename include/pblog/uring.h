@@ -0,0 +1,71 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* io_uring flash operations for file backed logs */
+
+#ifndef PBLOG_URING_H
+#define PBLOG_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pblog/flash.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Optional settings for pblog_uring_ops_open(). */
+typedef struct pblog_uring_options {
+  /* Maximum number of operations in flight.  0 selects synchronous reads and
+   * writes, which are also used when the kernel does not support io_uring.
+   */
+  unsigned queue_depth;
+  /* Number of queued operations that triggers a submission.  Queued
+   * operations are also submitted by reads of the same bytes, sync() and
+   * pblog_uring_ops_free().  0 submits every operation immediately.
+   */
+  unsigned submit_batch;
+} pblog_uring_options;
+
+/* Initializes flash operations backed by a file through io_uring.  Writes
+ * and erases return as soon as they are queued; the failure of a queued
+ * operation is reported by the next sync().  Reads and writes wait for the
+ * queued writes they overlap, and prefetch() reads ahead in the background.
+ * Operations the kernel does not accept run synchronously instead.
+ * Args:
+ *   filename, size: as for pblog_file_ops_open()
+ *   options: settings, or NULL for the defaults
+ * Returns:
+ *   0 on success, <0 on failure
+ */
+int pblog_uring_ops_open(struct pblog_flash_ops *ops, const char *filename,
+                         size_t size, const struct pblog_uring_options *options);
+
+/* Returns 1 if the operations submit through io_uring, 0 if they fell back
+ * to synchronous reads and writes.
+ */
+int pblog_uring_ops_is_async(const struct pblog_flash_ops *ops);
+
+/* Waits for the operations in flight and releases the operations. */
+void pblog_uring_ops_free(struct pblog_flash_ops *ops);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* PBLOG_URING_H */
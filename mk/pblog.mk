@@ -16,6 +16,7 @@ PBLOG_BUILD_STATIC ?= y
 PBLOG_BUILD_SHARED ?= n
 
 PBLOG_BUILD_MODULE_FILE ?= y
+PBLOG_BUILD_THREADS ?= n
 
 # Parameters
 PBLOG_LIBRARIES =
@@ -42,12 +43,17 @@ PBLOG_CFLAGS = $(CPPFLAGS) $(CFLAGS) -Wall -DPB_FIELD_32BIT=1
 ifeq ($(PBLOG_BUILD_SHARED),y)
 PBLOG_CFLAGS += -fPIC
 endif
+PBLOG_LDLIBS =
+ifeq ($(PBLOG_BUILD_THREADS),y)
+PBLOG_CFLAGS += -DPBLOG_USE_PTHREADS=1 -pthread
+PBLOG_LDLIBS += -pthread
+endif
 
 HEADER_FILTER =
 SOURCE_FILTER =
 ifeq ($(PBLOG_BUILD_MODULE_FILE),n)
-HEADER_FILTER += %/file.h
-SOURCE_FILTER += %/file.c
+HEADER_FILTER += %/file.h %/uring.h
+SOURCE_FILTER += %/file.c %/uring.c
 endif
 
 PBLOG_SRC_INCLUDE = $(PBLOG_DIR)/include
@@ -112,7 +118,7 @@ $(PBLOG_OUT)/libpblog.a: $(PBLOG_OBJECTS)
 
 $(PBLOG_OUT)/libpblog.so: $(PBLOG_OBJECTS)
 	@$(PBLOG_MKDIR) -p $(PBLOG_OUT)
-	$(PBLOG_CC) -shared -Wl,-soname,libpblog.so $(PBLOG_OBJECTS) -o $(PBLOG_OUT)/libpblog.so
+	$(PBLOG_CC) -shared -Wl,-soname,libpblog.so $(PBLOG_OBJECTS) $(PBLOG_LDLIBS) -o $(PBLOG_OUT)/libpblog.so
 
 pblog_clean:
 	rm -rf $(PBLOG_OUT)
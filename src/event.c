@@ -54,6 +54,58 @@ static bool string_decoder(pb_istream_t *stream,
   return true;
 }
 
+/* Input stream state of event_decode_arena: the bytes left to read and the
+   arena the strings are allocated from. */
+struct arena_stream_state {
+  const uint8_t *pos;
+  event_arena *arena;
+  bool full;
+};
+
+static bool arena_stream_read(pb_istream_t *stream, uint8_t *buf,
+                              size_t count) {
+  struct arena_stream_state *state = (struct arena_stream_state *)stream->state;
+  if (buf != NULL) {
+    memcpy(buf, state->pos, count);
+  }
+  state->pos += count;
+  return true;
+}
+
+static bool arena_string_decoder(pb_istream_t *stream,
+                                 const pb_field_t *field,  // NOLINT
+                                 void **arg) {
+  struct arena_stream_state *state = (struct arena_stream_state *)stream->state;
+  event_arena *arena = state->arena;
+  size_t strsize = stream->bytes_left;
+  char *str;
+
+  if (arena->size - arena->used < strsize + 1) {
+    state->full = true;
+    return false;
+  }
+  str = arena->buf + arena->used;
+  if (!pb_read(stream, (uint8_t *)str, strsize)) {
+    return false;
+  }
+  str[strsize] = '\0';
+  arena->used += strsize + 1;
+  *arg = str;
+  return true;
+}
+
+/* Returns 1 if the string of a key or value was allocated from an arena. */
+static int is_arena_string(const pb_callback_t *callback) {
+  return callback->funcs.decode == arena_string_decoder;
+}
+
+/* Returns 1 if the string of a key or value was allocated with malloc by
+   event_decode or event_add_kv_data. */
+static int is_heap_string(const pb_callback_t *callback) {
+  return callback->funcs.decode == string_decoder ||
+         callback->funcs.encode == string_encoder;
+}
+
 int event_encode(const pblog_Event *event, void *buf, size_t len) {
   pb_ostream_t stream = pb_ostream_from_buffer((uint8_t *)buf, len);
 
@@ -71,6 +123,13 @@ int event_decode(const void *buf, size_t len, pblog_Event *event) {
   int i = 0;
 
   for (i = 0; i < pb_arraysize(pblog_Event, data); ++i) {
+    /* string_decoder frees the previous string, which an arena owns. */
+    if (is_arena_string(&event->data[i].key)) {
+      event->data[i].key.arg = NULL;
+    }
+    if (is_arena_string(&event->data[i].value)) {
+      event->data[i].value.arg = NULL;
+    }
     event->data[i].key.funcs.decode = string_decoder;
     event->data[i].value.funcs.decode = string_decoder;
   }
@@ -82,6 +141,45 @@ int event_decode(const void *buf, size_t len, pblog_Event *event) {
   return PBLOG_ERR_INVALID;
 }
 
+void event_arena_init(event_arena *arena, void *buf, size_t size) {
+  arena->buf = (char *)buf;
+  arena->size = size;
+  arena->used = 0;
+}
+
+void event_arena_reset(event_arena *arena) { arena->used = 0; }
+
+int event_decode_arena(const void *buf, size_t len, pblog_Event *event,
+                       event_arena *arena) {
+  struct arena_stream_state state = {(const uint8_t *)buf, arena, false};
+  pb_istream_t stream = {&arena_stream_read, &state, len};
+  int i = 0;
+
+  /* Entries past data_count may still hold strings from an earlier
+     event_decode too. */
+  for (i = 0; i < pb_arraysize(pblog_Event, data); ++i) {
+    if (is_heap_string(&event->data[i].key)) {
+      free(event->data[i].key.arg);
+    }
+    if (is_heap_string(&event->data[i].value)) {
+      free(event->data[i].value.arg);
+    }
+    event->data[i].key.funcs.decode = arena_string_decoder;
+    event->data[i].key.arg = NULL;
+    event->data[i].value.funcs.decode = arena_string_decoder;
+    event->data[i].value.arg = NULL;
+  }
+  if (pb_decode(&stream, pblog_Event_fields, event)) {
+    return 0;
+  }
+  if (state.full) {
+    return PBLOG_ERR_NO_SPACE;
+  }
+
+  PBLOG_ERRF("event decode error: %s\n", PB_GET_ERROR(&stream));
+  return PBLOG_ERR_INVALID;
+}
+
 static bool nul_write_callback(pb_ostream_t *stream, const uint8_t *buf,
                                size_t count) {
   (void)stream;
@@ -102,14 +200,88 @@ int event_size(const pblog_Event *event) {
   return PBLOG_ERR_INVALID;
 }
 
+/* Field numbers and wire types of the leading fields of pblog.Event. */
+#define EVENT_FIELD_VENDOR 1
+#define EVENT_FIELD_TYPE 2
+#define EVENT_FIELD_TIMESTAMP 3
+#define EVENT_FIELD_BOOT_NUMBER 4
+#define WIRETYPE_VARINT 0
+#define WIRETYPE_FIXED32 5
+
+static int read_varint(const uint8_t **pos, const uint8_t *end,
+                       uint64_t *value) {
+  int shift;
+  *value = 0;
+  for (shift = 0; *pos < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*pos)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  return PBLOG_ERR_INVALID;
+}
+
+int event_peek(const void *buf, size_t len, event_header *header) {
+  const uint8_t *pos = (const uint8_t *)buf;
+  const uint8_t *end = pos + len;
+
+  memset(header, 0, sizeof(*header));
+  while (pos < end) {
+    uint64_t key;
+    uint64_t value;
+    if (read_varint(&pos, end, &key) != 0) {
+      return PBLOG_ERR_INVALID;
+    }
+    if ((key >> 3) > EVENT_FIELD_BOOT_NUMBER) {
+      break;
+    }
+
+    if ((key >> 3) == EVENT_FIELD_TIMESTAMP &&
+        (key & 7) == WIRETYPE_FIXED32) {
+      if (end - pos < 4) {
+        return PBLOG_ERR_INVALID;
+      }
+      header->timestamp = pos[0] | (pos[1] << 8) | (pos[2] << 16) |
+                          ((uint32_t)pos[3] << 24);
+      header->has_timestamp = true;
+      pos += 4;
+      continue;
+    }
+    if ((key & 7) != WIRETYPE_VARINT || read_varint(&pos, end, &value) != 0) {
+      return PBLOG_ERR_INVALID;
+    }
+    switch (key >> 3) {
+      case EVENT_FIELD_VENDOR:
+        header->vendor = (pblog_Event_Vendor)value;
+        break;
+      case EVENT_FIELD_TYPE:
+        header->type = (pblog_event_type)value;
+        header->has_type = true;
+        break;
+      case EVENT_FIELD_BOOT_NUMBER:
+        header->boot_number = value;
+        header->has_boot_number = true;
+        break;
+      default:
+        return PBLOG_ERR_INVALID;
+    }
+  }
+  return 0;
+}
+
 void event_init(pblog_Event *event) { memset(event, 0, sizeof(*event)); }
 
 void event_free(pblog_Event *event) {
   int i = 0;
   for (i = 0; i < event->data_count; ++i) {
-    free(event->data[i].key.arg);
+    if (!is_arena_string(&event->data[i].key)) {
+      free(event->data[i].key.arg);
+    }
     event->data[i].key.arg = NULL;
-    free(event->data[i].value.arg);
+    if (!is_arena_string(&event->data[i].value)) {
+      free(event->data[i].value.arg);
+    }
     event->data[i].value.arg = NULL;
   }
 }
@@ -14,14 +14,22 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE  // O_DIRECT
+
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#ifdef PBLOG_USE_PTHREADS
+#include <pthread.h>
+#endif
 
+#include <pblog/common.h>
 #include <pblog/file.h>
 
 static int file_read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
@@ -51,17 +59,470 @@ static int file_write(pblog_flash_ops *ops, int offset, size_t len,
   return rc;
 }
 
+// Maximum number of buffers handed to a single pwritev call.
+#define FILE_MAX_IOV 64
+
+// Writes the buffers back to back at offset.  Returns the number of bytes
+// written, or <0 on failure.
+static int fd_pwritev(int fd, int offset, const struct pblog_flash_iovec *iov,
+                      int iovcnt) {
+  struct iovec vec[FILE_MAX_IOV];
+  int total = 0;
+
+  while (iovcnt > 0) {
+    int count = iovcnt < FILE_MAX_IOV ? iovcnt : FILE_MAX_IOV;
+    size_t len = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+      vec[i].iov_base = (void *)iov[i].data;
+      vec[i].iov_len = iov[i].len;
+      len += iov[i].len;
+    }
+
+    int rc = pwritev(fd, vec, count, offset + total);
+    if (rc < 0) {
+      return rc;
+    }
+    total += rc;
+    if (rc != len) {
+      break;
+    }
+    iov += count;
+    iovcnt -= count;
+  }
+  return total;
+}
+
+static int file_writev(pblog_flash_ops *ops, int offset,
+                       const struct pblog_flash_iovec *iov, int iovcnt) {
+  const char *filename = ops->priv;
+  int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = fd_pwritev(fd, offset, iov, iovcnt);
+  close(fd);
+  return rc;
+}
+
+// Writes erased bytes to [offset, offset + len) of a file.  Every buffer of
+// a pwritev call points at the same erased page, so the memory used does not
+// depend on len.
+static int fd_fill_erased(int fd, off_t offset, size_t len) {
+  unsigned char page[4096];
+  struct iovec vec[FILE_MAX_IOV];
+  int i;
+
+  memset(page, 0xff, sizeof(page));
+  while (len > 0) {
+    size_t chunk = 0;
+    int count = 0;
+    ssize_t rc;
+    for (i = 0; i < FILE_MAX_IOV && chunk < len; ++i) {
+      vec[i].iov_base = page;
+      vec[i].iov_len = len - chunk < sizeof(page) ? len - chunk : sizeof(page);
+      chunk += vec[i].iov_len;
+      count++;
+    }
+    rc = pwritev(fd, vec, count, offset);
+    if (rc <= 0) {
+      return -1;
+    }
+    offset += rc;
+    len -= rc;
+  }
+  return 0;
+}
+
 static int file_erase(pblog_flash_ops *ops, int offset, size_t len) {
-  unsigned char *erase_buf = malloc(len);
-  memset(erase_buf, 0xff, len);
-  int rc = ops->write(ops, offset, len, erase_buf);
-  free(erase_buf);
-  return rc == len ? 0 : -1;
+  const char *filename = ops->priv;
+  int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = fd_fill_erased(fd, offset, len);
+  close(fd);
+  return rc;
 }
 
 struct pblog_flash_ops pblog_file_ops = {
     .read = &file_read,
     .write = &file_write,
     .erase = &file_erase,
+    .writev = &file_writev,
     .priv = NULL /* filename to be set on instantiation */
 };
+
+int pblog_file_ops_init(struct pblog_flash_ops *ops, const char *filename) {
+  *ops = pblog_file_ops;
+  ops->priv = strdup(filename);
+  return ops->priv != NULL ? PBLOG_SUCCESS : PBLOG_ERR_NO_SPACE;
+}
+
+// Block size that PBLOG_FILE_DIRECT transfers are aligned to.
+#define FILE_DIRECT_BLOCK_SIZE 4096
+// Size of the bounce buffer of PBLOG_FILE_DIRECT operations.
+#define FILE_DIRECT_BOUNCE_SIZE (64 * 1024)
+
+// State of operations set up by pblog_file_ops_open().
+struct file_state {
+  int fd;
+  // Mapping of the whole file with PBLOG_FILE_MMAP, NULL otherwise.
+  unsigned char *map;
+  size_t size;
+  // Aligned buffer for transfers with PBLOG_FILE_DIRECT, NULL otherwise.
+  unsigned char *bounce;
+#ifdef PBLOG_USE_PTHREADS
+  // Serializes the transfers through the bounce buffer.
+  pthread_mutex_t lock;
+#endif
+};
+
+static void file_lock(struct file_state *state) {
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_lock(&state->lock);
+#endif
+}
+
+static void file_unlock(struct file_state *state) {
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_unlock(&state->lock);
+#endif
+}
+
+static int fd_read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
+  struct file_state *state = ops->priv;
+  return pread(state->fd, data, len, offset);
+}
+
+static int fd_write(pblog_flash_ops *ops, int offset, size_t len,
+                    const void *data) {
+  struct file_state *state = ops->priv;
+  return pwrite(state->fd, data, len, offset);
+}
+
+static int fd_writev(pblog_flash_ops *ops, int offset,
+                     const struct pblog_flash_iovec *iov, int iovcnt) {
+  struct file_state *state = ops->priv;
+  return fd_pwritev(state->fd, offset, iov, iovcnt);
+}
+
+static int fd_erase(pblog_flash_ops *ops, int offset, size_t len) {
+  struct file_state *state = ops->priv;
+  return fd_fill_erased(state->fd, offset, len);
+}
+
+static int fd_sync(pblog_flash_ops *ops) {
+  struct file_state *state = ops->priv;
+  return fdatasync(state->fd) == 0 ? 0 : -1;
+}
+
+// Returns 1 if [offset, offset + len) lies within the mapping.
+static int map_contains(const struct file_state *state, int offset,
+                        size_t len) {
+  return offset >= 0 && offset <= state->size && len <= state->size - offset;
+}
+
+static int map_read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
+  struct file_state *state = ops->priv;
+  if (!map_contains(state, offset, len)) {
+    return -1;
+  }
+  memcpy(data, state->map + offset, len);
+  return len;
+}
+
+static int map_write(pblog_flash_ops *ops, int offset, size_t len,
+                     const void *data) {
+  struct file_state *state = ops->priv;
+  if (!map_contains(state, offset, len)) {
+    return -1;
+  }
+  memcpy(state->map + offset, data, len);
+  return len;
+}
+
+static int map_writev(pblog_flash_ops *ops, int offset,
+                      const struct pblog_flash_iovec *iov, int iovcnt) {
+  struct file_state *state = ops->priv;
+  size_t total = 0;
+  int i;
+  for (i = 0; i < iovcnt; ++i) {
+    total += iov[i].len;
+  }
+  if (!map_contains(state, offset, total)) {
+    return -1;
+  }
+  total = 0;
+  for (i = 0; i < iovcnt; ++i) {
+    memcpy(state->map + offset + total, iov[i].data, iov[i].len);
+    total += iov[i].len;
+  }
+  return total;
+}
+
+static int map_erase(pblog_flash_ops *ops, int offset, size_t len) {
+  struct file_state *state = ops->priv;
+  if (!map_contains(state, offset, len)) {
+    return -1;
+  }
+  memset(state->map + offset, 0xff, len);
+  return 0;
+}
+
+static int map_sync(pblog_flash_ops *ops) {
+  struct file_state *state = ops->priv;
+  return msync(state->map, state->size, MS_SYNC) == 0 ? 0 : -1;
+}
+
+// Copies len bytes from position pos of the buffers to dst, or erased bytes
+// if iov is NULL.
+static void iov_copy(unsigned char *dst, const struct pblog_flash_iovec *iov,
+                     int iovcnt, size_t pos, size_t len) {
+  int i;
+  if (iov == NULL) {
+    memset(dst, 0xff, len);
+    return;
+  }
+  for (i = 0; i < iovcnt && len > 0; ++i) {
+    size_t n;
+    if (pos >= iov[i].len) {
+      pos -= iov[i].len;
+      continue;
+    }
+    n = iov[i].len - pos < len ? iov[i].len - pos : len;
+    memcpy(dst, (const unsigned char *)iov[i].data + pos, n);
+    dst += n;
+    len -= n;
+    pos = 0;
+  }
+}
+
+static int direct_read(pblog_flash_ops *ops, int offset, size_t len,
+                       void *data) {
+  struct file_state *state = ops->priv;
+  const size_t block = FILE_DIRECT_BLOCK_SIZE;
+  size_t done = 0;
+  int rc = 0;
+
+  file_lock(state);
+  while (done < len) {
+    const size_t pos = offset + done;
+    const size_t head = pos % block;
+    size_t span = (head + len - done + block - 1) / block * block;
+    size_t n;
+    ssize_t got;
+    if (span > FILE_DIRECT_BOUNCE_SIZE) {
+      span = FILE_DIRECT_BOUNCE_SIZE;
+    }
+    got = pread(state->fd, state->bounce, span, pos - head);
+    if (got < 0) {
+      rc = -1;
+      break;
+    }
+    if (got <= head) {
+      break;
+    }
+    n = got - head < len - done ? got - head : len - done;
+    memcpy((unsigned char *)data + done, state->bounce + head, n);
+    done += n;
+  }
+  file_unlock(state);
+  return rc < 0 ? rc : (int)done;
+}
+
+// Reads the block at offset into buf, as erased bytes past the end of file.
+static int direct_read_block(struct file_state *state, size_t offset,
+                             unsigned char *buf) {
+  memset(buf, 0xff, FILE_DIRECT_BLOCK_SIZE);
+  return pread(state->fd, buf, FILE_DIRECT_BLOCK_SIZE, offset) < 0 ? -1 : 0;
+}
+
+// Writes the buffers to [offset, offset + len), or erases it if iov is NULL,
+// in whole blocks.  Blocks that are only partly written are read first.
+// Returns the number of bytes written.
+static int direct_program(struct file_state *state, int offset, size_t len,
+                          const struct pblog_flash_iovec *iov, int iovcnt) {
+  const size_t block = FILE_DIRECT_BLOCK_SIZE;
+  size_t done = 0;
+
+  file_lock(state);
+  while (done < len) {
+    const size_t pos = offset + done;
+    const size_t head = pos % block;
+    size_t n = len - done;
+    size_t span;
+    if (head + n > FILE_DIRECT_BOUNCE_SIZE) {
+      n = FILE_DIRECT_BOUNCE_SIZE - head;
+    }
+    span = (head + n + block - 1) / block * block;
+
+    if (head != 0 &&
+        direct_read_block(state, pos - head, state->bounce) != 0) {
+      break;
+    }
+    if ((head + n) % block != 0 && (span > block || head == 0) &&
+        direct_read_block(state, pos - head + span - block,
+                          state->bounce + span - block) != 0) {
+      break;
+    }
+    iov_copy(state->bounce + head, iov, iovcnt, done, n);
+    if (pwrite(state->fd, state->bounce, span, pos - head) != span) {
+      break;
+    }
+    done += n;
+  }
+  file_unlock(state);
+  return done > 0 || len == 0 ? (int)done : -1;
+}
+
+static int direct_write(pblog_flash_ops *ops, int offset, size_t len,
+                        const void *data) {
+  struct pblog_flash_iovec iov = {data, len};
+  return direct_program(ops->priv, offset, len, &iov, 1);
+}
+
+static int direct_writev(pblog_flash_ops *ops, int offset,
+                         const struct pblog_flash_iovec *iov, int iovcnt) {
+  size_t len = 0;
+  int i;
+  for (i = 0; i < iovcnt; ++i) {
+    len += iov[i].len;
+  }
+  return direct_program(ops->priv, offset, len, iov, iovcnt);
+}
+
+static int direct_erase(pblog_flash_ops *ops, int offset, size_t len) {
+  return direct_program(ops->priv, offset, len, NULL, 0) == len ? 0 : -1;
+}
+
+static int direct_get_geometry(pblog_flash_ops *ops,
+                               struct pblog_flash_geometry *geometry) {
+  (void)ops;
+  geometry->program_size = FILE_DIRECT_BLOCK_SIZE;
+  geometry->erase_block_size = FILE_DIRECT_BLOCK_SIZE;
+  geometry->alignment = FILE_DIRECT_BLOCK_SIZE;
+  return 0;
+}
+
+int pblog_file_ops_open(struct pblog_flash_ops *ops, const char *filename,
+                        size_t size, int flags) {
+  struct file_state *state;
+  struct stat st;
+  int fd;
+
+  if ((flags & PBLOG_FILE_MMAP) && (flags & PBLOG_FILE_DIRECT)) {
+    return PBLOG_ERR_INVALID;
+  }
+  fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    PBLOG_ERRF("failed to open %s\n", filename);
+    return PBLOG_ERR_IO;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return PBLOG_ERR_IO;
+  }
+  if (size == 0) {
+    size = st.st_size;
+  } else if (st.st_size < size &&
+             fd_fill_erased(fd, st.st_size, size - st.st_size) != 0) {
+    PBLOG_ERRF("failed to extend %s to %zu bytes\n", filename, size);
+    close(fd);
+    return PBLOG_ERR_IO;
+  }
+
+  state = malloc(sizeof(*state));
+  if (state == NULL) {
+    close(fd);
+    return PBLOG_ERR_NO_SPACE;
+  }
+  state->fd = fd;
+  state->map = NULL;
+  state->size = size;
+  state->bounce = NULL;
+
+  memset(ops, 0, sizeof(*ops));
+  if (flags & PBLOG_FILE_MMAP) {
+    void *map = MAP_FAILED;
+    if (size > 0) {
+      map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+      PBLOG_ERRF("failed to map %s\n", filename);
+      close(fd);
+      free(state);
+      return size > 0 ? PBLOG_ERR_IO : PBLOG_ERR_INVALID;
+    }
+    state->map = map;
+    ops->read = &map_read;
+    ops->write = &map_write;
+    ops->erase = &map_erase;
+    ops->writev = &map_writev;
+    ops->sync = &map_sync;
+  } else if (flags & PBLOG_FILE_DIRECT) {
+    // The file was extended through the page cache, switch to direct I/O
+    // for the log itself.
+    if (fdatasync(fd) != 0 || fcntl(fd, F_SETFL, O_DIRECT) != 0 ||
+        posix_memalign((void **)&state->bounce, FILE_DIRECT_BLOCK_SIZE,
+                       FILE_DIRECT_BOUNCE_SIZE) != 0) {
+      PBLOG_ERRF("O_DIRECT unavailable for %s\n", filename);
+      close(fd);
+      free(state);
+      return PBLOG_ERR_INVALID;
+    }
+#ifdef PBLOG_USE_PTHREADS
+    pthread_mutex_init(&state->lock, NULL);
+#endif
+    ops->read = &direct_read;
+    ops->write = &direct_write;
+    ops->erase = &direct_erase;
+    ops->writev = &direct_writev;
+    ops->sync = &fd_sync;
+    ops->get_geometry = &direct_get_geometry;
+  } else {
+    ops->read = &fd_read;
+    ops->write = &fd_write;
+    ops->erase = &fd_erase;
+    ops->writev = &fd_writev;
+    ops->sync = &fd_sync;
+  }
+  ops->priv = state;
+  return PBLOG_SUCCESS;
+}
+
+// Returns 1 if the operations were set up by pblog_file_ops_open().
+static int file_ops_opened(const struct pblog_flash_ops *ops) {
+  return ops->read == &fd_read || ops->read == &map_read ||
+         ops->read == &direct_read;
+}
+
+int pblog_file_ops_fd(const struct pblog_flash_ops *ops) {
+  if (file_ops_opened(ops)) {
+    const struct file_state *state = ops->priv;
+    return state->fd;
+  }
+  return -1;
+}
+
+void pblog_file_ops_free(struct pblog_flash_ops *ops) {
+  // Operations from pblog_file_ops_open() own a file_state, the others a copy
+  // of the file name.
+  if (file_ops_opened(ops)) {
+    struct file_state *state = ops->priv;
+    if (state->map != NULL) {
+      munmap(state->map, state->size);
+    }
+    if (state->bounce != NULL) {
+#ifdef PBLOG_USE_PTHREADS
+      pthread_mutex_destroy(&state->lock);
+#endif
+      free(state->bounce);
+    }
+    close(state->fd);
+    free(state);
+  } else {
+    free(ops->priv);
+  }
+  ops->priv = NULL;
+}
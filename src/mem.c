@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <pblog/common.h>
 #include <pblog/mem.h>
 
 static int mem_read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
@@ -34,6 +35,19 @@ static int mem_write(pblog_flash_ops *ops, int offset, size_t len,
   return len;
 }
 
+static int mem_writev(pblog_flash_ops *ops, int offset,
+                      const struct pblog_flash_iovec *iov, int iovcnt) {
+  unsigned char *addr = ops->priv;
+  size_t total = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    memcpy(addr + offset + total, iov[i].data, iov[i].len);
+    total += iov[i].len;
+  }
+  return total;
+}
+
 static int mem_erase(pblog_flash_ops *ops, int offset, size_t len) {
   unsigned char *addr = ops->priv;
 
@@ -45,5 +59,17 @@ struct pblog_flash_ops pblog_mem_ops = {
     .read = &mem_read,
     .write = &mem_write,
     .erase = &mem_erase,
+    .writev = &mem_writev,
     .priv = NULL /* set to memory address base upon instantiation */
 };
+
+int pblog_mem_ops_init(struct pblog_flash_ops *ops, void *addr) {
+  if (addr == NULL) {
+    return PBLOG_ERR_INVALID;
+  }
+  *ops = pblog_mem_ops;
+  ops->priv = addr;
+  return PBLOG_SUCCESS;
+}
+
+void pblog_mem_ops_free(struct pblog_flash_ops *ops) { ops->priv = NULL; }
@@ -328,14 +328,19 @@ int main(int argc, char *argv[]) {
 
   int rc;
 
-  pblog_file_ops.priv = (void *)filename;
+  struct pblog_flash_ops flash;
+  rc = pblog_file_ops_init(&flash, filename);
+  if (rc < 0) {
+    fprintf(stderr, "cannot open %s: %d\n", filename, rc);
+    return 1;
+  }
 
   struct record_region regions[1];
   regions[0].offset = 0;
   regions[0].size = 0xff;
 
   struct record_intf ri;
-  record_intf_init(&ri, regions, 1, &pblog_file_ops);
+  record_intf_init(&ri, regions, 1, &flash);
 
   struct nvram nvram;
   nvram_init(&nvram, &ri);
@@ -343,29 +348,27 @@ int main(int argc, char *argv[]) {
   if (!key) {
     struct nvram_entry *entries;
     rc = nvram.list(&nvram, &entries);
-    if (rc < 0) {
-      return rc;
-    }
-    struct nvram_entry *entry = entries;
-    for (; entry->key != NULL; entry++) {
-      fprintf(stdout, "%s=%s\n", entry->key, entry->data);
+    if (rc >= 0) {
+      struct nvram_entry *entry = entries;
+      for (; entry->key != NULL; entry++) {
+        fprintf(stdout, "%s=%s\n", entry->key, entry->data);
+      }
+      nvram_list_free(&entries);
+      rc = 0;
     }
-    nvram_list_free(&entries);
-    return 0;
   } else if (!data) {
     data = malloc(MAX_NVRAM_ENTRY_SIZE);
     rc = nvram.lookup(&nvram, key, data, MAX_NVRAM_ENTRY_SIZE);
-    if (rc < 0) {
-      return rc;
+    if (rc >= 0) {
+      fprintf(stdout, "%s=%s\n", key, data);
     }
-    fprintf(stdout, "%s=%s\n", key, data);
     free(data);
-    return rc;
   } else {
     rc = nvram.set(&nvram, key, data, strlen(data));
-    return rc;
   }
 
-  return 0;
+  record_intf_free(&ri);
+  pblog_file_ops_free(&flash);
+  return rc;
 }
 #endif
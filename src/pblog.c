@@ -16,9 +16,14 @@
 
 /* Base support for reading/writing of protobuf log events */
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef PBLOG_USE_PTHREADS
+#include <pthread.h>
+#endif
 
+#include <pblog/checksum.h>
 #include <pblog/common.h>
 #include <pblog/event.h>
 #include <pblog/flash.h>
@@ -26,21 +31,482 @@
 #include <pblog/pblog.h>
 #include <pblog/record.h>
 
+// Size of the length prefix of the events in the async queue.
+#define ASYNC_LEN_SIZE 2
+// Buffer and maximum number of events of a batch encoded by add_events.
+#define BATCH_BUFFER_SIZE (2 * PBLOG_MAX_EVENT_SIZE)
+#define BATCH_MAX_EVENTS 64
+
+// Stamp kept at the start of the memory of a log with mem_reuse.  It
+// records where both logs ended when they last held the same events, so
+// that a warm reboot can tell whether the memory log still matches flash.
+struct mem_stamp {
+  uint8_t magic[4];
+  uint32_t mem_size;
+  // Sequence numbers of the head and tail regions of the flash log, the
+  // used size of its tail region and the record offsets after the newest
+  // record of each log.
+  uint32_t flash_head_sequence;
+  uint32_t flash_tail_sequence;
+  uint32_t flash_tail_used;
+  uint32_t flash_end;
+  uint32_t mem_end;
+  int32_t num_events;
+  uint32_t crc;  // CRC32C of the fields above
+};
+
+static const uint8_t mem_stamp_magic[4] = {'P', 'B', 'M', 'S'};
+
+// Summary of the events of a record region, kept by the record interfaces of
+// the log so that for_each_matching_event can skip regions.  Zeroed for an
+// empty region.
+struct event_summary {
+  uint32_t count;  // events whose header could be read
+  // Ranges of the timestamps and boot numbers of the events that have them.
+  uint32_t num_timed;
+  uint32_t time_min;
+  uint32_t time_max;
+  uint32_t num_booted;
+  uint32_t boot_min;
+  uint32_t boot_max;
+  // Bit type % 64 is set for the type of every event, bit vendor % 32 for
+  // every vendor.
+  uint64_t types;
+  uint32_t vendors;
+};
+
 struct pblog_metadata {
   struct record_intf *flash_ri;
   struct record_intf *mem_ri;
+  // Backend of mem_ri, owned by this log.
+  struct pblog_flash_ops mem_ops;
   int allow_clear_on_add;
+  struct pblog_options options;
+  int async;  // events are written to flash by the async worker
+#ifdef PBLOG_USE_PTHREADS
+  pthread_t worker;
+  // Held while using flash_ri once the worker runs.
+  pthread_mutex_t flash_lock;
+  // Guards the fields below and signals the worker.  Nests in flash_lock.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Ring of events waiting for flash, each prefixed by its length.
+  unsigned char *queue;
+  size_t queue_head;
+  size_t queue_len;
+  int queue_count;
+  int stop;
+  // Set when the worker found the flash log full, left for the caller to
+  // compact.
+  int flash_full;
+#endif
+  // First error writing to flash since the last pblog_flush().
+  int async_status;
+  // Number of valid events in the log read by queries, -1 if not known.
+  int num_events;
+  // Set when an append to the memory log failed, until it is copied from
+  // flash again.  The stamp is kept invalid meanwhile.
+  int mem_stale;
 };
 
-static int sync_events(struct record_intf *source, struct record_intf *dest);
+static int sync_events(struct record_intf *source, struct record_intf *dest,
+                       int mirror);
+static int write_clear_event(struct pblog *pblog);
 
-static int write_event(struct pblog *pblog, pblog_Event *event) {
-  struct pblog_metadata *meta = pblog->priv;
+// Adds appended events to the event count, if it is known.
+static void count_added(struct pblog_metadata *meta, int count) {
+  if (meta->num_events >= 0) {
+    meta->num_events += count;
+  }
+}
+
+#ifdef PBLOG_USE_PTHREADS
+// Copies len bytes into the queue at position pos, wrapping around.
+static void queue_put(struct pblog_metadata *meta, size_t pos,
+                      const void *data, size_t len) {
+  const size_t size = meta->options.async_queue_size;
+  const size_t start = (meta->queue_head + pos) % size;
+  const size_t first = len < size - start ? len : size - start;
+  memcpy(meta->queue + start, data, first);
+  memcpy(meta->queue, (const unsigned char *)data + first, len - first);
+}
+
+// Copies len bytes out of the queue at position pos, wrapping around.
+static void queue_get(struct pblog_metadata *meta, size_t pos, void *data,
+                      size_t len) {
+  const size_t size = meta->options.async_queue_size;
+  const size_t start = (meta->queue_head + pos) % size;
+  const size_t first = len < size - start ? len : size - start;
+  memcpy(data, meta->queue + start, first);
+  memcpy((unsigned char *)data + first, meta->queue, len - first);
+}
+
+// Queues an event for the worker.  Returns 0 if it does not fit.
+static int queue_push(struct pblog_metadata *meta, const void *data,
+                      size_t len) {
+  unsigned char prefix[ASYNC_LEN_SIZE] = {len & 0xff, len >> 8};
+  if (meta->queue_len + ASYNC_LEN_SIZE + len >
+      meta->options.async_queue_size) {
+    return 0;
+  }
+  queue_put(meta, meta->queue_len, prefix, ASYNC_LEN_SIZE);
+  queue_put(meta, meta->queue_len + ASYNC_LEN_SIZE, data, len);
+  meta->queue_len += ASYNC_LEN_SIZE + len;
+  meta->queue_count++;
+  return 1;
+}
+
+// Copies the oldest queued event to data.  Returns 0 if the queue is empty.
+static int queue_peek(struct pblog_metadata *meta, void *data, size_t *len) {
+  unsigned char prefix[ASYNC_LEN_SIZE];
+  if (meta->queue_count == 0) {
+    return 0;
+  }
+  queue_get(meta, 0, prefix, ASYNC_LEN_SIZE);
+  *len = prefix[0] | (prefix[1] << 8);
+  queue_get(meta, ASYNC_LEN_SIZE, data, *len);
+  return 1;
+}
+
+static void queue_pop(struct pblog_metadata *meta, size_t len) {
+  meta->queue_head =
+      (meta->queue_head + ASYNC_LEN_SIZE + len) % meta->options.async_queue_size;
+  meta->queue_len -= ASYNC_LEN_SIZE + len;
+  meta->queue_count--;
+}
+
+// Records the first error writing to flash, for pblog_flush().
+static void async_set_status(struct pblog_metadata *meta, int rc) {
+  pthread_mutex_lock(&meta->lock);
+  if (meta->async_status == PBLOG_SUCCESS) {
+    meta->async_status = rc;
+  }
+  pthread_mutex_unlock(&meta->lock);
+}
+
+// Appends an event to the flash log, clearing its oldest region if it is
+// full and that is allowed, which sets *cleared.  Called with flash_lock
+// held.
+static int async_append_locked(struct pblog_metadata *meta, const void *data,
+                               size_t len, int *cleared) {
+  int rc = meta->flash_ri->append(meta->flash_ri, len, data);
+  if (rc == PBLOG_ERR_NO_SPACE && meta->allow_clear_on_add) {
+    rc = meta->flash_ri->clear(meta->flash_ri, 1);
+    if (rc >= 0) {
+      *cleared = 1;
+      rc = meta->flash_ri->append(meta->flash_ri, len, data);
+    }
+  }
+  if (rc < 0) {
+    PBLOG_ERRF("pblog: failed to write queued event to flash\n");
+    async_set_status(meta, rc);
+  }
+  return rc;
+}
+
+// Writes the oldest queued event to flash.  Called with flash_lock held.
+// When the flash log is full and may be compacted, the worker (compact
+// unset) leaves the event queued and flags the log for the caller to
+// compact, while callers clear the oldest region and set *cleared.
+// Returns 1 if an event was taken off the queue.
+static int async_write_one(struct pblog_metadata *meta, int compact,
+                           int *cleared) {
   unsigned char event_buf[PBLOG_MAX_EVENT_SIZE];
+  size_t len;
   int rc;
-  int encoded_size;
 
-  // Add current timestamp and bootnum if not set.
+  pthread_mutex_lock(&meta->lock);
+  if ((meta->flash_full && !compact) ||
+      !queue_peek(meta, event_buf, &len)) {
+    pthread_mutex_unlock(&meta->lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&meta->lock);
+
+  if (compact) {
+    async_append_locked(meta, event_buf, len, cleared);
+  } else {
+    rc = meta->flash_ri->append(meta->flash_ri, len, event_buf);
+    if (rc == PBLOG_ERR_NO_SPACE && meta->allow_clear_on_add) {
+      pthread_mutex_lock(&meta->lock);
+      meta->flash_full = 1;
+      pthread_mutex_unlock(&meta->lock);
+      return 0;
+    }
+    if (rc < 0) {
+      PBLOG_ERRF("pblog: failed to write queued event to flash\n");
+      async_set_status(meta, rc);
+    }
+  }
+
+  pthread_mutex_lock(&meta->lock);
+  queue_pop(meta, len);
+  pthread_mutex_unlock(&meta->lock);
+  return 1;
+}
+
+// Writes all queued events to flash.  Called with flash_lock held.  Returns
+// 1 if flash regions were cleared to make room.
+static int async_drain_locked(struct pblog_metadata *meta) {
+  int cleared = 0;
+  while (async_write_one(meta, 1, &cleared)) {
+  }
+  pthread_mutex_lock(&meta->lock);
+  meta->flash_full = 0;
+  pthread_mutex_unlock(&meta->lock);
+  return cleared;
+}
+
+// Rebuilds the memory log from the flash log followed by the queued events.
+// Called with flash_lock held, so the worker leaves the queue alone.
+static int async_rebuild_memlog_locked(struct pblog_metadata *meta) {
+  unsigned char event_buf[PBLOG_MAX_EVENT_SIZE];
+  unsigned char prefix[ASYNC_LEN_SIZE];
+  size_t pos;
+  size_t len;
+  int rc = meta->mem_ri->clear(meta->mem_ri, 0);
+  if (rc < 0) {
+    return rc;
+  }
+  meta->num_events = -1;
+  rc = sync_events(meta->flash_ri, meta->mem_ri, 0);
+  if (rc < 0) {
+    return rc;
+  }
+  meta->num_events = rc;
+
+  pthread_mutex_lock(&meta->lock);
+  for (pos = 0; pos < meta->queue_len; pos += ASYNC_LEN_SIZE + len) {
+    queue_get(meta, pos, prefix, ASYNC_LEN_SIZE);
+    len = prefix[0] | (prefix[1] << 8);
+    queue_get(meta, pos + ASYNC_LEN_SIZE, event_buf, len);
+    rc = meta->mem_ri->append(meta->mem_ri, len, event_buf);
+    if (rc < 0) {
+      meta->num_events = -1;
+      break;
+    }
+    count_added(meta, 1);
+  }
+  pthread_mutex_unlock(&meta->lock);
+  return rc < 0 ? rc : PBLOG_SUCCESS;
+}
+
+// Drops the queued events, for a log about to be cleared.  Called with
+// flash_lock held.
+static void async_discard_locked(struct pblog_metadata *meta) {
+  pthread_mutex_lock(&meta->lock);
+  meta->queue_head = 0;
+  meta->queue_len = 0;
+  meta->queue_count = 0;
+  meta->flash_full = 0;
+  pthread_mutex_unlock(&meta->lock);
+}
+
+static void *async_worker_main(void *arg) {
+  struct pblog_metadata *meta = arg;
+  const int batch =
+      meta->options.async_batch > 0 ? meta->options.async_batch : 1;
+  int cleared = 0;
+  int more;
+
+  pthread_mutex_lock(&meta->lock);
+  while (!meta->stop) {
+    if (meta->flash_full || meta->queue_count < batch) {
+      pthread_cond_wait(&meta->cond, &meta->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&meta->lock);
+    // Take the flash log for one event at a time, so that callers needing
+    // it do not wait for the whole batch.
+    do {
+      pthread_mutex_lock(&meta->flash_lock);
+      more = async_write_one(meta, 0, &cleared);
+      pthread_mutex_unlock(&meta->flash_lock);
+    } while (more);
+    pthread_mutex_lock(&meta->lock);
+  }
+  pthread_mutex_unlock(&meta->lock);
+  return NULL;
+}
+#endif
+
+// Takes the flash log from the async worker, with the queued events written
+// out.  Regions the flash log had to clear for them are also dropped from
+// the memory log.  Returns 1 if a clear event must be logged once the flash
+// log is released.
+static int flash_acquire(struct pblog *pblog) {
+#ifdef PBLOG_USE_PTHREADS
+  struct pblog_metadata *meta = pblog->priv;
+  int cleared;
+
+  if (!meta->async) {
+    return 0;
+  }
+  pthread_mutex_lock(&meta->flash_lock);
+  cleared = async_drain_locked(meta);
+  if (cleared) {
+    async_rebuild_memlog_locked(meta);
+  }
+  return cleared;
+#else
+  (void)pblog;
+  return 0;
+#endif
+}
+
+// Hands the flash log back to the async worker.
+static int flash_release(struct pblog *pblog, int cleared) {
+#ifdef PBLOG_USE_PTHREADS
+  struct pblog_metadata *meta = pblog->priv;
+  if (meta->async) {
+    pthread_mutex_unlock(&meta->flash_lock);
+  }
+#endif
+  return cleared ? write_clear_event(pblog) : PBLOG_SUCCESS;
+}
+
+// Adds an encoded event to the memory log and queues it for flash.
+static int write_event_async(struct pblog *pblog, const void *data,
+                             size_t len) {
+#ifdef PBLOG_USE_PTHREADS
+  struct pblog_metadata *meta = pblog->priv;
+  int queued;
+  int cleared = 0;
+  int rc = meta->mem_ri->append(meta->mem_ri, len, data);
+  if (rc < 0) {
+    PBLOG_ERRF("pblog: failed to write event to memory\n");
+    return rc;
+  }
+  count_added(meta, 1);
+
+  pthread_mutex_lock(&meta->lock);
+  queued = queue_push(meta, data, len);
+  if (!queued && meta->options.async_overflow == PBLOG_ASYNC_OVERFLOW_DROP) {
+    if (meta->async_status == PBLOG_SUCCESS) {
+      meta->async_status = PBLOG_ERR_NO_SPACE;
+    }
+    queued = 1;
+  }
+  pthread_mutex_unlock(&meta->lock);
+
+  // Make room by writing the oldest queued events on this thread, or write
+  // the event itself if it does not fit in the empty queue.
+  while (!queued) {
+    pthread_mutex_lock(&meta->flash_lock);
+    if (async_write_one(meta, 1, &cleared)) {
+      pthread_mutex_lock(&meta->lock);
+      queued = queue_push(meta, data, len);
+      pthread_mutex_unlock(&meta->lock);
+    } else {
+      async_append_locked(meta, data, len, &cleared);
+      queued = 1;
+    }
+    // The event is already in the memory log, which must lose the cleared
+    // regions too.
+    if (queued && cleared) {
+      async_rebuild_memlog_locked(meta);
+    }
+    pthread_mutex_unlock(&meta->flash_lock);
+  }
+
+  pthread_mutex_lock(&meta->lock);
+  pthread_cond_signal(&meta->cond);
+  pthread_mutex_unlock(&meta->lock);
+  return cleared ? write_clear_event(pblog) : PBLOG_SUCCESS;
+#else
+  (void)pblog;
+  (void)data;
+  (void)len;
+  return PBLOG_ERR_INVALID;
+#endif
+}
+
+// Moves the tail of a mirroring memory log to the region of the tail of the
+// flash log, before appending what was just appended to flash.
+static int mirror_align(struct pblog_metadata *meta) {
+  struct record_cursor cursor;
+  int rc;
+  if (!meta->options.mem_mirror_regions) {
+    return PBLOG_SUCCESS;
+  }
+  rc = meta->flash_ri->seek_end(meta->flash_ri, &cursor);
+  if (rc < 0) {
+    return rc;
+  }
+  return meta->mem_ri->skip_to_region(meta->mem_ri, cursor.region);
+}
+
+// Fills a stamp with the current ends of both logs.
+static int mem_stamp_make(struct pblog_metadata *meta,
+                          struct record_intf *mem_ri,
+                          struct mem_stamp *stamp) {
+  struct record_cursor flash_end;
+  struct record_cursor mem_end;
+  int rc;
+
+  memset(stamp, 0, sizeof(*stamp));
+  rc = meta->flash_ri->seek_end(meta->flash_ri, &flash_end);
+  if (rc >= 0) {
+    rc = mem_ri->seek_end(mem_ri, &mem_end);
+  }
+  if (rc >= 0) {
+    rc = record_intf_region_sequence(meta->flash_ri, 0,
+                                     &stamp->flash_head_sequence);
+  }
+  if (rc >= 0) {
+    rc = record_intf_region_sequence(meta->flash_ri, flash_end.region,
+                                     &stamp->flash_tail_sequence);
+  }
+  if (rc < 0) {
+    return rc;
+  }
+  memcpy(stamp->magic, mem_stamp_magic, sizeof(stamp->magic));
+  stamp->mem_size = meta->options.mem_size;
+  stamp->flash_tail_used = flash_end.region_offset;
+  stamp->flash_end = flash_end.offset;
+  stamp->mem_end = mem_end.offset;
+  stamp->num_events = meta->num_events;
+  stamp->crc = pblog_crc32c(0, stamp, offsetof(struct mem_stamp, crc));
+  return PBLOG_SUCCESS;
+}
+
+// Records in the stamp of a log with mem_reuse that both logs hold the same
+// events, or invalidates the stamp if the memory log is stale.
+static void mem_stamp_update(struct pblog_metadata *meta) {
+  struct mem_stamp stamp;
+  if (!meta->options.mem_reuse) {
+    return;
+  }
+  if (meta->mem_stale || mem_stamp_make(meta, meta->mem_ri, &stamp) < 0) {
+    memset(&stamp, 0, sizeof(stamp));
+  }
+  memcpy(meta->options.mem_addr, &stamp, sizeof(stamp));
+}
+
+// Returns 1 if the stamp left in memory matches the flash log and a memory
+// log found in the rest of the memory.
+static int mem_stamp_matches(struct pblog_metadata *meta,
+                             struct record_intf *mem_ri) {
+  struct mem_stamp found;
+  struct mem_stamp expected;
+
+  memcpy(&found, meta->options.mem_addr, sizeof(found));
+  if (memcmp(found.magic, mem_stamp_magic, sizeof(found.magic)) != 0 ||
+      found.crc !=
+          pblog_crc32c(0, &found, offsetof(struct mem_stamp, crc))) {
+    return 0;
+  }
+  meta->num_events = found.num_events;
+  if (mem_stamp_make(meta, mem_ri, &expected) < 0 ||
+      memcmp(&found, &expected, sizeof(found)) != 0) {
+    meta->num_events = -1;
+    return 0;
+  }
+  return 1;
+}
+
+// Adds current timestamp and bootnum if not set.
+static void event_set_defaults(struct pblog *pblog, pblog_Event *event) {
   if (!event->has_boot_number && pblog->get_current_bootnum) {
     event->boot_number = pblog->get_current_bootnum(pblog);
     event->has_boot_number = 1;
@@ -49,12 +515,24 @@ static int write_event(struct pblog *pblog, pblog_Event *event) {
     event->timestamp = pblog->get_time_now(pblog);
     event->has_timestamp = 1;
   }
+}
+
+static int write_event(struct pblog *pblog, pblog_Event *event) {
+  struct pblog_metadata *meta = pblog->priv;
+  unsigned char event_buf[PBLOG_MAX_EVENT_SIZE];
+  int rc;
+  int encoded_size;
+
+  event_set_defaults(pblog, event);
 
   // Encode the event and determine the size.
   encoded_size = event_encode(event, event_buf, sizeof(event_buf));
   if (encoded_size < 0) {
     return encoded_size;
   }
+  if (meta->async) {
+    return write_event_async(pblog, event_buf, encoded_size);
+  }
 
   rc = meta->flash_ri->append(meta->flash_ri, encoded_size, event_buf);
   if (rc < 0) {
@@ -62,13 +540,21 @@ static int write_event(struct pblog *pblog, pblog_Event *event) {
     return rc;
   }
   if (meta->mem_ri) {
-    rc = meta->mem_ri->append(meta->mem_ri, encoded_size, event_buf);
+    rc = mirror_align(meta);
+    if (rc >= 0) {
+      rc = meta->mem_ri->append(meta->mem_ri, encoded_size, event_buf);
+    }
     if (rc < 0) {
       PBLOG_ERRF("pblog: failed to write event to memory\n");
+      meta->num_events = -1;
+      meta->mem_stale = 1;
+      mem_stamp_update(meta);
       return rc;
     }
   }
 
+  count_added(meta, 1);
+  mem_stamp_update(meta);
   return PBLOG_SUCCESS;
 }
 
@@ -89,16 +575,23 @@ static int write_clear_event(struct pblog *pblog) {
   return ret;
 }
 
-// Compacts the log by removing the old entries.
-static int log_compact(struct pblog *pblog) {
-  struct pblog_metadata *meta = pblog->priv;
-
-  // Clear the oldest flash region.
+// Clears the oldest flash region and the memory log, then copies the flash
+// log back to memory.
+static int log_compact_sync(struct pblog_metadata *meta) {
+  // Clear the oldest flash region.  The events it held are counted again
+  // when needed, unless the memory log is copied back from flash.
   int rc = meta->flash_ri->clear(meta->flash_ri, 1);
+  meta->num_events = -1;
   if (rc < 0) {
     return rc;
   }
 
+  // A mirroring mem log drops the same region.
+  if (meta->mem_ri && meta->options.mem_mirror_regions) {
+    rc = meta->mem_ri->clear(meta->mem_ri, 1);
+    return rc < 0 ? rc : PBLOG_SUCCESS;
+  }
+
   // Clear the entire mem log.
   if (meta->mem_ri) {
     rc = meta->mem_ri->clear(meta->mem_ri, 0);
@@ -107,10 +600,50 @@ static int log_compact(struct pblog *pblog) {
     }
 
     // Sync flash to mem.
-    rc = sync_events(meta->flash_ri, meta->mem_ri);
+    rc = sync_events(meta->flash_ri, meta->mem_ri, 0);
     if (rc < 0) {
       return rc;
     }
+    meta->num_events = rc;
+    meta->mem_stale = 0;
+  }
+  return PBLOG_SUCCESS;
+}
+
+// Like log_compact_sync() for an async log.  The queued events are left to
+// the worker and copied to the memory log after the flash log, unless they
+// do not fit there.
+static int log_compact_async(struct pblog_metadata *meta) {
+#ifdef PBLOG_USE_PTHREADS
+  int rc;
+
+  pthread_mutex_lock(&meta->flash_lock);
+  rc = meta->flash_ri->clear(meta->flash_ri, 1);
+  if (rc >= 0) {
+    rc = async_rebuild_memlog_locked(meta);
+    if (rc == PBLOG_ERR_NO_SPACE) {
+      async_drain_locked(meta);
+      rc = async_rebuild_memlog_locked(meta);
+    }
+  }
+  pthread_mutex_lock(&meta->lock);
+  meta->flash_full = 0;
+  pthread_cond_signal(&meta->cond);
+  pthread_mutex_unlock(&meta->lock);
+  pthread_mutex_unlock(&meta->flash_lock);
+  return rc;
+#else
+  (void)meta;
+  return PBLOG_ERR_INVALID;
+#endif
+}
+
+// Compacts the log by removing the old entries.
+static int log_compact(struct pblog *pblog) {
+  struct pblog_metadata *meta = pblog->priv;
+  int rc = meta->async ? log_compact_async(meta) : log_compact_sync(meta);
+  if (rc < 0) {
+    return rc;
   }
 
   // Log a clear event (to both logs).
@@ -120,7 +653,25 @@ static int log_compact(struct pblog *pblog) {
 static enum pblog_status pblog_add_event(struct pblog *pblog,
                                          pblog_Event *event) {
   struct pblog_metadata *meta = pblog->priv;
-  int rc = write_event(pblog, event);
+  int rc;
+
+#ifdef PBLOG_USE_PTHREADS
+  // Compact a flash log the async worker found full.
+  if (meta->async) {
+    int flash_full;
+    pthread_mutex_lock(&meta->lock);
+    flash_full = meta->flash_full;
+    pthread_mutex_unlock(&meta->lock);
+    if (flash_full) {
+      rc = log_compact(pblog);
+      if (rc < 0) {
+        return rc;
+      }
+    }
+  }
+#endif
+
+  rc = write_event(pblog, event);
 
   if (meta->allow_clear_on_add && rc == PBLOG_ERR_NO_SPACE) {
     rc = log_compact(pblog);
@@ -135,21 +686,250 @@ static enum pblog_status pblog_add_event(struct pblog *pblog,
   return rc;
 }
 
-static enum pblog_status pblog_for_each_event(struct pblog *pblog,
-                                              pblog_event_cb callback,
-                                              pblog_Event *event, void *priv) {
+// Appends a batch of encoded events to both logs.  A full log is compacted
+// when the batch stops fitting, and again only once records were appended
+// since.
+static int write_batch(struct pblog *pblog, int count, const size_t *lens,
+                       const unsigned char *data) {
+  struct pblog_metadata *meta = pblog->priv;
+  int compacted = 0;
+  int rc;
+  int i;
+
+  while (count > 0) {
+    rc = meta->flash_ri->append_batch(meta->flash_ri, count, lens, data);
+    if (rc == PBLOG_ERR_NO_SPACE && meta->allow_clear_on_add && !compacted) {
+      rc = log_compact(pblog);
+      if (rc < 0) {
+        PBLOG_ERRF("log full, failed to free space");
+        return rc;
+      }
+      compacted = 1;
+      continue;
+    }
+    if (rc < 0) {
+      PBLOG_ERRF("pblog: failed to write events to flash\n");
+      return rc;
+    }
+    if (meta->mem_ri) {
+      int mem_rc = mirror_align(meta);
+      if (mem_rc >= 0) {
+        mem_rc = meta->mem_ri->append_batch(meta->mem_ri, rc, lens, data);
+      }
+      if (mem_rc != rc) {
+        PBLOG_ERRF("pblog: failed to write events to memory\n");
+        meta->num_events = -1;
+        meta->mem_stale = 1;
+        mem_stamp_update(meta);
+        return mem_rc < 0 ? mem_rc : PBLOG_ERR_NO_SPACE;
+      }
+    }
+    count_added(meta, rc);
+    mem_stamp_update(meta);
+    for (i = 0; i < rc; ++i) {
+      data += lens[i];
+    }
+    lens += rc;
+    count -= rc;
+    compacted = 0;
+  }
+  return PBLOG_SUCCESS;
+}
+
+static enum pblog_status pblog_add_events(struct pblog *pblog,
+                                          pblog_Event *events, size_t count) {
+  struct pblog_metadata *meta = pblog->priv;
+  unsigned char buf[BATCH_BUFFER_SIZE];
+  size_t lens[BATCH_MAX_EVENTS];
+  size_t used = 0;
+  int num_encoded = 0;
+  size_t i;
+  int rc;
+
+  // An async log only queues events, which add_event does cheaply.
+  if (meta->async) {
+    for (i = 0; i < count; ++i) {
+      rc = pblog_add_event(pblog, &events[i]);
+      if (rc < 0) {
+        return rc;
+      }
+    }
+    return PBLOG_SUCCESS;
+  }
+
+  for (i = 0; i < count; ++i) {
+    // Write out the batch once the next event may not fit.
+    if (num_encoded == BATCH_MAX_EVENTS ||
+        sizeof(buf) - used < PBLOG_MAX_EVENT_SIZE) {
+      rc = write_batch(pblog, num_encoded, lens, buf);
+      if (rc < 0) {
+        return rc;
+      }
+      used = 0;
+      num_encoded = 0;
+    }
+
+    event_set_defaults(pblog, &events[i]);
+    rc = event_encode(&events[i], buf + used, PBLOG_MAX_EVENT_SIZE);
+    if (rc < 0) {
+      write_batch(pblog, num_encoded, lens, buf);
+      return rc;
+    }
+    lens[num_encoded++] = rc;
+    used += rc;
+  }
+  return write_batch(pblog, num_encoded, lens, buf);
+}
+
+// Returns 1 if an encoded event matches a filter.
+static int filter_match(const pblog_filter *filter, const void *data,
+                        size_t len) {
+  event_header header;
+  size_t i;
+
+  if (event_peek(data, len, &header) != 0) {
+    return 0;
+  }
+  if (filter->types != NULL) {
+    if (!header.has_type) {
+      header.type = pblog_TYPE_UNKNOWN;
+    }
+    for (i = 0; i < filter->num_types; ++i) {
+      if (filter->types[i] == header.type) {
+        break;
+      }
+    }
+    if (i == filter->num_types) {
+      return 0;
+    }
+  }
+  if (filter->has_time_range &&
+      (!header.has_timestamp || header.timestamp < filter->time_min ||
+       header.timestamp > filter->time_max)) {
+    return 0;
+  }
+  if (filter->has_boot_range &&
+      (!header.has_boot_number || header.boot_number < filter->boot_min ||
+       header.boot_number > filter->boot_max)) {
+    return 0;
+  }
+  return !filter->has_vendor || header.vendor == filter->vendor;
+}
+
+// Adds an encoded event to an event_summary.
+static void event_summarize(void *summary, const void *data, size_t len,
+                            void *priv) {
+  struct event_summary *s = summary;
+  event_header header;
+
+  (void)priv;
+  if (event_peek(data, len, &header) != 0) {
+    return;
+  }
+  if (!header.has_type) {
+    header.type = pblog_TYPE_UNKNOWN;
+  }
+  s->count++;
+  s->types |= 1ull << ((uint32_t)header.type % 64);
+  s->vendors |= 1u << ((uint32_t)header.vendor % 32);
+  if (header.has_timestamp) {
+    if (s->num_timed == 0 || header.timestamp < s->time_min) {
+      s->time_min = header.timestamp;
+    }
+    if (s->num_timed == 0 || header.timestamp > s->time_max) {
+      s->time_max = header.timestamp;
+    }
+    s->num_timed++;
+  }
+  if (header.has_boot_number) {
+    if (s->num_booted == 0 || header.boot_number < s->boot_min) {
+      s->boot_min = header.boot_number;
+    }
+    if (s->num_booted == 0 || header.boot_number > s->boot_max) {
+      s->boot_max = header.boot_number;
+    }
+    s->num_booted++;
+  }
+}
+
+// Returns 1 if no event of a region with an event_summary matches a filter.
+static int filter_skip_region(const void *summary, void *priv) {
+  const struct event_summary *s = summary;
+  const pblog_filter *filter = priv;
+  size_t i;
+
+  if (s->count == 0) {
+    return 1;
+  }
+  if (filter->types != NULL) {
+    for (i = 0; i < filter->num_types; ++i) {
+      if (s->types & (1ull << ((uint32_t)filter->types[i] % 64))) {
+        break;
+      }
+    }
+    if (i == filter->num_types) {
+      return 1;
+    }
+  }
+  if (filter->has_time_range &&
+      (s->num_timed == 0 || s->time_max < filter->time_min ||
+       s->time_min > filter->time_max)) {
+    return 1;
+  }
+  if (filter->has_boot_range &&
+      (s->num_booted == 0 || s->boot_max < filter->boot_min ||
+       s->boot_min > filter->boot_max)) {
+    return 1;
+  }
+  return filter->has_vendor &&
+         !(s->vendors & (1u << ((uint32_t)filter->vendor % 32)));
+}
+
+void pblog_summary_options(struct record_intf_options *options) {
+  options->summary_size = sizeof(struct event_summary);
+  options->summarize = event_summarize;
+  options->summary_priv = NULL;
+}
+
+// Calls the callback for every event, from the oldest or the newest one.
+// With a filter, only for the valid events that match it, skipping the
+// regions whose summary rules out a match.
+static enum pblog_status pblog_iterate(struct pblog *pblog,
+                                       const pblog_filter *filter,
+                                       pblog_event_cb callback,
+                                       pblog_Event *event, void *priv,
+                                       int reverse) {
   struct pblog_metadata *meta = pblog->priv;
   // Prefer reading from the memory-based log if available.
   struct record_intf *ri = meta->mem_ri ? meta->mem_ri : meta->flash_ri;
-  int offset = 0;
+  struct record_cursor cursor;
+  // The strings of each event are decoded into the arena, which holds any
+  // event, so iterating does not allocate.
+  unsigned char arena_buf[PBLOG_MAX_EVENT_SIZE];
+  struct event_arena arena;
+  int rc = reverse ? ri->seek_end(ri, &cursor) : ri->seek(ri, &cursor, 0);
+  if (rc < 0) {
+    return rc;
+  }
 
+  event_arena_init(&arena, arena_buf, sizeof(arena_buf));
   while (1) {
     size_t len = PBLOG_MAX_EVENT_SIZE;
     unsigned char event_buf[PBLOG_MAX_EVENT_SIZE];
     int next_offset = 0;
     int event_valid;
 
-    int rc = ri->read_record(ri, offset, &next_offset, &len, event_buf);
+    if (filter != NULL && !reverse) {
+      rc = ri->skip_regions(ri, &cursor, filter_skip_region, (void *)filter);
+      if (rc < 0) {
+        return rc;
+      }
+    }
+    if (reverse) {
+      rc = ri->read_prev(ri, &cursor, &next_offset, &len, event_buf);
+    } else {
+      rc = ri->read_next(ri, &cursor, &next_offset, &len, event_buf);
+    }
     if (rc < 0 && rc != PBLOG_ERR_CHECKSUM) {
       return rc;
     }
@@ -158,42 +938,65 @@ static enum pblog_status pblog_for_each_event(struct pblog *pblog,
     }
 
     event_valid = rc != PBLOG_ERR_CHECKSUM;
+    if (filter != NULL &&
+        (!event_valid || !filter_match(filter, event_buf, len))) {
+      continue;
+    }
     // Decode the event.
-    rc = event_decode(event_buf, len, event);
+    event_arena_reset(&arena);
+    rc = event_decode_arena(event_buf, len, event, &arena);
     if (rc < 0) {
       event_valid = 0;
+      if (filter != NULL) {
+        continue;
+      }
     }
 
     // Notify callback.
     if (callback && (*callback)(event_valid, event, priv) != PBLOG_SUCCESS) {
       break;
     }
-
-    offset += next_offset;
   }
 
   return PBLOG_SUCCESS;
 }
 
-static enum pblog_status pblog_for_each_event_internal(struct pblog *pblog,
-                                                       pblog_event_cb callback,
-                                                       void *priv) {
-  enum pblog_status status;
-  pblog_Event *event = (pblog_Event *)malloc(sizeof(pblog_Event));
-  if (event == NULL) {
-    return PBLOG_ERR_NO_SPACE;
-  }
-  event_init(event);
-  status = pblog_for_each_event(pblog, callback, event, priv);
-  event_free(event);
-  free(event);
-  return status;
+static enum pblog_status pblog_for_each_event(struct pblog *pblog,
+                                              pblog_event_cb callback,
+                                              pblog_Event *event, void *priv) {
+  return pblog_iterate(pblog, NULL, callback, event, priv, 0);
+}
+
+static enum pblog_status pblog_for_each_event_reverse(struct pblog *pblog,
+                                                      pblog_event_cb callback,
+                                                      pblog_Event *event,
+                                                      void *priv) {
+  return pblog_iterate(pblog, NULL, callback, event, priv, 1);
+}
+
+static enum pblog_status pblog_for_each_matching_event(
+    struct pblog *pblog, const pblog_filter *filter, pblog_event_cb callback,
+    pblog_Event *event, void *priv) {
+  return pblog_iterate(pblog, filter, callback, event, priv, 0);
 }
 
 static enum pblog_status pblog_clear(struct pblog *pblog) {
   struct pblog_metadata *meta = pblog->priv;
-  // Erase the data.
-  int rc = meta->flash_ri->clear(meta->flash_ri, 0);
+  int rc;
+
+  // Erase the data, including the events still queued for flash.
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->async) {
+    pthread_mutex_lock(&meta->flash_lock);
+    async_discard_locked(meta);
+  }
+#endif
+  rc = meta->flash_ri->clear(meta->flash_ri, 0);
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->async) {
+    pthread_mutex_unlock(&meta->flash_lock);
+  }
+#endif
   if (rc < 0) {
     PBLOG_ERRF("pblog: flash clear error\n");
     return rc;
@@ -202,30 +1005,81 @@ static enum pblog_status pblog_clear(struct pblog *pblog) {
     rc = meta->mem_ri->clear(meta->mem_ri, 0);
     if (rc < 0) {
       PBLOG_ERRF("pblog: mem clear error\n");
+      meta->num_events = -1;
       return rc;
     }
   }
+  meta->num_events = 0;
+  meta->mem_stale = 0;
 
   // Log a clear event.
   return write_clear_event(pblog);
 }
 
+// Returns 1 if a record read without error holds a valid event.  Only the
+// leading fields are parsed, so that events can be counted without decoding
+// them.
+static int record_is_event(const void *data, size_t len) {
+  event_header header;
+  return event_peek(data, len, &header) == 0;
+}
+
+// Counts the valid events of the log read by queries, stopping once max are
+// found if max > 0.
+static int count_events(struct pblog_metadata *meta, int max) {
+  struct record_intf *ri = meta->mem_ri ? meta->mem_ri : meta->flash_ri;
+  struct record_cursor cursor;
+  int count = 0;
+  int rc = ri->seek(ri, &cursor, 0);
+  if (rc < 0) {
+    return rc;
+  }
+
+  while (max <= 0 || count < max) {
+    size_t len = PBLOG_MAX_EVENT_SIZE;
+    unsigned char event_buf[PBLOG_MAX_EVENT_SIZE];
+    int next_offset = 0;
+    rc = ri->read_next(ri, &cursor, &next_offset, &len, event_buf);
+    if (rc < 0 && rc != PBLOG_ERR_CHECKSUM) {
+      return rc;
+    }
+    if (next_offset == 0) {
+      break;
+    }
+    count += rc == PBLOG_SUCCESS && record_is_event(event_buf, len);
+  }
+  return count;
+}
+
 // Synchronizes events between 2 record sources.  Skips corrupt/invalid
-// records.
-static int sync_events(struct record_intf *source, struct record_intf *dest) {
-  int offset = 0;
+// records.  With mirror set, every record is copied to the region of dest
+// with the index of its region in source.  Returns the number of valid
+// events copied, or <0 on failure.
+static int sync_events(struct record_intf *source, struct record_intf *dest,
+                       int mirror) {
+  struct record_cursor cursor;
+  int count = 0;
+  int rc = source->seek(source, &cursor, 0);
+  if (rc < 0) {
+    return rc;
+  }
 
   while (1) {
     size_t len = PBLOG_MAX_EVENT_SIZE;
     unsigned char event_buf[PBLOG_MAX_EVENT_SIZE];
     int next_offset = 0;
-    int rc = source->read_record(source, offset, &next_offset, &len, event_buf);
+    int offset = cursor.offset;
+    rc = source->read_next(source, &cursor, &next_offset, &len, event_buf);
     if (next_offset == 0) {
       break;
     }
 
     if (rc >= 0) {
-      rc = dest->append(dest, len, event_buf);
+      count += record_is_event(event_buf, len);
+      rc = mirror ? dest->skip_to_region(dest, cursor.region) : 0;
+      if (rc >= 0) {
+        rc = dest->append(dest, len, event_buf);
+      }
       if (rc < 0) {
         PBLOG_ERRF("pblog: failed to sync event to dest\n");
         return rc;
@@ -233,52 +1087,115 @@ static int sync_events(struct record_intf *source, struct record_intf *dest) {
     } else {
       PBLOG_DPRINTF("pblog: skipping corrupt record at offset %d\n", offset);
     }
-
-    offset += next_offset;
   }
 
-  return PBLOG_SUCCESS;
+  return count;
+}
+
+static void pblog_free_memlog(struct pblog_metadata *meta) {
+  if (meta->mem_ri) {
+    record_intf_free(meta->mem_ri);
+    free(meta->mem_ri);
+    pblog_mem_ops_free(&meta->mem_ops);
+    meta->mem_ri = NULL;
+  }
 }
 
-static struct record_intf *pblog_init_memlog(void *addr, size_t size,
-                                             struct record_intf *flash_ri) {
+// Sets up meta->mem_ri in size bytes at addr, holding the events of the
+// flash log.  Returns 0 on success or <0 on failure, with mem_ri NULL.
+static int pblog_init_memlog(struct pblog_metadata *meta, void *addr,
+                             size_t size, struct record_intf *flash_ri) {
   struct record_region mem_region;
+  struct record_region *mem_regions = &mem_region;
+  struct record_intf_options mem_options;
+  int num_regions = 1;
   struct record_intf *mem_ri;
+  struct record_cursor cursor;
+  // The stamp of mem_reuse comes before the records.
+  const size_t base = meta->options.mem_reuse ? sizeof(struct mem_stamp) : 0;
+  int empty;
   int rc;
+  int i;
 
-  pblog_mem_ops.priv = addr;
+  pblog_mem_ops_init(&meta->mem_ops, (unsigned char *)addr + base);
+  memset(&mem_region, 0, sizeof(mem_region));
   mem_region.offset = 0;
-  mem_region.size = size;
+  mem_region.size = size - base;
+  if (meta->options.mem_mirror_regions) {
+    // One region per flash region, each as large as the largest.
+    uint32_t region_size;
+    num_regions = record_intf_num_regions(flash_ri, &region_size);
+    mem_regions = calloc(num_regions, sizeof(*mem_regions));
+    if (mem_regions == NULL) {
+      return PBLOG_ERR_NO_SPACE;
+    }
+    for (i = 0; i < num_regions; ++i) {
+      mem_regions[i].offset = i * region_size;
+      mem_regions[i].size = region_size;
+    }
+  }
   mem_ri = (struct record_intf *)malloc(sizeof(struct record_intf));
-  record_intf_init(mem_ri, &mem_region, 1, &pblog_mem_ops);
+  if (mem_ri == NULL) {
+    rc = PBLOG_ERR_NO_SPACE;
+  } else {
+    memset(&mem_options, 0, sizeof(mem_options));
+    mem_options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+    mem_options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+    pblog_summary_options(&mem_options);
+    rc = record_intf_init_options(mem_ri, mem_regions, num_regions,
+                                  &meta->mem_ops, &mem_options);
+  }
+  if (mem_regions != &mem_region) {
+    free(mem_regions);
+  }
+  if (rc != PBLOG_SUCCESS) {
+    PBLOG_ERRF("pblog: failed to set up memlog: %d\n", rc);
+    free(mem_ri);
+    return rc;
+  }
+  meta->mem_ri = mem_ri;
 
-  // Initialize the contents of the mem log with the flash log.
-  rc = sync_events(flash_ri, mem_ri);
+  // Adopt the mem log left by a warm reboot if it still matches flash.
+  if (meta->options.mem_reuse && mem_stamp_matches(meta, mem_ri)) {
+    PBLOG_DPRINTF("pblog: reusing memlog\n");
+    return PBLOG_SUCCESS;
+  }
+  // Records left in memory would not line up with the flash regions, or
+  // are out of date.
+  if (meta->options.mem_mirror_regions || meta->options.mem_reuse) {
+    mem_ri->clear(mem_ri, 0);
+  }
+  empty = mem_ri->seek_end(mem_ri, &cursor) == 0 && cursor.offset == 0;
+
+  // Initialize the contents of the mem log with the flash log.  The events
+  // copied are all there is to count if the mem log started out empty.
+  rc = sync_events(flash_ri, mem_ri, meta->options.mem_mirror_regions);
   if (rc < 0) {
     PBLOG_ERRF("pblog: failed to initialize memlog\n");
+    meta->mem_stale = 1;
+  } else if (empty) {
+    meta->num_events = rc;
   }
 
-  return mem_ri;
-}
-
-static enum pblog_status count_events_callback(int valid,
-                                               const pblog_Event *event,
-                                               void *priv) {
-  int *count = priv;
-  (void)event;
-  if (valid) {
-    (*count)++;
-  }
   return PBLOG_SUCCESS;
 }
 
 // Check if this is a newly initialized log due to first time use or corruption.
 // If this is the first time write a clear event with the current timestamp.
+// The events are counted without decoding them, and with fast_init only
+// until the first one.
 static int pblog_first_time_init(struct pblog *pblog) {
-  int count = 0;
-  int rc = pblog_for_each_event_internal(pblog, count_events_callback, &count);
-  if (rc < 0) {
-    return rc;
+  struct pblog_metadata *meta = pblog->priv;
+  int count = meta->num_events;
+  int rc;
+  if (count < 0) {
+    count = count_events(meta, meta->options.fast_init ? 1 : 0);
+    if (count < 0) {
+      return count;
+    }
+    if (!meta->options.fast_init || count == 0) {
+      meta->num_events = count;
+    }
   }
   if (count == 0) {
     PBLOG_DPRINTF("pblog first time init\n");
@@ -294,33 +1211,187 @@ static int pblog_first_time_init(struct pblog *pblog) {
 
 int pblog_init(struct pblog *pblog, int allow_clear_on_add,
                struct record_intf *flash_ri, void *mem_addr, size_t mem_size) {
-  struct pblog_metadata *meta = malloc(sizeof(struct pblog_metadata));
+  struct pblog_options options;
+  memset(&options, 0, sizeof(options));
+  options.allow_clear_on_add = allow_clear_on_add;
+  options.mem_addr = mem_addr;
+  options.mem_size = mem_size;
+  return pblog_init_options(pblog, flash_ri, &options);
+}
+
+int pblog_init_options(struct pblog *pblog, struct record_intf *flash_ri,
+                       const struct pblog_options *options) {
+  struct pblog_metadata *meta;
+  int rc;
+  const size_t stamp_size =
+      options->mem_reuse ? sizeof(struct mem_stamp) : 0;
+
+  pblog->priv = NULL;
+  if (options->mem_reuse &&
+      (options->mem_addr == NULL || options->async_queue_size > 0 ||
+       options->mem_size <= stamp_size)) {
+    PBLOG_ERRF("pblog: mem_reuse requires a synchronous memory log\n");
+    return PBLOG_ERR_INVALID;
+  }
+  if (options->mem_mirror_regions) {
+    uint32_t region_size;
+    int num_regions = record_intf_num_regions(flash_ri, &region_size);
+    if (options->mem_addr == NULL || options->async_queue_size > 0 ||
+        options->mem_size < stamp_size + (size_t)num_regions * region_size) {
+      PBLOG_ERRF("pblog: cannot mirror %d regions of %u bytes in memory\n",
+                 num_regions, region_size);
+      return PBLOG_ERR_INVALID;
+    }
+  }
+  if (options->async_queue_size > 0) {
+#ifdef PBLOG_USE_PTHREADS
+    if (options->mem_addr == NULL) {
+      PBLOG_ERRF("pblog: async mode requires a memory log\n");
+      return PBLOG_ERR_INVALID;
+    }
+#else
+    PBLOG_ERRF("pblog: async mode requires PBLOG_USE_PTHREADS\n");
+    return PBLOG_ERR_INVALID;
+#endif
+  }
+  meta = malloc(sizeof(struct pblog_metadata));
   if (meta == NULL) {
     return PBLOG_ERR_NO_SPACE;
   }
 
   meta->flash_ri = flash_ri;
-  meta->allow_clear_on_add = allow_clear_on_add;
-  if (mem_addr != NULL) {
-    meta->mem_ri = pblog_init_memlog(mem_addr, mem_size, flash_ri);
-  } else {
-    meta->mem_ri = NULL;
+  meta->allow_clear_on_add = options->allow_clear_on_add;
+  meta->options = *options;
+  meta->async = 0;
+  meta->async_status = PBLOG_SUCCESS;
+  meta->num_events = -1;
+  meta->mem_stale = 0;
+  meta->mem_ri = NULL;
+  if (options->mem_addr != NULL) {
+    rc = pblog_init_memlog(meta, options->mem_addr, options->mem_size,
+                           flash_ri);
+    if (rc != PBLOG_SUCCESS) {
+      pblog_mem_ops_free(&meta->mem_ops);
+      free(meta);
+      return rc;
+    }
+    mem_stamp_update(meta);
   }
 
   pblog->priv = meta;
 
   pblog->add_event = pblog_add_event;
+  pblog->add_events = pblog_add_events;
   pblog->for_each_event = pblog_for_each_event;
+  pblog->for_each_event_reverse = pblog_for_each_event_reverse;
+  pblog->for_each_matching_event = pblog_for_each_matching_event;
   pblog->clear = pblog_clear;
 
+#ifdef PBLOG_USE_PTHREADS
+  if (options->async_queue_size > 0) {
+    meta->queue = malloc(options->async_queue_size);
+    if (meta->queue == NULL) {
+      goto fail;
+    }
+    meta->queue_head = 0;
+    meta->queue_len = 0;
+    meta->queue_count = 0;
+    meta->stop = 0;
+    meta->flash_full = 0;
+    pthread_mutex_init(&meta->flash_lock, NULL);
+    pthread_mutex_init(&meta->lock, NULL);
+    pthread_cond_init(&meta->cond, NULL);
+    if (pthread_create(&meta->worker, NULL, async_worker_main, meta) != 0) {
+      PBLOG_ERRF("pblog: failed to start the async worker\n");
+      pthread_cond_destroy(&meta->cond);
+      pthread_mutex_destroy(&meta->lock);
+      pthread_mutex_destroy(&meta->flash_lock);
+      free(meta->queue);
+      meta->queue = NULL;
+      goto fail;
+    }
+    meta->async = 1;
+  }
+#endif
+
   return pblog_first_time_init(pblog);
+
+#ifdef PBLOG_USE_PTHREADS
+fail:
+  // Leave nothing for pblog_free() to release.
+  pblog_free_memlog(meta);
+  free(meta);
+  pblog->priv = NULL;
+  return PBLOG_ERR_NO_SPACE;
+#endif
 }
 
-void pblog_free(struct pblog *pblog) {
+int pblog_event_count(struct pblog *pblog) {
+  struct pblog_metadata *meta = pblog->priv;
+  if (meta->num_events < 0) {
+    int rc = count_events(meta, 0);
+    if (rc < 0) {
+      return rc;
+    }
+    meta->num_events = rc;
+  }
+  return meta->num_events;
+}
+
+enum pblog_status pblog_flush(struct pblog *pblog) {
   struct pblog_metadata *meta = pblog->priv;
-  record_intf_free(meta->mem_ri);
-  free(meta->mem_ri);
-  pblog_mem_ops.priv = NULL;
+  int rc;
 
+  // Write out the clear events logged for cleared regions too.
+  while (flash_acquire(pblog)) {
+    rc = flash_release(pblog, 1);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+  rc = meta->flash_ri->flush(meta->flash_ri);
+  flash_release(pblog, 0);
+  if (rc < 0) {
+    return rc;
+  }
+
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->async) {
+    pthread_mutex_lock(&meta->lock);
+  }
+#endif
+  rc = meta->async_status;
+  meta->async_status = PBLOG_SUCCESS;
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->async) {
+    pthread_mutex_unlock(&meta->lock);
+  }
+#endif
+  return rc;
+}
+
+void pblog_free(struct pblog *pblog) {
+  struct pblog_metadata *meta = pblog->priv;
+  if (meta == NULL) {
+    return;
+  }
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->async) {
+    pthread_mutex_lock(&meta->lock);
+    meta->stop = 1;
+    pthread_cond_signal(&meta->cond);
+    pthread_mutex_unlock(&meta->lock);
+    pthread_join(meta->worker, NULL);
+    // Write out what is left on this thread, with the clear events of the
+    // regions cleared for it.
+    pblog_flush(pblog);
+    meta->async = 0;
+    pthread_cond_destroy(&meta->cond);
+    pthread_mutex_destroy(&meta->lock);
+    pthread_mutex_destroy(&meta->flash_lock);
+    free(meta->queue);
+  }
+#endif
+  pblog_free_memlog(meta);
   free(meta);
 }
@@ -14,31 +14,183 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
 #include <string.h>
+#ifdef PBLOG_USE_PTHREADS
+#include <pthread.h>
+#endif
 
+#include <pblog/checksum.h>
 #include <pblog/common.h>
 #include <pblog/flash.h>
 #include <pblog/record.h>
 
-unsigned char record_checksum(const void *buf, size_t len) {
-  unsigned char csum = 0;
-  const unsigned char *p = buf;
-  for (; p < (unsigned char *)(buf) + len; p++) {
-    csum += *p;
-  }
-  return csum;
-}
+// Offsets of the records in a region, built on demand for reading records
+// backwards and kept up to date by appends.
+struct region_index {
+  uint32_t *offsets;
+  int count;
+  int capacity;
+  int valid;  // set once offsets lists every record of the region
+};
+
+// In-memory state kept for each region.
+struct region_info {
+  enum record_format format;
+  struct region_index index;
+  // Set once the region is dropped from the log and waits to be erased.
+  int erase_pending;
+  uint32_t erase_offset;  // number of bytes of the region erased so far
+  // Summary of the records, with options.summary_size.  Set once it covers
+  // every record of the region.
+  unsigned char *summary;
+  int summary_valid;
+};
 
 struct log_metadata {
   struct record_region *regions;
+  struct region_info *info;  // indexed like regions
+  unsigned char *summaries;  // summary storage of all regions
   int num_regions;
   int used_regions;   // the number of regions in use
   int head_region;    // the first region (beginning of records)
   int next_sequence;  // next sequence number to use
+  // Byte offset of the first record in each used region, indexed from the
+  // head region.  Lets offsets be mapped to regions with a binary search.
+  int *region_start;
+  // Incremented whenever regions are cleared, invalidating cursors.
+  uint32_t generation;
+  // Number of record bytes dropped from the start of the log by clear(), used
+  // to move cursors back onto their record.
+  uint32_t dropped;
   struct pblog_flash_ops *flash;
+  struct record_intf_options options;
+  // Read-ahead window holding a copy of the flash range starting at
+  // read_ahead_offset, used by cursor reads.  Only holds bytes below the
+  // used size of a region, which appends do not modify.
+  unsigned char *read_ahead;
+  uint32_t read_ahead_offset;
+  uint32_t read_ahead_len;
+  // Write buffer holding the newest write_len bytes of records of
+  // write_region, which are counted in its used size but not yet on flash.
+  unsigned char *write_buf;
+  struct record_region *write_region;
+  size_t write_len;
+  int write_records;
+  // Program unit of the flash from its geometry, 1 if it has none.  Above 1
+  // the write buffer is flushed in whole units through program_buf.
+  uint32_t program_size;
+  unsigned char *program_buf;
+  // Region whose last, partly programmed unit starts at tail_offset and is
+  // kept at the start of program_buf.  NULL if not known.
+  struct record_region *tail_region;
+  uint32_t tail_offset;
+#ifdef PBLOG_USE_PTHREADS
+  // With the thread_safe option, operations reading records share the lock
+  // and the others hold it exclusively.  cache_lock serializes the readers'
+  // updates of the read-ahead window and the region indexes.
+  pthread_rwlock_t lock;
+  pthread_mutex_t cache_lock;
+#endif
 };
 
 const uint8_t record_magic[4] = {'R', 'E', 'C', 0xfe};
+// Magic of regions holding RECORD_FORMAT_CRC32C records.
+static const uint8_t record_magic_crc32c[4] = {'R', 'E', 'C', 0xfd};
+
+// Largest record header of all the record formats.
+#define RECORD_MAX_HEADER_SIZE sizeof(record_header_crc32c)
+
+// Returns the size of the record header used by a record format.
+static int record_header_size(enum record_format format) {
+  if (format == RECORD_FORMAT_CRC32C) {
+    return sizeof(record_header_crc32c);
+  }
+  return sizeof(record_header);
+}
+
+// Fills in the record header for a record of data.  Every header format
+// starts with the big-endian length of the record, including the header.
+static void record_header_init(enum record_format format, void *header,
+                               int record_size, const void *data, size_t len) {
+  if (format == RECORD_FORMAT_CRC32C) {
+    record_header_crc32c *h = header;
+    uint32_t crc;
+    h->length_lsb = record_size & 0xff;
+    h->length_msb = (record_size >> 8) & 0xff;
+    // The CRC covers the length and the record data.
+    crc = pblog_crc32c(0, h, offsetof(record_header_crc32c, crc));
+    crc = pblog_crc32c(crc, data, len);
+    h->crc[0] = crc & 0xff;
+    h->crc[1] = (crc >> 8) & 0xff;
+    h->crc[2] = (crc >> 16) & 0xff;
+    h->crc[3] = (crc >> 24) & 0xff;
+  } else {
+    record_header *h = header;
+    h->length_lsb = record_size & 0xff;
+    h->length_msb = (record_size >> 8) & 0xff;
+    // The checksum covers the entire record including the header.
+    h->checksum = 0;
+    h->checksum = -(record_checksum(h, sizeof(*h)) +
+                    record_checksum(data, len));
+  }
+}
+
+// Returns 0 if the record header matches the record data.
+static int record_verify(enum record_format format, const void *header,
+                         const void *data, size_t len) {
+  if (format == RECORD_FORMAT_CRC32C) {
+    const record_header_crc32c *h = header;
+    uint32_t crc = pblog_crc32c(0, h, offsetof(record_header_crc32c, crc));
+    crc = pblog_crc32c(crc, data, len);
+    return crc != (h->crc[0] | h->crc[1] << 8 | h->crc[2] << 16 |
+                   (uint32_t)h->crc[3] << 24);
+  }
+  return (unsigned char)(record_checksum(header, sizeof(record_header)) +
+                         record_checksum(data, len)) != 0;
+}
+
+// Records up to this size are assembled on the stack and written in a single
+// operation on flash backends without writev.
+#define RECORD_COALESCE_SIZE 256
+
+// Writes the buffers to consecutive flash locations, combining them into a
+// single write when possible.  Returns the number of bytes written.
+static int flash_writev(struct pblog_flash_ops *flash, int offset,
+                        const struct pblog_flash_iovec *iov, int iovcnt) {
+  unsigned char buf[RECORD_COALESCE_SIZE];
+  size_t total = 0;
+  int i;
+
+  if (flash->writev) {
+    return flash->writev(flash, offset, iov, iovcnt);
+  }
+
+  for (i = 0; i < iovcnt; ++i) {
+    total += iov[i].len;
+  }
+  if (total <= sizeof(buf)) {
+    total = 0;
+    for (i = 0; i < iovcnt; ++i) {
+      memcpy(buf + total, iov[i].data, iov[i].len);
+      total += iov[i].len;
+    }
+    return flash->write(flash, offset, total, buf);
+  }
+
+  total = 0;
+  for (i = 0; i < iovcnt; ++i) {
+    int rc = flash->write(flash, offset + total, iov[i].len, iov[i].data);
+    if (rc < 0) {
+      return rc;
+    }
+    total += rc;
+    if (rc != iov[i].len) {
+      break;
+    }
+  }
+  return total;
+}
 
 // Helper to return the i-th region starting from the head region.
 struct record_region *region_at(struct log_metadata *meta, int i) {
@@ -49,17 +201,302 @@ struct record_region *region_at(struct log_metadata *meta, int i) {
   return &meta->regions[(meta->head_region + i) % meta->num_regions];
 }
 
+// Returns the region_info entry of a region.
+static struct region_info *region_info(struct log_metadata *meta,
+                                       const struct record_region *region) {
+  return &meta->info[region - meta->regions];
+}
+
+// Returns the record format of a region.
+static enum record_format region_format(struct log_metadata *meta,
+                                        const struct record_region *region) {
+  return region_info(meta, region)->format;
+}
+
+// Adds the offset of a record to a region index.  The index is dropped if
+// it cannot grow, to be rebuilt when next needed.
+static void region_index_add(struct region_index *index, uint32_t offset) {
+  if (!index->valid) {
+    return;
+  }
+  if (index->count == index->capacity) {
+    int capacity = index->capacity ? index->capacity * 2 : 64;
+    uint32_t *offsets =
+        realloc(index->offsets, sizeof(*index->offsets) * capacity);
+    if (offsets == NULL) {
+      index->valid = 0;
+      return;
+    }
+    index->offsets = offsets;
+    index->capacity = capacity;
+  }
+  index->offsets[index->count++] = offset;
+}
+
+// Empties a region index.  valid tells whether the region is now empty, so
+// that the empty index is complete.
+static void region_index_reset(struct region_index *index, int valid) {
+  index->count = 0;
+  index->valid = valid;
+}
+
+// Returns the number of record bytes stored in a region.
+static int region_data_size(const struct record_region *region) {
+  if (region->used_size < sizeof(struct region_header)) {
+    return 0;
+  }
+  return region->used_size - sizeof(struct region_header);
+}
+
+// Empties the summary of a region.  valid tells whether the region is now
+// empty, so that the empty summary is complete.
+static void region_summary_reset(struct log_metadata *meta,
+                                 const struct record_region *region,
+                                 int valid) {
+  struct region_info *info = region_info(meta, region);
+  if (info->summary != NULL) {
+    memset(info->summary, 0, meta->options.summary_size);
+    info->summary_valid = valid;
+  }
+}
+
+// Adds an appended record to the summary of its region, unless the summary
+// is still to be built from the records on flash.
+static void region_summary_add(struct log_metadata *meta,
+                               const struct record_region *region,
+                               const void *data, size_t len) {
+  struct region_info *info = region_info(meta, region);
+  if (info->summary != NULL && info->summary_valid) {
+    meta->options.summarize(info->summary, data, len,
+                            meta->options.summary_priv);
+  }
+}
+
+// Recomputes the offset of the first record of every used region.
+static void log_update_region_start(struct log_metadata *meta) {
+  int i;
+  meta->region_start[0] = 0;
+  for (i = 1; i < meta->used_regions; ++i) {
+    meta->region_start[i] =
+        meta->region_start[i - 1] + region_data_size(region_at(meta, i - 1));
+  }
+}
+
+// Returns the index of the used region containing a record offset.  Offsets
+// past the end of the log map to the last used region.
+static int log_find_region(struct log_metadata *meta, int offset) {
+  int low = 0;
+  int high = meta->used_regions - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (meta->region_start[mid] <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+}
+
+static void log_cache_lock(struct log_metadata *meta) {
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->options.thread_safe) {
+    pthread_mutex_lock(&meta->cache_lock);
+  }
+#endif
+}
+
+static void log_cache_unlock(struct log_metadata *meta) {
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->options.thread_safe) {
+    pthread_mutex_unlock(&meta->cache_lock);
+  }
+#endif
+}
+
+// Returns 1 if the read-ahead window holds len bytes of flash at start.
+static int read_ahead_contains(struct log_metadata *meta, uint32_t start,
+                               size_t len) {
+  return start >= meta->read_ahead_offset &&
+         start + len <= meta->read_ahead_offset + meta->read_ahead_len;
+}
+
+// Returns the number of bytes of a region that are on flash: its used size
+// minus the records still in the write buffer.
+static uint32_t region_flushed_size(struct log_metadata *meta,
+                                    const struct record_region *region) {
+  if (region == meta->write_region) {
+    return region->used_size - meta->write_len;
+  }
+  return region->used_size;
+}
+
+// Writes len bytes of records at start of a region in whole program units:
+// the bytes already programmed in the first unit, the records, then erased
+// bytes up to the end of the last unit.  Returns len on success.
+static int region_program(struct log_metadata *meta,
+                          struct record_region *region, uint32_t start,
+                          size_t len, const void *data) {
+  const uint32_t unit = meta->program_size;
+  const uint32_t first = start - start % unit;
+  const uint32_t prefix = start - first;
+  const uint32_t end = start + len;
+  size_t span = (prefix + len + unit - 1) / unit * unit;
+  int rc;
+
+  if (prefix > 0 &&
+      (meta->tail_region != region || meta->tail_offset != first)) {
+    rc = meta->flash->read(meta->flash, region->offset + first, prefix,
+                           meta->program_buf);
+    if (rc != prefix) {
+      meta->tail_region = NULL;
+      return rc < 0 ? rc : PBLOG_ERR_IO;
+    }
+  }
+  if (first + span > region->size) {
+    span = region->size - first;
+  }
+  memcpy(meta->program_buf + prefix, data, len);
+  memset(meta->program_buf + prefix + len, 0xff, span - prefix - len);
+
+  meta->tail_region = NULL;
+  rc = meta->flash->write(meta->flash, region->offset + first, span,
+                          meta->program_buf);
+  if (rc != span) {
+    return rc < 0 ? rc : PBLOG_ERR_IO;
+  }
+  if (end % unit != 0) {
+    memmove(meta->program_buf, meta->program_buf + (end - end % unit - first),
+            end % unit);
+    meta->tail_region = region;
+    meta->tail_offset = end - end % unit;
+  }
+  return len;
+}
+
+// Writes out the records in the write buffer.  If they cannot be written
+// they are dropped from the log.
+static int write_buffer_flush(struct log_metadata *meta) {
+  struct record_region *region = meta->write_region;
+  struct region_index *index;
+  uint32_t start;
+  int rc;
+
+  if (meta->write_len == 0) {
+    return PBLOG_SUCCESS;
+  }
+
+  start = region_flushed_size(meta, region);
+  if (meta->program_size > 1) {
+    rc = region_program(meta, region, start, meta->write_len,
+                        meta->write_buf);
+  } else {
+    rc = meta->flash->write(meta->flash, region->offset + start,
+                            meta->write_len, meta->write_buf);
+  }
+  if (rc != meta->write_len) {
+    PBLOG_ERRF("write buffer flush error: %d, dropping %d records\n", rc,
+               meta->write_records);
+    region->used_size = start;
+    index = &region_info(meta, region)->index;
+    while (index->count > 0 && index->offsets[index->count - 1] >= start) {
+      index->count--;
+    }
+    // The region may no longer be the tail, so the regions after it move
+    // and cursors have to find their records again.
+    log_update_region_start(meta);
+    meta->generation++;
+    rc = rc < 0 ? rc : PBLOG_ERR_IO;
+  } else {
+    rc = PBLOG_SUCCESS;
+  }
+
+  meta->write_len = 0;
+  meta->write_records = 0;
+  meta->write_region = NULL;
+  return rc;
+}
+
+// Loads the read-ahead window with up to read_ahead_size bytes of the records
+// of a region starting at offset.  Returns 0 if the window now holds len bytes
+// at offset.
+static int region_fill_read_ahead(struct log_metadata *meta,
+                                  struct record_region *region,
+                                  uint32_t offset, size_t len) {
+  const uint32_t flushed = region_flushed_size(meta, region);
+  size_t fill;
+  int rc;
+
+  fill = offset < flushed ? flushed - offset : 0;
+  if (fill > meta->options.read_ahead_size) {
+    fill = meta->options.read_ahead_size;
+  }
+  if (meta->read_ahead == NULL || len > fill) {
+    return PBLOG_ERR_NO_SPACE;
+  }
+
+  meta->read_ahead_len = 0;
+  rc = meta->flash->read(meta->flash, region->offset + offset, fill,
+                         meta->read_ahead);
+  if (rc != fill) {
+    return rc < 0 ? rc : PBLOG_ERR_IO;
+  }
+  meta->read_ahead_offset = region->offset + offset;
+  meta->read_ahead_len = fill;
+
+  // Let the backend read the next window while this one is parsed.
+  if (meta->flash->prefetch != NULL && offset + fill < flushed) {
+    size_t next = flushed - (offset + fill);
+    if (next > meta->options.read_ahead_size) {
+      next = meta->options.read_ahead_size;
+    }
+    meta->flash->prefetch(meta->flash, region->offset + offset + fill, next);
+  }
+  return PBLOG_SUCCESS;
+}
+
+// Reads from a region like flash->read(), through the read-ahead window if
+// read_ahead is set.  Records still in the write buffer are read from it.
+static int region_read(struct log_metadata *meta, struct record_region *region,
+                       uint32_t offset, size_t len, void *data,
+                       int read_ahead) {
+  const uint32_t start = region->offset + offset;
+  const uint32_t flushed = region_flushed_size(meta, region);
+
+  if (region == meta->write_region && offset >= flushed &&
+      offset + len <= region->used_size) {
+    memcpy(data, meta->write_buf + (offset - flushed), len);
+    return len;
+  }
+
+  if (read_ahead && meta->read_ahead != NULL) {
+    log_cache_lock(meta);
+    if (read_ahead_contains(meta, start, len) ||
+        region_fill_read_ahead(meta, region, offset, len) == PBLOG_SUCCESS) {
+      memcpy(data, meta->read_ahead + (start - meta->read_ahead_offset), len);
+      log_cache_unlock(meta);
+      return len;
+    }
+    log_cache_unlock(meta);
+  }
+  return meta->flash->read(meta->flash, start, len, data);
+}
+
 // Reads a record within a region.
 // Args:
 //   offset: byte offset within region
 //   next_offset: set to the offset of the next record
 //   len: maximum data length to read, updated with actual read data length
 //   data: data buffer to write
+//   read_ahead: read through the read-ahead window
 static int region_read_record(struct log_metadata *meta,
                               struct record_region *region, int offset,
-                              int *next_offset, size_t *len, void *data) {
+                              int *next_offset, size_t *len, void *data,
+                              int read_ahead) {
   int rc;
-  record_header header;
+  const enum record_format format = region_format(meta, region);
+  const int header_size = record_header_size(format);
+  unsigned char header[RECORD_MAX_HEADER_SIZE];
   int length;
   int data_length;
 
@@ -67,19 +504,18 @@ static int region_read_record(struct log_metadata *meta,
 
   *next_offset = 0;
 
-  if (offset > region->size - sizeof(header)) {
+  if (offset > (int)region->size - header_size) {
     return PBLOG_ERR_INVALID;
   }
 
   // Read in the record header.
-  rc = meta->flash->read(meta->flash, region->offset + offset, sizeof(header),
-                         &header);
-  if (rc != sizeof(header)) {
+  rc = region_read(meta, region, offset, header_size, header, read_ahead);
+  if (rc != header_size) {
     return rc < 0 ? rc : PBLOG_ERR_IO;
   }
 
   // End of log?
-  length = header.length_lsb | (header.length_msb << 8);
+  length = header[1] | (header[0] << 8);
   if (length == 0 || length == 0xffff) {
     if (len) {
       *len = 0;
@@ -87,7 +523,7 @@ static int region_read_record(struct log_metadata *meta,
     return PBLOG_SUCCESS;
   }
 
-  data_length = length - sizeof(header);
+  data_length = length - header_size;
 
   if (length > region->size - offset) {
     PBLOG_ERRF("bad record length found at offset %d: %d\n", offset, length);
@@ -106,19 +542,15 @@ static int region_read_record(struct log_metadata *meta,
 
     // Read in the record data.
     if (data != NULL) {
-      unsigned char checksum;
-      rc = meta->flash->read(meta->flash,
-                             region->offset + offset + sizeof(header),
-                             data_length, data);
+      rc = region_read(meta, region, offset + header_size, data_length, data,
+                       read_ahead);
       if (rc != data_length) {
         *len = rc > 0 ? rc : 0;
         return rc < 0 ? rc : PBLOG_ERR_IO;
       }
-      checksum = record_checksum(&header, sizeof(header)) +
-                 record_checksum(data, data_length);
-      if (checksum != 0) {
-        PBLOG_ERRF("checksum failure record off:%d, checksum: %d\n", offset,
-                   checksum);
+      if (record_verify(format, header, data, data_length) != 0) {
+        PBLOG_ERRF("checksum failure record off:%d, format: %d\n", offset,
+                   format);
         rc = PBLOG_ERR_CHECKSUM;
       }
     }
@@ -130,26 +562,22 @@ static int region_read_record(struct log_metadata *meta,
 static int log_read_record(struct record_intf *ri, int offset, int *next_offset,
                            size_t *len, void *data) {
   struct log_metadata *meta = ri->priv;
-
-  // Determine the region that contains this offset.
+  struct record_region *region;
   int i;
-  struct record_region *region = NULL;
-  for (i = 0; i < meta->used_regions; ++i) {
-    // Account for the region header at the beginning of each region.
-    offset += sizeof(struct region_header);
 
-    region = region_at(meta, i);
-    if (offset < region->used_size) {
-      break;
-    }
-    offset -= region->used_size;
-  }
-  if (region == NULL) {
+  if (offset < 0) {
     return PBLOG_ERR_INVALID;
   }
-  if (i >= meta->used_regions) {
+
+  // Determine the region that contains this offset, accounting for the region
+  // header at the beginning of each region.
+  i = log_find_region(meta, offset);
+  region = region_at(meta, i);
+  offset += sizeof(struct region_header) - meta->region_start[i];
+  if (offset >= region->used_size) {
     // Check for end of log (reading last record one past end).
     // Return success in that case, set next_offset to 0.
+    offset -= region->used_size;
     if (offset == 0 || offset == region->used_size) {
       *next_offset = 0;
       if (len) {
@@ -157,92 +585,597 @@ static int log_read_record(struct record_intf *ri, int offset, int *next_offset,
       }
       return PBLOG_SUCCESS;
     }
-    return PBLOG_ERR_INVALID;
+    return PBLOG_ERR_INVALID;
+  }
+
+  return region_read_record(meta, region, offset, next_offset, len, data, 0);
+}
+
+// Positions a cursor at a record offset.
+static void cursor_seek(struct log_metadata *meta,
+                        struct record_cursor *cursor, int offset) {
+  int i = log_find_region(meta, offset);
+  cursor->offset = offset;
+  cursor->region = i;
+  cursor->region_offset =
+      offset + sizeof(struct region_header) - meta->region_start[i];
+  cursor->generation = meta->generation;
+  cursor->dropped = meta->dropped;
+}
+
+// Re-positions a cursor after regions were cleared.  The cursor stays on its
+// record, or moves to the oldest record if its record was cleared.
+static void cursor_rebase(struct log_metadata *meta,
+                          struct record_cursor *cursor) {
+  uint32_t dropped = meta->dropped - cursor->dropped;
+  if (dropped <= (uint32_t)cursor->offset) {
+    cursor_seek(meta, cursor, cursor->offset - dropped);
+  } else {
+    cursor_seek(meta, cursor, 0);
+  }
+}
+
+// Drops the read-ahead window so that a new scan reads fresh flash contents.
+static void log_drop_read_ahead(struct log_metadata *meta) {
+  log_cache_lock(meta);
+  meta->read_ahead_len = 0;
+  log_cache_unlock(meta);
+}
+
+static int log_seek(struct record_intf *ri, struct record_cursor *cursor,
+                    int offset) {
+  struct log_metadata *meta = ri->priv;
+
+  if (offset < 0) {
+    return PBLOG_ERR_INVALID;
+  }
+
+  log_drop_read_ahead(meta);
+  cursor_seek(meta, cursor, offset);
+  return PBLOG_SUCCESS;
+}
+
+static int log_read_next(struct record_intf *ri, struct record_cursor *cursor,
+                         int *next_offset, size_t *len, void *data) {
+  struct log_metadata *meta = ri->priv;
+  struct record_region *region;
+  int rc;
+
+  *next_offset = 0;
+  if (cursor->generation != meta->generation) {
+    cursor_rebase(meta, cursor);
+  }
+
+  // Move on to the next region once all records of this one are read.
+  region = region_at(meta, cursor->region);
+  while (cursor->region_offset >= region->used_size) {
+    if (cursor->region + 1 >= meta->used_regions) {
+      if (len) {
+        *len = 0;
+      }
+      return PBLOG_SUCCESS;
+    }
+    cursor->region++;
+    cursor->region_offset = sizeof(struct region_header);
+    region = region_at(meta, cursor->region);
+  }
+
+  rc = region_read_record(meta, region, cursor->region_offset, next_offset,
+                          len, data, 1);
+  cursor->offset += *next_offset;
+  cursor->region_offset += *next_offset;
+  return rc;
+}
+
+static int log_seek_end(struct record_intf *ri, struct record_cursor *cursor) {
+  struct log_metadata *meta = ri->priv;
+  const int last = meta->used_regions - 1;
+  log_drop_read_ahead(meta);
+  cursor_seek(meta, cursor,
+              meta->region_start[last] +
+                  region_data_size(region_at(meta, last)));
+  return PBLOG_SUCCESS;
+}
+
+// Largest record data length, as limited by the 16-bit record length.
+#define RECORD_MAX_DATA_SIZE 0xffff
+
+// Builds the summary of a region from its records.  Corrupt records are left
+// out.  The summary is built aside and installed under the cache lock, as
+// several readers may build it at once.
+static int region_build_summary(struct log_metadata *meta,
+                                struct record_region *region) {
+  struct region_info *info = region_info(meta, region);
+  unsigned char *summary = calloc(1, meta->options.summary_size);
+  unsigned char *buf = malloc(RECORD_MAX_DATA_SIZE);
+  int offset = sizeof(struct region_header);
+  int rc = PBLOG_SUCCESS;
+
+  if (summary == NULL || buf == NULL) {
+    free(buf);
+    free(summary);
+    return PBLOG_ERR_NO_SPACE;
+  }
+  while (offset < region->used_size) {
+    size_t len = RECORD_MAX_DATA_SIZE;
+    int next_offset;
+    rc = region_read_record(meta, region, offset, &next_offset, &len, buf, 1);
+    if (rc == PBLOG_SUCCESS && next_offset != 0) {
+      meta->options.summarize(summary, buf, len, meta->options.summary_priv);
+    } else if (rc != PBLOG_ERR_CHECKSUM) {
+      break;
+    }
+    rc = PBLOG_SUCCESS;
+    offset += next_offset;
+  }
+
+  if (rc == PBLOG_SUCCESS) {
+    log_cache_lock(meta);
+    memcpy(info->summary, summary, meta->options.summary_size);
+    info->summary_valid = 1;
+    log_cache_unlock(meta);
+  }
+  free(buf);
+  free(summary);
+  return rc;
+}
+
+// Returns 1 if skip() rejects a region, 0 if it must be read or <0 on failure
+// to build its summary.
+static int region_skip(struct log_metadata *meta, struct record_region *region,
+                       record_skip_fn skip, void *priv) {
+  struct region_info *info = region_info(meta, region);
+  int rc;
+
+  log_cache_lock(meta);
+  if (!info->summary_valid) {
+    log_cache_unlock(meta);
+    rc = region_build_summary(meta, region);
+    if (rc < 0) {
+      return rc;
+    }
+    log_cache_lock(meta);
+  }
+  rc = skip(info->summary, priv) != 0;
+  log_cache_unlock(meta);
+  return rc;
+}
+
+static int log_skip_regions(struct record_intf *ri,
+                            struct record_cursor *cursor, record_skip_fn skip,
+                            void *priv) {
+  struct log_metadata *meta = ri->priv;
+  struct record_region *region;
+  int skipped = 0;
+  int rc = PBLOG_SUCCESS;
+
+  if (meta->summaries == NULL) {
+    return 0;
+  }
+  if (cursor->generation != meta->generation) {
+    cursor_rebase(meta, cursor);
+  }
+
+  region = region_at(meta, cursor->region);
+  while (1) {
+    // Move on to the next region once all records of this one are read.
+    if (cursor->region_offset >= region->used_size) {
+      if (cursor->region + 1 >= meta->used_regions) {
+        break;
+      }
+      cursor->region++;
+      cursor->region_offset = sizeof(struct region_header);
+      region = region_at(meta, cursor->region);
+      continue;
+    }
+    // Only whole regions are skipped.
+    if (cursor->region_offset != sizeof(struct region_header)) {
+      break;
+    }
+    rc = region_skip(meta, region, skip, priv);
+    if (rc <= 0) {
+      break;
+    }
+    skipped++;
+    cursor->region_offset = region->used_size;
+  }
+
+  cursor->offset = meta->region_start[cursor->region] +
+                   cursor->region_offset - sizeof(struct region_header);
+  return rc < 0 ? rc : skipped;
+}
+
+static struct region_index *region_get_index(struct log_metadata *meta,
+                                             struct record_region *region);
+
+// Returns the offset of the last record of a region starting before
+// region_offset, building the region index if needed.
+static int region_find_prev(struct log_metadata *meta,
+                            struct record_region *region, int region_offset) {
+  struct region_index *index = region_get_index(meta, region);
+  int low = 0;
+  int high = index->count - 1;
+
+  if (!index->valid) {
+    return PBLOG_ERR_NO_SPACE;
+  }
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (index->offsets[mid] < region_offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  if (index->count == 0 || index->offsets[low] >= region_offset) {
+    return PBLOG_ERR_INVALID;
+  }
+  return index->offsets[low];
+}
+
+static int log_read_prev(struct record_intf *ri, struct record_cursor *cursor,
+                         int *prev_offset, size_t *len, void *data) {
+  struct log_metadata *meta = ri->priv;
+  struct record_region *region;
+  int offset;
+  int next_offset;
+
+  *prev_offset = 0;
+  if (cursor->generation != meta->generation) {
+    cursor_rebase(meta, cursor);
+  }
+
+  // Move back to the previous region once at the start of this one.
+  region = region_at(meta, cursor->region);
+  while (cursor->region_offset <= sizeof(struct region_header)) {
+    if (cursor->region == 0) {
+      if (len) {
+        *len = 0;
+      }
+      return PBLOG_SUCCESS;
+    }
+    cursor->region--;
+    region = region_at(meta, cursor->region);
+    cursor->region_offset = region->used_size;
+  }
+
+  log_cache_lock(meta);
+  offset = region_find_prev(meta, region, cursor->region_offset);
+  // Read ahead backwards: load the window so that it ends with this record.
+  if (offset >= 0 &&
+      cursor->region_offset - offset <= meta->options.read_ahead_size &&
+      !read_ahead_contains(meta, region->offset + offset,
+                           cursor->region_offset - offset)) {
+    int start = cursor->region_offset - (int)meta->options.read_ahead_size;
+    if (start < (int)sizeof(struct region_header)) {
+      start = sizeof(struct region_header);
+    }
+    region_fill_read_ahead(meta, region, start,
+                           cursor->region_offset - start);
+  }
+  log_cache_unlock(meta);
+  if (offset < 0) {
+    return offset;
+  }
+
+  *prev_offset = cursor->region_offset - offset;
+  cursor->offset -= *prev_offset;
+  cursor->region_offset = offset;
+  return region_read_record(meta, region, cursor->region_offset,
+                            &next_offset, len, data, 1);
+}
+
+static int region_append(struct log_metadata *meta,
+                         struct record_region *region, size_t len,
+                         const void *data) {
+  int rc;
+  const enum record_format format = region_format(meta, region);
+  unsigned char header[RECORD_MAX_HEADER_SIZE];
+  struct pblog_flash_iovec iov[2];
+
+  int record_size = len + record_header_size(format);
+  if (record_size > (region->size - region->used_size)) {
+    PBLOG_ERRF("region rseq %d full\n", region->sequence);
+    return PBLOG_ERR_NO_SPACE;
+  }
+
+  record_header_init(format, header, record_size, data, len);
+
+  // The write buffer only holds records of a single region.
+  if (meta->write_region != region ||
+      meta->write_len + record_size > meta->options.write_buffer_size) {
+    rc = write_buffer_flush(meta);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+
+  if (meta->write_buf != NULL &&
+      record_size <= meta->options.write_buffer_size) {
+    // Collect the record in the write buffer.
+    memcpy(meta->write_buf + meta->write_len, header,
+           record_header_size(format));
+    memcpy(meta->write_buf + meta->write_len + record_header_size(format),
+           data, len);
+    meta->write_region = region;
+    meta->write_len += record_size;
+    meta->write_records++;
+  } else {
+    // Write out the header and record together.
+    iov[0].data = header;
+    iov[0].len = record_header_size(format);
+    iov[1].data = data;
+    iov[1].len = len;
+    if (meta->tail_region == region) {
+      meta->tail_region = NULL;
+    }
+    rc = flash_writev(meta->flash, region->offset + region->used_size, iov,
+                      2);
+    if (rc != record_size) {
+      PBLOG_ERRF("record write error: %d\n", rc);
+      return rc < 0 ? rc : PBLOG_ERR_IO;
+    }
+  }
+
+  // Adjust the metadata.
+  region_index_add(&region_info(meta, region)->index, region->used_size);
+  region->used_size += record_size;
+
+  // Apply the flush policy.
+  if ((meta->options.flush_bytes != 0 &&
+       meta->write_len >= meta->options.flush_bytes) ||
+      (meta->options.flush_records != 0 &&
+       meta->write_records >= meta->options.flush_records)) {
+    rc = write_buffer_flush(meta);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+  return record_size;
+}
+
+// Maximum number of records handed to a single flash write by append_batch.
+#define RECORD_BATCH_RECORDS 32
+
+// Appends the leading records of a batch that fit in a region.  Records go
+// through the write buffer if there is one, otherwise up to
+// RECORD_BATCH_RECORDS of them are written together.  Returns the number of
+// records appended, or <0 on failure to append the first one.
+static int region_append_batch(struct log_metadata *meta,
+                               struct record_region *region, int count,
+                               const size_t *lens, const unsigned char *data) {
+  const enum record_format format = region_format(meta, region);
+  const int header_size = record_header_size(format);
+  unsigned char headers[RECORD_BATCH_RECORDS][RECORD_MAX_HEADER_SIZE];
+  struct pblog_flash_iovec iov[2 * RECORD_BATCH_RECORDS];
+  uint32_t end = region->used_size;
+  int n;
+  int rc;
+  int i;
+
+  if (meta->write_buf != NULL) {
+    for (n = 0; n < count; ++n) {
+      if (n > 0 && lens[n] + header_size > region->size - region->used_size) {
+        break;
+      }
+      rc = region_append(meta, region, lens[n], data);
+      if (rc < 0) {
+        return n > 0 ? n : rc;
+      }
+      data += lens[n];
+    }
+    return n;
+  }
+
+  for (n = 0; n < count && n < RECORD_BATCH_RECORDS; ++n) {
+    int record_size = lens[n] + header_size;
+    if (record_size > region->size - end) {
+      break;
+    }
+    record_header_init(format, headers[n], record_size, data, lens[n]);
+    iov[2 * n].data = headers[n];
+    iov[2 * n].len = header_size;
+    iov[2 * n + 1].data = data;
+    iov[2 * n + 1].len = lens[n];
+    data += lens[n];
+    end += record_size;
+  }
+  if (n == 0) {
+    PBLOG_ERRF("region rseq %d full\n", region->sequence);
+    return PBLOG_ERR_NO_SPACE;
+  }
+
+  rc = flash_writev(meta->flash, region->offset + region->used_size, iov,
+                    2 * n);
+  if (rc != end - region->used_size) {
+    PBLOG_ERRF("record write error: %d\n", rc);
+    return rc < 0 ? rc : PBLOG_ERR_IO;
+  }
+  for (i = 0; i < n; ++i) {
+    region_index_add(&region_info(meta, region)->index, region->used_size);
+    region->used_size += lens[i] + header_size;
+  }
+  return n;
+}
+
+static int region_erase_step(struct log_metadata *meta,
+                             struct record_region *region, int *max_chunks);
+
+// Continues erasing regions dropped from the log, oldest first.  Returns the
+// number of regions still waiting to be erased, or <0 on failure.
+static int log_erase_pending_chunks(struct log_metadata *meta,
+                                    int *max_chunks) {
+  int pending = 0;
+  int i;
+  for (i = meta->used_regions; i < meta->num_regions; ++i) {
+    struct record_region *region = region_at(meta, i);
+    if (region_info(meta, region)->erase_pending) {
+      int rc = region_erase_step(meta, region, max_chunks);
+      if (rc < 0) {
+        return rc;
+      }
+      pending += region_info(meta, region)->erase_pending;
+    }
+  }
+  return pending;
+}
+
+static int log_erase_pending(struct record_intf *ri, int max_chunks) {
+  return log_erase_pending_chunks(ri->priv, &max_chunks);
+}
+
+// Moves the tail to the next free region.
+static int log_next_region(struct log_metadata *meta) {
+  struct record_region *tail_region = region_at(meta, meta->used_regions - 1);
+  struct record_region *next;
+
+  if (meta->used_regions >= meta->num_regions - meta->options.spare_regions) {
+    PBLOG_ERRF("log full: %d used regions, %d used bytes in tail\n",
+               meta->used_regions, tail_region->used_size);
+    return PBLOG_ERR_NO_SPACE;
+  }
+  next = region_at(meta, meta->used_regions);
+  // Finish erasing the next region if the background erase fell behind.
+  if (region_info(meta, next)->erase_pending) {
+    int rc = region_erase_step(meta, next, NULL);
+    if (rc < 0) {
+      return rc;
+    }
+  }
+  meta->region_start[meta->used_regions] =
+      meta->region_start[meta->used_regions - 1] +
+      region_data_size(tail_region);
+  meta->used_regions++;
+  return PBLOG_SUCCESS;
+}
+
+// Returns 1 if a record of len bytes fits in what is left of a region.
+static int region_fits(struct log_metadata *meta,
+                       const struct record_region *region, size_t len) {
+  return len + record_header_size(region_format(meta, region)) <=
+         region->size - region->used_size;
+}
+
+// Finds the region to append a record of len bytes to, moving on to the
+// next free region if the tail region cannot take it.
+static int log_tail_region(struct log_metadata *meta, size_t len,
+                           struct record_region **region) {
+  // Check if we need to go to the next free region.
+  if (!region_fits(meta, region_at(meta, meta->used_regions - 1), len)) {
+    int rc = log_next_region(meta);
+    if (rc < 0) {
+      return rc;
+    }
   }
 
-  return region_read_record(meta, region, offset, next_offset, len, data);
+  *region = region_at(meta, meta->used_regions - 1);
+  return PBLOG_SUCCESS;
 }
 
-static int region_append(struct log_metadata *meta,
-                         struct record_region *region, size_t len,
-                         const void *data) {
-  int rc;
-  record_header header;
+static int log_append(struct record_intf *ri, size_t len, const void *data) {
+  struct log_metadata *meta = ri->priv;
+  struct record_region *tail_region;
 
-  int record_size = len + sizeof(record_header);
-  if (record_size > (region->size - region->used_size)) {
-    PBLOG_ERRF("region rseq %d full\n", region->sequence);
-    return PBLOG_ERR_NO_SPACE;
+  int rc = log_tail_region(meta, len, &tail_region);
+  if (rc < 0) {
+    return rc;
   }
 
-  // Update and write out the header.
-  header.length_lsb = record_size & 0xff;
-  header.length_msb = (record_size >> 8) & 0xff;
-  // The checksum covers the entire record including the header.
-  header.checksum = 0;
-  header.checksum =
-      -(record_checksum(&header, sizeof(header)) + record_checksum(data, len));
-
-  // Write out the header then record.
-  rc = meta->flash->write(meta->flash, region->offset + region->used_size,
-                          sizeof(header), &header);
-  if (rc != sizeof(header)) {
-    PBLOG_ERRF("header write error: %d\n", rc);
-    return rc < 0 ? rc : PBLOG_ERR_IO;
+  rc = region_append(meta, tail_region, len, data);
+  if (rc >= 0) {
+    region_summary_add(meta, tail_region, data, len);
   }
-  rc = meta->flash->write(meta->flash,
-                          region->offset + region->used_size + sizeof(header),
-                          len, data);
-  if (rc != len) {
-    PBLOG_ERRF("data write error: %d\n", rc);
-    return rc < 0 ? rc : PBLOG_ERR_IO;
+  if (rc >= 0 && meta->options.erase_chunks_per_append > 0) {
+    int max_chunks = meta->options.erase_chunks_per_append;
+    log_erase_pending_chunks(meta, &max_chunks);
   }
-
-  // Adjust the metadata.
-  region->used_size += record_size;
-  return record_size;
+  return rc;
 }
 
-static int log_append(struct record_intf *ri, size_t len, const void *data) {
+static int log_append_batch(struct record_intf *ri, int count,
+                            const size_t *lens, const void *data) {
   struct log_metadata *meta = ri->priv;
+  const unsigned char *next = data;
+  int done = 0;
+  int rc = PBLOG_SUCCESS;
+  int i;
 
-  // Check which region we can fit into.
-  int record_size = len + sizeof(record_header);
+  struct record_region *tail_region;
 
-  struct record_region *tail_region = region_at(meta, meta->used_regions - 1);
-  // Check if we need to go to the next free region.
-  if (record_size > tail_region->size - tail_region->used_size) {
-    if (meta->used_regions < meta->num_regions) {
-      meta->used_regions++;
-      tail_region = region_at(meta, meta->used_regions - 1);
-    } else {
-      PBLOG_ERRF("log full: %d used regions, %d used bytes in tail\n",
-                 meta->used_regions, tail_region->used_size);
-      return PBLOG_ERR_NO_SPACE;
+  rc = log_tail_region(meta, lens[0], &tail_region);
+  while (rc >= 0 && done < count) {
+    rc = region_append_batch(meta, tail_region, count - done, lens + done,
+                             next);
+    if (rc < 0) {
+      break;
+    }
+    for (i = done; i < done + rc; ++i) {
+      region_summary_add(meta, tail_region, next, lens[i]);
+      next += lens[i];
+    }
+    done += rc;
+    // Stop at the end of the region, so the caller sees which records went
+    // to which region.
+    if (done < count && !region_fits(meta, tail_region, lens[done])) {
+      break;
+    }
+  }
+
+  // Background erase work is paced per call, as for a single append.
+  if (done > 0 && meta->options.erase_chunks_per_append > 0) {
+    int max_chunks = meta->options.erase_chunks_per_append;
+    log_erase_pending_chunks(meta, &max_chunks);
+  }
+  return done > 0 ? done : rc;
+}
+
+static int log_skip_to_region(struct record_intf *ri, int region) {
+  struct log_metadata *meta = ri->priv;
+  while (meta->used_regions <= region) {
+    int rc = log_next_region(meta);
+    if (rc < 0) {
+      return rc;
     }
   }
+  return PBLOG_SUCCESS;
+}
 
-  return region_append(meta, tail_region, len, data);
+static int log_flush(struct record_intf *ri) {
+  struct log_metadata *meta = ri->priv;
+  int rc = write_buffer_flush(meta);
+  if (rc == PBLOG_SUCCESS && meta->flash->sync != NULL &&
+      meta->flash->sync(meta->flash) != 0) {
+    rc = PBLOG_ERR_IO;
+  }
+  return rc;
 }
 
 static int log_get_free_space(struct record_intf *ri) {
   struct log_metadata *meta = ri->priv;
 
+  struct record_region *tail_region = region_at(meta, meta->used_regions - 1);
   int i;
   int free_space = 0;
-  for (i = meta->used_regions - 1; i < meta->num_regions; ++i) {
+  // Spare regions do not take records.
+  int num_regions = meta->num_regions - meta->options.spare_regions;
+  if (num_regions < meta->used_regions) {
+    num_regions = meta->used_regions;
+  }
+  for (i = meta->used_regions - 1; i < num_regions; ++i) {
     struct record_region *region = region_at(meta, i);
     free_space += region->size - region->used_size;
   }
 
   // Subtract out the size of a single record header as we require atleast
   // that much overhead.
-  free_space -= sizeof(record_header);
+  free_space -= record_header_size(region_format(meta, tail_region));
   return free_space < 0 ? 0 : free_space;
 }
 
 static int region_create(struct log_metadata *meta,
                          struct record_region *region, uint32_t sequence);
+static void region_retire(struct log_metadata *meta,
+                          struct record_region *region);
 
 static int log_clear(struct record_intf *ri, int num_to_clear) {
   struct log_metadata *meta = ri->priv;
@@ -252,6 +1185,26 @@ static int log_clear(struct record_intf *ri, int num_to_clear) {
   if (num_to_clear > meta->num_regions || num_to_clear == 0) {
     num_to_clear = meta->num_regions;
   }
+  meta->generation++;
+  meta->read_ahead_len = 0;
+  // Regions must be on flash before their sequence numbers change.  Buffered
+  // records that cannot be written are dropped.
+  write_buffer_flush(meta);
+
+  // With spare regions, old records are dropped now and erased later, unless
+  // the whole log is cleared.
+  if (meta->options.spare_regions > 0 && num_to_clear < meta->used_regions) {
+    for (i = 0; i < num_to_clear; ++i) {
+      struct record_region *region = region_at(meta, i);
+      freed_space += region->size;
+      meta->dropped += region_data_size(region);
+      region_retire(meta, region);
+    }
+    meta->head_region = (meta->head_region + num_to_clear) % meta->num_regions;
+    meta->used_regions -= num_to_clear;
+    log_update_region_start(meta);
+    return freed_space;
+  }
 
   for (i = 0; i < num_to_clear; ++i) {
     struct record_region *region = region_at(meta, i);
@@ -259,9 +1212,13 @@ static int log_clear(struct record_intf *ri, int num_to_clear) {
     int rc;
 
     freed_space += region->size;
+    if (i < meta->used_regions) {
+      meta->dropped += region_data_size(region);
+    }
     rc = region_create(meta, region, meta->next_sequence++);
     if (rc != PBLOG_SUCCESS) {
       PBLOG_ERRF("error clearing region %d\n", i);
+      log_update_region_start(meta);
       return rc;
     }
     (void)old_seq;
@@ -274,25 +1231,24 @@ static int log_clear(struct record_intf *ri, int num_to_clear) {
   if (meta->used_regions <= 0) {
     meta->used_regions = 1;
   }
+  log_update_region_start(meta);
 
   return freed_space;
 }
 
-// Initialize a region for first time use.
-static int region_create(struct log_metadata *meta,
-                         struct record_region *region, uint32_t sequence) {
+// Writes the header of an erased region, making it ready for records.
+static int region_write_header(struct log_metadata *meta,
+                               struct record_region *region,
+                               uint32_t sequence) {
   struct region_header header;
+  const uint8_t *magic = meta->options.format == RECORD_FORMAT_CRC32C
+                             ? record_magic_crc32c
+                             : record_magic;
   int i;
   int rc;
 
-  rc = meta->flash->erase(meta->flash, region->offset, region->size);
-  if (rc != PBLOG_SUCCESS) {
-    PBLOG_ERRF("region roff %d erase error: %d\n", region->offset, rc);
-    return rc;
-  }
-
   for (i = 0; i < sizeof(header.magic); ++i) {
-    header.magic[i] = record_magic[i];
+    header.magic[i] = magic[i];
   }
   header.sequence[0] = sequence & 0xff;
   header.sequence[1] = (sequence >> 8) & 0xff;
@@ -303,7 +1259,12 @@ static int region_create(struct log_metadata *meta,
     return PBLOG_ERR_NO_SPACE;
   }
 
-  rc = meta->flash->write(meta->flash, region->offset, sizeof(header), &header);
+  if (meta->program_size > 1) {
+    rc = region_program(meta, region, 0, sizeof(header), &header);
+  } else {
+    rc = meta->flash->write(meta->flash, region->offset, sizeof(header),
+                            &header);
+  }
   if (rc != sizeof(header)) {
     PBLOG_ERRF("region roff %d header write error: %d\n", region->offset, rc);
     return rc < 0 ? rc : PBLOG_ERR_IO;
@@ -311,17 +1272,109 @@ static int region_create(struct log_metadata *meta,
 
   region->used_size = sizeof(header);
   region->sequence = sequence;
+  region_info(meta, region)->format = meta->options.format;
+  region_info(meta, region)->erase_pending = 0;
+  region_index_reset(&region_info(meta, region)->index, 1);
+  region_summary_reset(meta, region, 1);
 
   return PBLOG_SUCCESS;
 }
 
+// Initialize a region for first time use.
+static int region_create(struct log_metadata *meta,
+                         struct record_region *region, uint32_t sequence) {
+  int rc = meta->flash->erase(meta->flash, region->offset, region->size);
+  if (rc != PBLOG_SUCCESS) {
+    PBLOG_ERRF("region roff %d erase error: %d\n", region->offset, rc);
+    return rc;
+  }
+  return region_write_header(meta, region, sequence);
+}
+
+// Drops a region from the log and queues it to be erased by
+// region_erase_step().  The region reads as empty from now on.  Its header is
+// programmed to zeros, which needs no erase, so that the next init does not
+// mount the dropped records again.
+static void region_retire(struct log_metadata *meta,
+                          struct record_region *region) {
+  struct region_info *info = region_info(meta, region);
+  struct region_header header;
+  size_t len = sizeof(header);
+  const void *data = &header;
+  int rc;
+
+  memset(&header, 0, sizeof(header));
+  if (meta->program_size > 1) {
+    // Zero whole program units; the records behind the header are dropped
+    // anyway.
+    len = (len + meta->program_size - 1) / meta->program_size *
+          meta->program_size;
+    if (len > region->size) {
+      len = region->size;
+    }
+    memset(meta->program_buf, 0, len);
+    data = meta->program_buf;
+    meta->tail_region = NULL;
+  }
+  rc = meta->flash->write(meta->flash, region->offset, len, data);
+  if (rc != len) {
+    // The region is still erased before it is reused.
+    PBLOG_ERRF("region roff %d header invalidate error: %d\n", region->offset,
+               rc);
+  }
+
+  info->erase_pending = 1;
+  info->erase_offset = 0;
+  region_index_reset(&info->index, 1);
+  region_summary_reset(meta, region, 1);
+  region->used_size = sizeof(struct region_header);
+}
+
+// Erases a region queued by region_retire() in chunks of erase_chunk_size,
+// then gives it a new sequence number.  The region header is in the first
+// chunk, so a partially erased region is recreated at the next init.
+// Args:
+//   max_chunks: number of chunks that may be erased, decremented for each
+//     chunk erased.  NULL to erase the whole region.
+static int region_erase_step(struct log_metadata *meta,
+                             struct record_region *region, int *max_chunks) {
+  struct region_info *info = region_info(meta, region);
+  size_t chunk_size = meta->options.erase_chunk_size;
+  int rc;
+
+  if (chunk_size == 0) {
+    chunk_size = region->size;
+  }
+  while (info->erase_offset < region->size) {
+    size_t len = region->size - info->erase_offset;
+    if (max_chunks != NULL) {
+      if (*max_chunks <= 0) {
+        return PBLOG_SUCCESS;
+      }
+      (*max_chunks)--;
+    }
+    if (len > chunk_size) {
+      len = chunk_size;
+    }
+    rc = meta->flash->erase(meta->flash, region->offset + info->erase_offset,
+                            len);
+    if (rc != PBLOG_SUCCESS) {
+      PBLOG_ERRF("region roff %d erase error: %d\n", region->offset, rc);
+      return rc;
+    }
+    info->erase_offset += len;
+  }
+
+  return region_write_header(meta, region, meta->next_sequence++);
+}
+
 // Reads the number of records in this region to determine the used space.
 static int region_calc_used_size(struct log_metadata *meta,
                                  struct record_region *region) {
   int offset = sizeof(struct region_header);
   while (1) {
     int next_offset;
-    region_read_record(meta, region, offset, &next_offset, NULL, NULL);
+    region_read_record(meta, region, offset, &next_offset, NULL, NULL, 0);
     if (next_offset == 0) {
       break;
     }
@@ -330,43 +1383,211 @@ static int region_calc_used_size(struct log_metadata *meta,
   return offset;
 }
 
-// Initializes a single region struct by reading the region header.
-// On read failure will create the region.
-static int region_init(struct log_metadata *meta,
-                       struct record_region *region) {
+// Determines the used space like region_calc_used_size(), but reads the
+// region in large chunks and walks the record headers in memory.
+// Args:
+//   end: stop walking at this region offset
+//   index: if not NULL, the offset of every record is added to it
+static int region_walk(struct log_metadata *meta, struct record_region *region,
+                       uint32_t end, unsigned char *buf, size_t buf_size,
+                       struct region_index *index) {
+  uint32_t offset = sizeof(struct region_header);
+  uint32_t buf_start = 0;
+  uint32_t buf_len = 0;
+
+  while (offset + sizeof(record_header) <= end) {
+    const record_header *header;
+    int length;
+
+    // Refill the buffer if it does not hold the whole record header.
+    if (offset < buf_start ||
+        offset + sizeof(record_header) > buf_start + buf_len) {
+      size_t len = end - offset;
+      int rc;
+      if (len > buf_size) {
+        len = buf_size;
+      }
+      rc = meta->flash->read(meta->flash, region->offset + offset, len, buf);
+      if (rc < (int)sizeof(record_header)) {
+        break;
+      }
+      buf_start = offset;
+      buf_len = rc;
+    }
+
+    header = (const record_header *)(buf + offset - buf_start);
+    length = header->length_lsb | (header->length_msb << 8);
+    if (length == 0 || length == 0xffff || length > end - offset) {
+      break;
+    }
+    if (index != NULL) {
+      region_index_add(index, offset);
+    }
+    offset += length;
+  }
+  return offset;
+}
+
+// Returns the index of a region, building it if needed.  The index is not
+// valid if it could not be allocated.
+static struct region_index *region_get_index(struct log_metadata *meta,
+                                             struct record_region *region) {
+  struct region_index *index = &region_info(meta, region)->index;
+  uint32_t offset;
+  unsigned char header_buf[RECORD_MAX_HEADER_SIZE];
+  unsigned char *buf = header_buf;
+  size_t buf_size = sizeof(header_buf);
+
+  if (index->valid) {
+    return index;
+  }
+
+  if (meta->options.scan_buffer_size > buf_size) {
+    buf = malloc(meta->options.scan_buffer_size);
+    buf_size = meta->options.scan_buffer_size;
+    if (buf == NULL) {
+      buf = header_buf;
+      buf_size = sizeof(header_buf);
+    }
+  }
+  region_index_reset(index, 1);
+  offset = region_walk(meta, region, region_flushed_size(meta, region), buf,
+                       buf_size, index);
+  if (buf != header_buf) {
+    free(buf);
+  }
+
+  // Add the records still in the write buffer.
+  while (offset < region->used_size) {
+    const unsigned char *header =
+        meta->write_buf + (offset - region_flushed_size(meta, region));
+    region_index_add(index, offset);
+    offset += header[1] | (header[0] << 8);
+  }
+  return index;
+}
+
+// Initializes a single region struct by reading the region header and
+// scanning its records.  Regions without a valid header are left with a
+// used_size of 0 so that they get created once all regions are scanned.
+// Only touches the given region, so regions can be scanned concurrently.
+static void region_scan(struct log_metadata *meta, struct record_region *region,
+                        unsigned char *scan_buf) {
   int rc;
   struct region_header header;
-  uint32_t sequence;
+
+  region->used_size = 0;
 
   // Read in the region header.
   rc = meta->flash->read(meta->flash, region->offset, sizeof(header), &header);
 
   if (rc != sizeof(header)) {
     PBLOG_ERRF("region roff %d header read error: %d\n", region->offset, rc);
-    return region_create(meta, region, meta->next_sequence++);
+    return;
   }
 
-  sequence = header.sequence[0] | header.sequence[1] << 8 |
-             header.sequence[2] << 16 | header.sequence[3] << 24;
-
-  if (header.magic[0] != record_magic[0] ||
-      header.magic[1] != record_magic[1] ||
-      header.magic[2] != record_magic[2] ||
-      header.magic[3] != record_magic[3]) {
+  if (memcmp(header.magic, record_magic, sizeof(header.magic)) == 0) {
+    region_info(meta, region)->format = RECORD_FORMAT_SUM8;
+  } else if (memcmp(header.magic, record_magic_crc32c,
+                    sizeof(header.magic)) == 0) {
+    region_info(meta, region)->format = RECORD_FORMAT_CRC32C;
+  } else {
     PBLOG_DPRINTF("region roff %d invalid header: %02x%02x%02x%02x\n",
                   region->offset, header.magic[0], header.magic[1],
                   header.magic[2], header.magic[3]);
-    return region_create(meta, region, meta->next_sequence++);
+    return;
   }
 
-  if (sequence >= meta->next_sequence) {
-    meta->next_sequence = sequence + 1;
+  region->sequence = header.sequence[0] | header.sequence[1] << 8 |
+                     header.sequence[2] << 16 | header.sequence[3] << 24;
+  if (scan_buf != NULL) {
+    region->used_size =
+        region_walk(meta, region, region->size, scan_buf,
+                    meta->options.scan_buffer_size, NULL);
+  } else {
+    region->used_size = region_calc_used_size(meta, region);
   }
+}
 
-  region->sequence = sequence;
-  region->used_size = region_calc_used_size(meta, region);
+// Scans every stride-th region starting with first.
+static void region_scan_range(struct log_metadata *meta, int first,
+                              int stride) {
+  unsigned char *scan_buf = NULL;
+  int i;
+
+  // Scanning is buffered unless the buffer could not hold a record header.
+  if (meta->options.scan_buffer_size >= sizeof(record_header)) {
+    scan_buf = malloc(meta->options.scan_buffer_size);
+  }
+
+  for (i = first; i < meta->num_regions; i += stride) {
+    region_scan(meta, &meta->regions[i], scan_buf);
+  }
+  free(scan_buf);
+}
+
+#ifdef PBLOG_USE_PTHREADS
+struct region_scan_worker {
+  struct log_metadata *meta;
+  int first;
+  int stride;
+  pthread_t thread;
+};
+
+static void *region_scan_worker_main(void *arg) {
+  struct region_scan_worker *worker = arg;
+  region_scan_range(worker->meta, worker->first, worker->stride);
+  return NULL;
+}
+
+// Scans the regions on init_threads threads.  Returns 0 on success.
+static int record_intf_scan_regions_parallel(struct log_metadata *meta) {
+  int num_threads = meta->options.init_threads;
+  struct region_scan_worker *workers;
+  int started = 0;
+  int i;
+
+  if (num_threads > meta->num_regions) {
+    num_threads = meta->num_regions;
+  }
+  workers = malloc(sizeof(*workers) * num_threads);
+  if (workers == NULL) {
+    return PBLOG_ERR_NO_SPACE;
+  }
+
+  for (i = 0; i < num_threads; ++i) {
+    workers[i].meta = meta;
+    workers[i].first = i;
+    workers[i].stride = num_threads;
+    if (pthread_create(&workers[i].thread, NULL, region_scan_worker_main,
+                       &workers[i]) != 0) {
+      break;
+    }
+    started++;
+  }
+  // Scan the share of any threads that could not be started ourselves.
+  for (i = started; i < num_threads; ++i) {
+    region_scan_range(meta, i, num_threads);
+  }
+  for (i = 0; i < started; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  free(workers);
   return PBLOG_SUCCESS;
 }
+#endif
+
+// Scans all regions, in parallel if requested by the options.
+static void record_intf_scan_regions(struct log_metadata *meta) {
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->options.init_threads > 1 && meta->num_regions > 1 &&
+      record_intf_scan_regions_parallel(meta) == PBLOG_SUCCESS) {
+    return;
+  }
+#endif
+  region_scan_range(meta, 0, 1);
+}
 
 // Initializes the head region as the one with the lowest sequence number.
 static void record_intf_init_head_region(struct log_metadata *meta) {
@@ -386,17 +1607,17 @@ static void record_intf_init_head_region(struct log_metadata *meta) {
   meta->head_region = min_region;
 }
 
-// Initializes the number of used regions as the regions with valid stored
-// records.
+// Initializes the number of used regions as the regions up to the last one
+// with valid stored records.  Regions are filled in sequence order, but a
+// region may be left empty in the middle of the log when its records could not
+// be written, so empty regions before the last valid one are kept.
 static void record_intf_init_used_regions(struct log_metadata *meta) {
   int used_regions = 0;
   int i;
   for (i = 0; i < meta->num_regions; ++i) {
     struct record_region *region = region_at(meta, i);
     if (region->used_size > sizeof(struct region_header)) {
-      used_regions++;
-    } else {
-      break;
+      used_regions = i + 1;
     }
   }
   // We always have atleast one used region.
@@ -408,13 +1629,25 @@ static int record_intf_init_meta(struct record_intf *log) {
   int i;
 
   // Determine the number of records in each region.
+  record_intf_scan_regions(meta);
+
+  // New regions are numbered after the newest valid region.
   for (i = 0; i < meta->num_regions; ++i) {
-    int rc = region_init(meta, &meta->regions[i]);
-    if (rc < 0) {
-      PBLOG_ERRF("region %d init failure, ignoring region\n", i);
-      // Mark the size of the region as 0 so we don't try to use it.
-      meta->regions[i].size = 0;
-      meta->regions[i].used_size = 0;
+    struct record_region *region = &meta->regions[i];
+    if (region->used_size != 0 && region->sequence >= meta->next_sequence) {
+      meta->next_sequence = region->sequence + 1;
+    }
+  }
+
+  for (i = 0; i < meta->num_regions; ++i) {
+    if (meta->regions[i].used_size == 0) {
+      int rc = region_create(meta, &meta->regions[i], meta->next_sequence++);
+      if (rc < 0) {
+        PBLOG_ERRF("region %d init failure, ignoring region\n", i);
+        // Mark the size of the region as 0 so we don't try to use it.
+        meta->regions[i].size = 0;
+        meta->regions[i].used_size = 0;
+      }
     }
 
     PBLOG_DPRINTF("region %d. rseq:%d offset:%d size:%d used_size:%d\n", i,
@@ -424,6 +1657,7 @@ static int record_intf_init_meta(struct record_intf *log) {
 
   record_intf_init_head_region(meta);
   record_intf_init_used_regions(meta);
+  log_update_region_start(meta);
 
   PBLOG_DPRINTF(
       "init num_regions:%d used_regions:%d head_region:%d "
@@ -433,33 +1667,363 @@ static int record_intf_init_meta(struct record_intf *log) {
   return PBLOG_SUCCESS;
 }
 
+#ifdef PBLOG_USE_PTHREADS
+// Operations installed by the thread_safe option.  They take the log lock
+// around the operations above.
+static int log_read_record_locked(struct record_intf *ri, int offset,
+                                  int *next_offset, size_t *len, void *data) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_rdlock(&meta->lock);
+  rc = log_read_record(ri, offset, next_offset, len, data);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_seek_locked(struct record_intf *ri,
+                           struct record_cursor *cursor, int offset) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_rdlock(&meta->lock);
+  rc = log_seek(ri, cursor, offset);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_read_next_locked(struct record_intf *ri,
+                                struct record_cursor *cursor,
+                                int *next_offset, size_t *len, void *data) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_rdlock(&meta->lock);
+  rc = log_read_next(ri, cursor, next_offset, len, data);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_seek_end_locked(struct record_intf *ri,
+                               struct record_cursor *cursor) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_rdlock(&meta->lock);
+  rc = log_seek_end(ri, cursor);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_skip_regions_locked(struct record_intf *ri,
+                                   struct record_cursor *cursor,
+                                   record_skip_fn skip, void *priv) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_rdlock(&meta->lock);
+  rc = log_skip_regions(ri, cursor, skip, priv);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_read_prev_locked(struct record_intf *ri,
+                                struct record_cursor *cursor,
+                                int *prev_offset, size_t *len, void *data) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_rdlock(&meta->lock);
+  rc = log_read_prev(ri, cursor, prev_offset, len, data);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_append_locked(struct record_intf *ri, size_t len,
+                             const void *data) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_wrlock(&meta->lock);
+  rc = log_append(ri, len, data);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_append_batch_locked(struct record_intf *ri, int count,
+                                   const size_t *lens, const void *data) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_wrlock(&meta->lock);
+  rc = log_append_batch(ri, count, lens, data);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_skip_to_region_locked(struct record_intf *ri, int region) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_wrlock(&meta->lock);
+  rc = log_skip_to_region(ri, region);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_get_free_space_locked(struct record_intf *ri) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_rdlock(&meta->lock);
+  rc = log_get_free_space(ri);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_clear_locked(struct record_intf *ri, int num_to_clear) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_wrlock(&meta->lock);
+  rc = log_clear(ri, num_to_clear);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_flush_locked(struct record_intf *ri) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_wrlock(&meta->lock);
+  rc = log_flush(ri);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+
+static int log_erase_pending_locked(struct record_intf *ri, int max_chunks) {
+  struct log_metadata *meta = ri->priv;
+  int rc;
+  pthread_rwlock_wrlock(&meta->lock);
+  rc = log_erase_pending(ri, max_chunks);
+  pthread_rwlock_unlock(&meta->lock);
+  return rc;
+}
+#endif
+
 int record_intf_init(record_intf *ri, const struct record_region *regions,
                      int num_regions, struct pblog_flash_ops *flash) {
+  struct record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  return record_intf_init_options(ri, regions, num_regions, flash, &options);
+}
+
+int record_intf_init_options(record_intf *ri,
+                             const struct record_region *regions,
+                             int num_regions, struct pblog_flash_ops *flash,
+                             const struct record_intf_options *options) {
   struct log_metadata *meta;
-  if (num_regions < 1) {
+  struct pblog_flash_geometry geometry;
+  int rc;
+  int i;
+  if (num_regions < 1 ||
+      (options->format != RECORD_FORMAT_SUM8 &&
+       options->format != RECORD_FORMAT_CRC32C) ||
+      (options->summary_size > 0 && options->summarize == NULL) ||
+      options->spare_regions < 0 || options->spare_regions >= num_regions) {
+    return PBLOG_ERR_INVALID;
+  }
+  memset(&geometry, 0, sizeof(geometry));
+  if (flash->get_geometry == NULL ||
+      flash->get_geometry(flash, &geometry) != 0) {
+    geometry.program_size = 1;
+    geometry.erase_block_size = 1;
+  }
+  if (geometry.program_size == 0) {
+    geometry.program_size = 1;
+  }
+  if (geometry.erase_block_size == 0 ||
+      geometry.erase_block_size % geometry.program_size != 0) {
+    PBLOG_ERRF("invalid flash geometry: program size %u, erase block size %u\n",
+               geometry.program_size, geometry.erase_block_size);
+    return PBLOG_ERR_INVALID;
+  }
+  // Regions are erased as a whole, so they must cover whole erase blocks.
+  for (i = 0; i < num_regions; ++i) {
+    if (regions[i].offset % geometry.erase_block_size != 0 ||
+        regions[i].size % geometry.erase_block_size != 0) {
+      PBLOG_ERRF("region roff %d not aligned to erase block size %u\n",
+                 regions[i].offset, geometry.erase_block_size);
+      return PBLOG_ERR_INVALID;
+    }
+  }
+#ifndef PBLOG_USE_PTHREADS
+  if (options->thread_safe) {
+    PBLOG_ERRF("thread_safe requires PBLOG_USE_PTHREADS\n");
     return PBLOG_ERR_INVALID;
   }
+#endif
   meta = malloc(sizeof(struct log_metadata));
 
   meta->regions = malloc(sizeof(*regions) * num_regions);
   memcpy(meta->regions, regions, sizeof(*regions) * num_regions);
+  meta->info = calloc(num_regions, sizeof(*meta->info));
+  meta->summaries = NULL;
+  if (options->summary_size > 0) {
+    meta->summaries = calloc(num_regions, options->summary_size);
+    for (i = 0; i < num_regions && meta->summaries != NULL; ++i) {
+      meta->info[i].summary = meta->summaries + i * options->summary_size;
+    }
+  }
   meta->num_regions = num_regions;
   meta->next_sequence = 0;
+  meta->region_start = malloc(sizeof(*meta->region_start) * num_regions);
+  meta->generation = 0;
+  meta->dropped = 0;
 
   meta->flash = flash;
+  meta->options = *options;
+  meta->read_ahead = NULL;
+  meta->read_ahead_offset = 0;
+  meta->read_ahead_len = 0;
+  meta->write_buf = NULL;
+  meta->write_region = NULL;
+  meta->write_len = 0;
+  meta->write_records = 0;
+  meta->program_size = geometry.program_size;
+  meta->program_buf = NULL;
+  meta->tail_region = NULL;
+  meta->tail_offset = 0;
+  if (meta->program_size > 1) {
+    // Appends go through the write buffer to be padded to program units.
+    // Without one, each record is flushed as it is appended.
+    if (meta->options.write_buffer_size == 0) {
+      meta->options.write_buffer_size = meta->program_size;
+      meta->options.flush_records = 1;
+    }
+    meta->program_buf =
+        malloc(meta->options.write_buffer_size + 2 * meta->program_size);
+  }
+  if (meta->options.erase_chunk_size % geometry.erase_block_size != 0) {
+    meta->options.erase_chunk_size +=
+        geometry.erase_block_size -
+        meta->options.erase_chunk_size % geometry.erase_block_size;
+  }
+  if (meta->options.write_buffer_size > 0) {
+    meta->write_buf = malloc(meta->options.write_buffer_size);
+  }
 
   ri->read_record = log_read_record;
+  ri->seek = log_seek;
+  ri->read_next = log_read_next;
+  ri->skip_regions = log_skip_regions;
+  ri->seek_end = log_seek_end;
+  ri->read_prev = log_read_prev;
   ri->append = log_append;
+  ri->append_batch = log_append_batch;
+  ri->skip_to_region = log_skip_to_region;
   ri->get_free_space = log_get_free_space;
   ri->clear = log_clear;
+  ri->flush = log_flush;
+  ri->erase_pending = log_erase_pending;
+#ifdef PBLOG_USE_PTHREADS
+  if (options->thread_safe) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // Readers would otherwise starve the writer during long scans.
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&meta->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&meta->cache_lock, NULL);
+    ri->read_record = log_read_record_locked;
+    ri->seek = log_seek_locked;
+    ri->read_next = log_read_next_locked;
+    ri->skip_regions = log_skip_regions_locked;
+    ri->seek_end = log_seek_end_locked;
+    ri->read_prev = log_read_prev_locked;
+    ri->append = log_append_locked;
+    ri->append_batch = log_append_batch_locked;
+    ri->skip_to_region = log_skip_to_region_locked;
+    ri->get_free_space = log_get_free_space_locked;
+    ri->clear = log_clear_locked;
+    ri->flush = log_flush_locked;
+    ri->erase_pending = log_erase_pending_locked;
+  }
+#endif
 
   ri->priv = meta;
 
-  return record_intf_init_meta(ri);
+  rc = record_intf_init_meta(ri);
+  // The window is only used once the regions are scanned, as the scan may
+  // run on several threads.  Thread safe logs read the flash directly:
+  // cursors of several threads would keep evicting each other's window.
+  if (options->read_ahead_size > 0 && !options->thread_safe) {
+    meta->read_ahead = malloc(options->read_ahead_size);
+  }
+  return rc;
+}
+
+int record_regions_from_geometry(const struct pblog_flash_geometry *geometry,
+                                 uint32_t offset, uint32_t size,
+                                 int num_regions,
+                                 struct record_region *regions) {
+  const uint32_t block =
+      geometry->erase_block_size > 0 ? geometry->erase_block_size : 1;
+  const uint32_t skip = (block - offset % block) % block;
+  uint32_t region_size;
+  int i;
+
+  if (num_regions < 1 || size < skip) {
+    return PBLOG_ERR_NO_SPACE;
+  }
+  region_size = (size - skip) / num_regions / block * block;
+  if (region_size == 0) {
+    return PBLOG_ERR_NO_SPACE;
+  }
+  for (i = 0; i < num_regions; ++i) {
+    memset(&regions[i], 0, sizeof(regions[i]));
+    regions[i].offset = offset + skip + i * region_size;
+    regions[i].size = region_size;
+  }
+  return PBLOG_SUCCESS;
+}
+
+int record_intf_num_regions(const record_intf *ri,
+                            uint32_t *max_region_size) {
+  const struct log_metadata *meta = ri->priv;
+  int i;
+  *max_region_size = 0;
+  for (i = 0; i < meta->num_regions; ++i) {
+    if (meta->regions[i].size > *max_region_size) {
+      *max_region_size = meta->regions[i].size;
+    }
+  }
+  return meta->num_regions - meta->options.spare_regions;
+}
+
+int record_intf_region_sequence(const record_intf *ri, int region,
+                                uint32_t *sequence) {
+  const struct log_metadata *meta = ri->priv;
+  if (region < 0 || region >= meta->used_regions) {
+    return PBLOG_ERR_INVALID;
+  }
+  *sequence =
+      meta->regions[(meta->head_region + region) % meta->num_regions].sequence;
+  return PBLOG_SUCCESS;
 }
 
 void record_intf_free(record_intf *ri) {
   struct log_metadata *meta = ri->priv;
+  int i;
+  write_buffer_flush(meta);
+  for (i = 0; i < meta->num_regions; ++i) {
+    free(meta->info[i].index.offsets);
+  }
+  free(meta->write_buf);
+  free(meta->program_buf);
+  free(meta->read_ahead);
+  free(meta->region_start);
+  free(meta->summaries);
+  free(meta->info);
   free(meta->regions);
+#ifdef PBLOG_USE_PTHREADS
+  if (meta->options.thread_safe) {
+    pthread_rwlock_destroy(&meta->lock);
+    pthread_mutex_destroy(&meta->cache_lock);
+  }
+#endif
   free(meta);
 }
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef PBLOG_USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <pblog/common.h>
+#include <pblog/sim.h>
+
+#define SIM_DEFAULT_ERASE_BLOCK_SIZE 4096
+
+struct sim_state {
+  struct pblog_sim_options options;
+  unsigned char *mem;
+  // Erase count of every erase block.
+  uint32_t *erase_counts;
+  // Programs of every program unit since its last erase, saturating.  Only
+  // tracked with options.max_programs.
+  uint8_t *program_counts;
+  struct pblog_sim_stats stats;
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+};
+
+static void sim_lock(struct sim_state *state) {
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_lock(&state->lock);
+#endif
+}
+
+static void sim_unlock(struct sim_state *state) {
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_unlock(&state->lock);
+#endif
+}
+
+// Returns 1 if [offset, offset + len) lies on the device.
+static int sim_contains(const struct sim_state *state, int offset,
+                        size_t len) {
+  return offset >= 0 && offset <= state->options.size &&
+         len <= state->options.size - offset;
+}
+
+static int sim_read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
+  struct sim_state *state = ops->priv;
+
+  if (!sim_contains(state, offset, len)) {
+    return PBLOG_ERR_INVALID;
+  }
+  sim_lock(state);
+  memcpy(data, state->mem + offset, len);
+  state->stats.reads++;
+  state->stats.bytes_read += len;
+  state->stats.time_ns +=
+      state->options.read_ns + (uint64_t)len * state->options.read_ns_per_byte;
+  sim_unlock(state);
+  return len;
+}
+
+// Programs the buffers at offset.  Bits can only go from 1 to 0.
+static int sim_program(struct sim_state *state, int offset,
+                       const struct pblog_flash_iovec *iov, int iovcnt) {
+  const uint32_t unit = state->options.program_size;
+  unsigned char *dst = state->mem + offset;
+  uint64_t errors = 0;
+  size_t len = 0;
+  uint32_t first;
+  uint32_t last;
+  uint32_t u;
+  size_t j;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    len += iov[i].len;
+  }
+  if (!sim_contains(state, offset, len)) {
+    return PBLOG_ERR_INVALID;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  sim_lock(state);
+  for (i = 0; i < iovcnt; ++i) {
+    const unsigned char *src = iov[i].data;
+    for (j = 0; j < iov[i].len; ++j) {
+      errors += (src[j] & ~dst[j]) != 0;
+    }
+    dst += iov[i].len;
+  }
+  state->stats.program_errors += errors;
+  if (errors != 0 && state->options.strict) {
+    sim_unlock(state);
+    PBLOG_ERRF("sim: program of zero bits at %d\n", offset);
+    return PBLOG_ERR_IO;
+  }
+
+  dst = state->mem + offset;
+  for (i = 0; i < iovcnt; ++i) {
+    const unsigned char *src = iov[i].data;
+    for (j = 0; j < iov[i].len; ++j) {
+      dst[j] &= src[j];
+    }
+    dst += iov[i].len;
+  }
+
+  first = offset / unit;
+  last = (offset + len - 1) / unit;
+  if (state->program_counts != NULL) {
+    for (u = first; u <= last; ++u) {
+      if (state->program_counts[u] < UINT8_MAX) {
+        state->program_counts[u]++;
+      }
+      if (state->program_counts[u] > state->options.max_programs) {
+        state->stats.disturbs++;
+      }
+    }
+  }
+  state->stats.programs += last - first + 1;
+  state->stats.bytes_programmed += len;
+  state->stats.time_ns +=
+      (uint64_t)(last - first + 1) * state->options.program_ns;
+  sim_unlock(state);
+  return len;
+}
+
+static int sim_write(pblog_flash_ops *ops, int offset, size_t len,
+                     const void *data) {
+  struct pblog_flash_iovec iov = {data, len};
+  return sim_program(ops->priv, offset, &iov, 1);
+}
+
+static int sim_writev(pblog_flash_ops *ops, int offset,
+                      const struct pblog_flash_iovec *iov, int iovcnt) {
+  return sim_program(ops->priv, offset, iov, iovcnt);
+}
+
+static int sim_erase(pblog_flash_ops *ops, int offset, size_t len) {
+  struct sim_state *state = ops->priv;
+  const uint32_t block = state->options.erase_block_size;
+  const uint32_t units_per_block = block / state->options.program_size;
+  uint32_t b;
+
+  if (!sim_contains(state, offset, len) || offset % block != 0 ||
+      len % block != 0) {
+    PBLOG_ERRF("sim: erase of [%d, +%zu) not on erase blocks\n", offset, len);
+    return PBLOG_ERR_INVALID;
+  }
+
+  sim_lock(state);
+  memset(state->mem + offset, 0xff, len);
+  for (b = offset / block; b < (offset + len) / block; ++b) {
+    state->erase_counts[b]++;
+    if (state->erase_counts[b] > state->stats.max_erase_count) {
+      state->stats.max_erase_count = state->erase_counts[b];
+    }
+    if (state->program_counts != NULL) {
+      memset(state->program_counts + b * units_per_block, 0, units_per_block);
+    }
+  }
+  state->stats.erases += len / block;
+  state->stats.time_ns += (uint64_t)(len / block) * state->options.erase_ns;
+  sim_unlock(state);
+  return 0;
+}
+
+static int sim_get_geometry(pblog_flash_ops *ops,
+                            struct pblog_flash_geometry *geometry) {
+  struct sim_state *state = ops->priv;
+  geometry->program_size = state->options.program_size;
+  geometry->erase_block_size = state->options.erase_block_size;
+  geometry->alignment = state->options.program_size;
+  return 0;
+}
+
+int pblog_sim_ops_init(struct pblog_flash_ops *ops,
+                       const struct pblog_sim_options *options) {
+  struct sim_state *state;
+
+  state = calloc(1, sizeof(*state));
+  if (state == NULL) {
+    return PBLOG_ERR_NO_SPACE;
+  }
+  state->options = *options;
+  if (state->options.program_size == 0) {
+    state->options.program_size = 1;
+  }
+  if (state->options.erase_block_size == 0) {
+    state->options.erase_block_size = SIM_DEFAULT_ERASE_BLOCK_SIZE;
+  }
+  if (state->options.size == 0 ||
+      state->options.erase_block_size % state->options.program_size != 0 ||
+      state->options.size % state->options.erase_block_size != 0) {
+    free(state);
+    return PBLOG_ERR_INVALID;
+  }
+
+  state->mem = malloc(state->options.size);
+  state->erase_counts = calloc(
+      state->options.size / state->options.erase_block_size, sizeof(uint32_t));
+  if (state->options.max_programs > 0) {
+    state->program_counts =
+        calloc(state->options.size / state->options.program_size, 1);
+  }
+  if (state->mem == NULL || state->erase_counts == NULL ||
+      (state->options.max_programs > 0 && state->program_counts == NULL)) {
+    free(state->program_counts);
+    free(state->erase_counts);
+    free(state->mem);
+    free(state);
+    return PBLOG_ERR_NO_SPACE;
+  }
+  memset(state->mem, 0xff, state->options.size);
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_init(&state->lock, NULL);
+#endif
+
+  memset(ops, 0, sizeof(*ops));
+  ops->read = &sim_read;
+  ops->write = &sim_write;
+  ops->erase = &sim_erase;
+  ops->writev = &sim_writev;
+  ops->get_geometry = &sim_get_geometry;
+  ops->priv = state;
+  return PBLOG_SUCCESS;
+}
+
+void pblog_sim_ops_free(struct pblog_flash_ops *ops) {
+  struct sim_state *state = ops->priv;
+  if (state == NULL) {
+    return;
+  }
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_destroy(&state->lock);
+#endif
+  free(state->program_counts);
+  free(state->erase_counts);
+  free(state->mem);
+  free(state);
+  ops->priv = NULL;
+}
+
+void pblog_sim_get_stats(struct pblog_flash_ops *ops,
+                         struct pblog_sim_stats *stats) {
+  struct sim_state *state = ops->priv;
+  sim_lock(state);
+  *stats = state->stats;
+  sim_unlock(state);
+}
+
+void pblog_sim_reset_stats(struct pblog_flash_ops *ops) {
+  struct sim_state *state = ops->priv;
+  uint32_t max_erase_count;
+  sim_lock(state);
+  max_erase_count = state->stats.max_erase_count;
+  memset(&state->stats, 0, sizeof(state->stats));
+  state->stats.max_erase_count = max_erase_count;
+  sim_unlock(state);
+}
+
+uint32_t pblog_sim_erase_count(struct pblog_flash_ops *ops, uint32_t block) {
+  struct sim_state *state = ops->priv;
+  uint32_t count = 0;
+  sim_lock(state);
+  if (block < state->options.size / state->options.erase_block_size) {
+    count = state->erase_counts[block];
+  }
+  sim_unlock(state);
+  return count;
+}
@@ -0,0 +1,649 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef PBLOG_USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PBLOG_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include <pblog/common.h>
+#include <pblog/file.h>
+#include <pblog/uring.h>
+
+#define URING_DEFAULT_QUEUE_DEPTH 32
+#define URING_DEFAULT_SUBMIT_BATCH 8
+
+#ifdef PBLOG_HAVE_IO_URING
+
+// Size of the erased buffer that erases write from.
+#define URING_ERASE_CHUNK 4096
+
+// Kind of an operation, in the low bits of its user_data.
+#define URING_OP_WRITE 0    // user_data points at its struct uring_write
+#define URING_OP_PREFETCH 1
+#define URING_OP_MASK 3
+
+// A write or erase in flight, with a copy of the data of a write.  Erases
+// write from the erased buffer and have no data.
+struct uring_write {
+  struct uring_write *prev;
+  struct uring_write *next;
+  uint32_t offset;
+  size_t len;
+  unsigned char data[];
+};
+
+enum uring_prefetch_state {
+  URING_PREFETCH_NONE,
+  URING_PREFETCH_PENDING,
+  URING_PREFETCH_DONE,
+};
+
+struct uring_state {
+  // Synchronous operations on the same file, used for plain reads and sync.
+  struct pblog_flash_ops file;
+  int fd;
+  int ring_fd;
+  unsigned submit_batch;
+
+  unsigned sq_entries;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // Operations not yet submitted, and operations not yet completed.
+  unsigned queued;
+  unsigned in_flight;
+  // Writes and erases in flight.
+  struct uring_write *writes;
+  // First failure of a queued operation since the last sync().
+  int error;
+  unsigned char *erased;
+
+  // Background read started by prefetch().
+  enum uring_prefetch_state prefetch_state;
+  unsigned char *prefetch_buf;
+  size_t prefetch_size;
+  uint32_t prefetch_offset;
+  size_t prefetch_len;
+  int prefetch_result;
+
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+};
+
+static void uring_lock(struct uring_state *state) {
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_lock(&state->lock);
+#endif
+}
+
+static void uring_unlock(struct uring_state *state) {
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_unlock(&state->lock);
+#endif
+}
+
+static void uring_complete(struct uring_state *state, uint64_t user_data,
+                           int res) {
+  struct uring_write *write;
+
+  if ((user_data & URING_OP_MASK) == URING_OP_PREFETCH) {
+    state->prefetch_result = res;
+    state->prefetch_state = URING_PREFETCH_DONE;
+    return;
+  }
+  write = (struct uring_write *)(uintptr_t)user_data;
+  if (res != (int)write->len && state->error == PBLOG_SUCCESS) {
+    PBLOG_ERRF("uring: queued write failed: %d\n", res);
+    state->error = PBLOG_ERR_IO;
+  }
+  if (write->prev != NULL) {
+    write->prev->next = write->next;
+  } else {
+    state->writes = write->next;
+  }
+  if (write->next != NULL) {
+    write->next->prev = write->prev;
+  }
+  free(write);
+}
+
+// Handles the completed operations.
+static void uring_reap(struct uring_state *state) {
+  unsigned head = *state->cq_head;
+  while (head != __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE)) {
+    const struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+    uring_complete(state, cqe->user_data, cqe->res);
+    state->in_flight--;
+    head++;
+  }
+  __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Runs the queued operations the kernel did not take with the synchronous
+// file operations, and completes them.
+static void uring_run_queued(struct uring_state *state) {
+  const unsigned head = *state->sq_tail - state->queued;
+  unsigned i;
+
+  for (i = head; i != *state->sq_tail; ++i) {
+    const struct io_uring_sqe *sqe = &state->sqes[i & *state->sq_mask];
+    void *addr = (void *)(uintptr_t)sqe->addr;
+    int res;
+    if (sqe->opcode == IORING_OP_READ) {
+      res = state->file.read(&state->file, sqe->off, sqe->len, addr);
+    } else {
+      res = state->file.write(&state->file, sqe->off, sqe->len, addr);
+    }
+    uring_complete(state, sqe->user_data, res);
+    state->in_flight--;
+  }
+  __atomic_store_n(state->sq_tail, head, __ATOMIC_RELEASE);
+  state->queued = 0;
+}
+
+// Submits the queued operations and, if wait is set, waits for an operation
+// to complete.  If the kernel takes none of the queued operations they run
+// synchronously instead, so that nothing waits for a completion that never
+// comes.  Only fails if waiting fails.
+static int uring_enter(struct uring_state *state, int wait) {
+  while (state->queued > 0 || wait) {
+    const unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int rc = syscall(__NR_io_uring_enter, state->ring_fd, state->queued,
+                     wait ? 1 : 0, flags, NULL, 0);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0 && state->queued > 0) {
+      PBLOG_ERRF("uring: submit failed: %d, running %u operations\n",
+                 rc < 0 ? -errno : rc, state->queued);
+      // The operations completed, which ends the wait.
+      uring_run_queued(state);
+      break;
+    }
+    if (rc < 0) {
+      PBLOG_ERRF("uring: wait failed: %d\n", -errno);
+      if (state->error == PBLOG_SUCCESS) {
+        state->error = PBLOG_ERR_IO;
+      }
+      return PBLOG_ERR_IO;
+    }
+    state->queued -= rc;
+    wait = 0;
+  }
+  uring_reap(state);
+  return PBLOG_SUCCESS;
+}
+
+// Submits the queued operations without waiting for completions.
+static void uring_submit(struct uring_state *state) {
+  uring_enter(state, 0);
+}
+
+// Submits the queued operations and waits for at least one operation to
+// complete.
+static int uring_wait(struct uring_state *state) {
+  return uring_enter(state, 1);
+}
+
+// Waits for every operation in flight.
+static int uring_drain(struct uring_state *state) {
+  while (state->in_flight > 0) {
+    int rc = uring_wait(state);
+    if (rc != PBLOG_SUCCESS) {
+      return rc;
+    }
+  }
+  return PBLOG_SUCCESS;
+}
+
+// Returns 1 if a write or erase in flight overlaps [offset, offset + len).
+static int uring_overlaps_write(const struct uring_state *state,
+                                uint32_t offset, size_t len) {
+  const struct uring_write *write;
+  for (write = state->writes; write != NULL; write = write->next) {
+    if (offset < write->offset + write->len &&
+        offset + len > write->offset) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Waits for the writes in flight that overlap [offset, offset + len), so that
+// operations on the same bytes complete in order.
+static int uring_order(struct uring_state *state, uint32_t offset,
+                       size_t len) {
+  while (uring_overlaps_write(state, offset, len)) {
+    int rc = uring_wait(state);
+    if (rc != PBLOG_SUCCESS) {
+      return rc;
+    }
+  }
+  return PBLOG_SUCCESS;
+}
+
+// Forgets a prefetched range that [offset, offset + len) is about to modify.
+static int uring_drop_prefetch(struct uring_state *state, uint32_t offset,
+                               size_t len) {
+  if (state->prefetch_state == URING_PREFETCH_NONE ||
+      offset >= state->prefetch_offset + state->prefetch_len ||
+      offset + len <= state->prefetch_offset) {
+    return PBLOG_SUCCESS;
+  }
+  while (state->prefetch_state == URING_PREFETCH_PENDING) {
+    int rc = uring_wait(state);
+    if (rc != PBLOG_SUCCESS) {
+      return rc;
+    }
+  }
+  state->prefetch_state = URING_PREFETCH_NONE;
+  return PBLOG_SUCCESS;
+}
+
+// Returns an entry for a new operation, waiting for completions if the
+// queue is full.
+static struct io_uring_sqe *uring_get_sqe(struct uring_state *state) {
+  struct io_uring_sqe *sqe;
+  while (state->in_flight >= state->sq_entries) {
+    if (uring_wait(state) != PBLOG_SUCCESS) {
+      return NULL;
+    }
+  }
+  sqe = &state->sqes[*state->sq_tail & *state->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// Queues the entry returned by uring_get_sqe().
+static void uring_queue(struct uring_state *state) {
+  __atomic_store_n(state->sq_tail, *state->sq_tail + 1, __ATOMIC_RELEASE);
+  state->queued++;
+  state->in_flight++;
+}
+
+// Queues a write of write->len bytes of data at write->offset, tracking it
+// until it completes.  The completion frees write.
+static int uring_queue_write(struct uring_state *state,
+                             struct uring_write *write, const void *data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(state);
+  if (sqe == NULL) {
+    return PBLOG_ERR_IO;
+  }
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = state->fd;
+  sqe->addr = (uintptr_t)data;
+  sqe->len = write->len;
+  sqe->off = write->offset;
+  sqe->user_data = (uintptr_t)write;
+  uring_queue(state);
+
+  write->prev = NULL;
+  write->next = state->writes;
+  if (state->writes != NULL) {
+    state->writes->prev = write;
+  }
+  state->writes = write;
+  if (state->queued >= state->submit_batch) {
+    uring_submit(state);
+  }
+  return PBLOG_SUCCESS;
+}
+
+static int uring_writev(pblog_flash_ops *ops, int offset,
+                        const struct pblog_flash_iovec *iov, int iovcnt) {
+  struct uring_state *state = ops->priv;
+  struct uring_write *write;
+  size_t total = 0;
+  int rc;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    total += iov[i].len;
+  }
+  // The caller may reuse its buffers as soon as the write is queued.
+  write = malloc(sizeof(*write) + total);
+  if (write == NULL) {
+    return -1;
+  }
+  write->offset = offset;
+  write->len = total;
+  total = 0;
+  for (i = 0; i < iovcnt; ++i) {
+    memcpy(write->data + total, iov[i].data, iov[i].len);
+    total += iov[i].len;
+  }
+
+  uring_lock(state);
+  rc = uring_order(state, offset, total);
+  if (rc == PBLOG_SUCCESS) {
+    rc = uring_drop_prefetch(state, offset, total);
+  }
+  if (rc == PBLOG_SUCCESS) {
+    rc = uring_queue_write(state, write, write->data);
+  }
+  uring_unlock(state);
+  if (rc != PBLOG_SUCCESS) {
+    free(write);
+    return -1;
+  }
+  return total;
+}
+
+static int uring_write(pblog_flash_ops *ops, int offset, size_t len,
+                       const void *data) {
+  struct pblog_flash_iovec iov = {data, len};
+  return uring_writev(ops, offset, &iov, 1);
+}
+
+static int uring_erase(pblog_flash_ops *ops, int offset, size_t len) {
+  struct uring_state *state = ops->priv;
+  int rc;
+
+  uring_lock(state);
+  rc = uring_order(state, offset, len);
+  if (rc == PBLOG_SUCCESS) {
+    rc = uring_drop_prefetch(state, offset, len);
+  }
+  while (rc == PBLOG_SUCCESS && len > 0) {
+    size_t chunk = len < URING_ERASE_CHUNK ? len : URING_ERASE_CHUNK;
+    struct uring_write *write = malloc(sizeof(*write));
+    if (write == NULL) {
+      rc = PBLOG_ERR_NO_SPACE;
+      break;
+    }
+    write->offset = offset;
+    write->len = chunk;
+    rc = uring_queue_write(state, write, state->erased);
+    if (rc != PBLOG_SUCCESS) {
+      free(write);
+    }
+    offset += chunk;
+    len -= chunk;
+  }
+  uring_unlock(state);
+  return rc == PBLOG_SUCCESS ? 0 : -1;
+}
+
+static int uring_read(pblog_flash_ops *ops, int offset, size_t len,
+                      void *data) {
+  struct uring_state *state = ops->priv;
+  int rc = PBLOG_SUCCESS;
+
+  uring_lock(state);
+  if (state->prefetch_state != URING_PREFETCH_NONE &&
+      offset >= state->prefetch_offset &&
+      offset + len <= state->prefetch_offset + state->prefetch_len) {
+    while (rc == PBLOG_SUCCESS &&
+           state->prefetch_state == URING_PREFETCH_PENDING) {
+      rc = uring_wait(state);
+    }
+    if (rc == PBLOG_SUCCESS && state->prefetch_result >= 0 &&
+        offset + len <= state->prefetch_offset + state->prefetch_result) {
+      memcpy(data, state->prefetch_buf + (offset - state->prefetch_offset),
+             len);
+      uring_unlock(state);
+      return len;
+    }
+  }
+  rc = uring_order(state, offset, len);
+  if (rc == PBLOG_SUCCESS) {
+    rc = state->file.read(&state->file, offset, len, data);
+  }
+  uring_unlock(state);
+  return rc;
+}
+
+static int uring_prefetch(pblog_flash_ops *ops, int offset, size_t len) {
+  struct uring_state *state = ops->priv;
+  struct io_uring_sqe *sqe;
+  int rc = PBLOG_SUCCESS;
+
+  uring_lock(state);
+  // A single read runs in the background; later hints are dropped until it
+  // completes.
+  if (state->prefetch_state == URING_PREFETCH_PENDING) {
+    uring_unlock(state);
+    return 0;
+  }
+  state->prefetch_state = URING_PREFETCH_NONE;
+  if (len > state->prefetch_size) {
+    unsigned char *buf = realloc(state->prefetch_buf, len);
+    if (buf == NULL) {
+      uring_unlock(state);
+      return -1;
+    }
+    state->prefetch_buf = buf;
+    state->prefetch_size = len;
+  }
+  rc = uring_order(state, offset, len);
+  sqe = rc == PBLOG_SUCCESS ? uring_get_sqe(state) : NULL;
+  if (sqe == NULL) {
+    uring_unlock(state);
+    return -1;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = state->fd;
+  sqe->addr = (uintptr_t)state->prefetch_buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = URING_OP_PREFETCH;
+  uring_queue(state);
+  state->prefetch_state = URING_PREFETCH_PENDING;
+  state->prefetch_offset = offset;
+  state->prefetch_len = len;
+  uring_submit(state);
+  uring_unlock(state);
+  return 0;
+}
+
+static int uring_sync(pblog_flash_ops *ops) {
+  struct uring_state *state = ops->priv;
+  int rc;
+
+  uring_lock(state);
+  rc = uring_drain(state);
+  if (rc == PBLOG_SUCCESS) {
+    rc = state->error;
+  }
+  state->error = PBLOG_SUCCESS;
+  if (rc == PBLOG_SUCCESS && state->file.sync(&state->file) != 0) {
+    rc = PBLOG_ERR_IO;
+  }
+  uring_unlock(state);
+  return rc == PBLOG_SUCCESS ? 0 : -1;
+}
+
+// Sets up the rings.  Returns 0 on success.
+static int uring_setup(struct uring_state *state, unsigned entries) {
+  struct io_uring_params params;
+  unsigned *array;
+  unsigned i;
+
+  memset(&params, 0, sizeof(params));
+  state->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (state->ring_fd < 0) {
+    return -1;
+  }
+  // IORING_OP_READ and IORING_OP_WRITE came with this feature.
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(state->ring_fd);
+    return -1;
+  }
+
+  state->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  state->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  state->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  state->sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                        IORING_OFF_SQ_RING);
+  state->cq_ring = mmap(NULL, state->cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                        IORING_OFF_CQ_RING);
+  state->sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                     IORING_OFF_SQES);
+  if (state->sq_ring == MAP_FAILED || state->cq_ring == MAP_FAILED ||
+      state->sqes == MAP_FAILED) {
+    if (state->sq_ring != MAP_FAILED) {
+      munmap(state->sq_ring, state->sq_ring_size);
+    }
+    if (state->cq_ring != MAP_FAILED) {
+      munmap(state->cq_ring, state->cq_ring_size);
+    }
+    if (state->sqes != MAP_FAILED) {
+      munmap(state->sqes, state->sqes_size);
+    }
+    close(state->ring_fd);
+    return -1;
+  }
+
+  state->sq_entries = params.sq_entries;
+  state->sq_tail = (unsigned *)((char *)state->sq_ring + params.sq_off.tail);
+  state->sq_mask =
+      (unsigned *)((char *)state->sq_ring + params.sq_off.ring_mask);
+  array = (unsigned *)((char *)state->sq_ring + params.sq_off.array);
+  for (i = 0; i < params.sq_entries; ++i) {
+    array[i] = i;
+  }
+  state->cq_head = (unsigned *)((char *)state->cq_ring + params.cq_off.head);
+  state->cq_tail = (unsigned *)((char *)state->cq_ring + params.cq_off.tail);
+  state->cq_mask =
+      (unsigned *)((char *)state->cq_ring + params.cq_off.ring_mask);
+  state->cqes =
+      (struct io_uring_cqe *)((char *)state->cq_ring + params.cq_off.cqes);
+  return 0;
+}
+
+// Switches file operations from pblog_file_ops_open() to io_uring.  Returns
+// 0 on success, and leaves the operations unchanged on failure.
+static int uring_open(struct pblog_flash_ops *ops,
+                      const struct pblog_uring_options *options) {
+  struct uring_state *state = calloc(1, sizeof(*state));
+  if (state == NULL) {
+    return -1;
+  }
+  state->file = *ops;
+  state->fd = pblog_file_ops_fd(ops);
+  state->erased = malloc(URING_ERASE_CHUNK);
+  if (state->erased == NULL || uring_setup(state, options->queue_depth) != 0) {
+    free(state->erased);
+    free(state);
+    return -1;
+  }
+  memset(state->erased, 0xff, URING_ERASE_CHUNK);
+  state->submit_batch = options->submit_batch > 0 ? options->submit_batch : 1;
+  state->prefetch_state = URING_PREFETCH_NONE;
+#ifdef PBLOG_USE_PTHREADS
+  pthread_mutex_init(&state->lock, NULL);
+#endif
+
+  memset(ops, 0, sizeof(*ops));
+  ops->read = &uring_read;
+  ops->write = &uring_write;
+  ops->erase = &uring_erase;
+  ops->writev = &uring_writev;
+  ops->sync = &uring_sync;
+  ops->prefetch = &uring_prefetch;
+  ops->priv = state;
+  return 0;
+}
+
+#endif  // PBLOG_HAVE_IO_URING
+
+int pblog_uring_ops_open(struct pblog_flash_ops *ops, const char *filename,
+                         size_t size,
+                         const struct pblog_uring_options *options) {
+  struct pblog_uring_options defaults;
+  int rc;
+
+  if (options == NULL) {
+    memset(&defaults, 0, sizeof(defaults));
+    defaults.queue_depth = URING_DEFAULT_QUEUE_DEPTH;
+    defaults.submit_batch = URING_DEFAULT_SUBMIT_BATCH;
+    options = &defaults;
+  }
+
+  rc = pblog_file_ops_open(ops, filename, size, 0);
+  if (rc != PBLOG_SUCCESS || options->queue_depth == 0) {
+    return rc;
+  }
+
+#ifdef PBLOG_HAVE_IO_URING
+  if (uring_open(ops, options) != 0) {
+    PBLOG_DPRINTF("uring: io_uring unavailable, using synchronous writes\n");
+  }
+#endif
+  return PBLOG_SUCCESS;
+}
+
+int pblog_uring_ops_is_async(const struct pblog_flash_ops *ops) {
+#ifdef PBLOG_HAVE_IO_URING
+  return ops->read == &uring_read;
+#else
+  (void)ops;
+  return 0;
+#endif
+}
+
+void pblog_uring_ops_free(struct pblog_flash_ops *ops) {
+#ifdef PBLOG_HAVE_IO_URING
+  if (ops->read == &uring_read) {
+    struct uring_state *state = ops->priv;
+    uring_drain(state);
+    munmap(state->sqes, state->sqes_size);
+    munmap(state->cq_ring, state->cq_ring_size);
+    munmap(state->sq_ring, state->sq_ring_size);
+    close(state->ring_fd);
+    pblog_file_ops_free(&state->file);
+    free(state->prefetch_buf);
+    free(state->erased);
+#ifdef PBLOG_USE_PTHREADS
+    pthread_mutex_destroy(&state->lock);
+#endif
+    free(state);
+    ops->priv = NULL;
+    return;
+  }
+#endif
+  pblog_file_ops_free(ops);
+}
@@ -0,0 +1,196 @@
+#ifndef PBLOG_TEST_BENCH_HH
+#define PBLOG_TEST_BENCH_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <pblog/flash.h>
+
+namespace pblog_test {
+
+// Monotonic time in nanoseconds.
+inline uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Histogram of latencies in power of two microsecond buckets.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : buckets_(32), count_(0), max_ns_(0) {}
+
+  void Add(uint64_t ns) {
+    size_t bucket = 0;
+    while (bucket + 1 < buckets_.size() && (1000ull << bucket) <= ns) {
+      bucket++;
+    }
+    buckets_[bucket]++;
+    count_++;
+    if (ns > max_ns_) {
+      max_ns_ = ns;
+    }
+  }
+
+  // Returns the upper bound in microseconds of the bucket holding the
+  // given fraction of the samples.
+  uint64_t PercentileUs(double fraction) const {
+    size_t seen = 0;
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+      seen += buckets_[i];
+      if (seen >= count_ * fraction) {
+        return 1ull << i;
+      }
+    }
+    return 1ull << buckets_.size();
+  }
+
+  // Prints one line with the percentiles and the non-empty buckets.
+  void Print(const char *name) const {
+    printf("%s: p50<%lluus p99<%lluus p99.9<%lluus max=%.1fus |", name,
+           static_cast<unsigned long long>(PercentileUs(0.5)),
+           static_cast<unsigned long long>(PercentileUs(0.99)),
+           static_cast<unsigned long long>(PercentileUs(0.999)),
+           static_cast<double>(max_ns_) / 1000);
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+      if (buckets_[i] != 0) {
+        printf(" <%lluus:%zu", 1ull << i, buckets_[i]);
+      }
+    }
+    printf("\n");
+  }
+
+ private:
+  std::vector<size_t> buckets_;
+  size_t count_;
+  uint64_t max_ns_;
+};
+
+// Flash operations that forward to another backend and count every call.
+// Optionally adds a fixed latency to every read and write and a latency
+// proportional to the size of every erase, to model a slow device.
+class CountingFlash {
+ public:
+  // If with_writev is false the writev operation is hidden from users, as
+  // for a backend that does not implement it.
+  CountingFlash(pblog_flash_ops *backend, bool with_writev)
+      : backend_(backend), read_delay_us_(0), write_delay_us_(0),
+        erase_delay_us_per_kib_(0), ops_() {
+    ops_.read = &Read;
+    ops_.write = &Write;
+    ops_.erase = &Erase;
+    ops_.writev = with_writev && backend->writev ? &Writev : nullptr;
+    ops_.sync = backend->sync ? &Sync : nullptr;
+    ops_.prefetch = backend->prefetch ? &Prefetch : nullptr;
+    ops_.get_geometry = backend->get_geometry ? &GetGeometry : nullptr;
+    ops_.priv = this;
+    Reset();
+  }
+
+  pblog_flash_ops *ops() { return &ops_; }
+
+  void set_read_delay_us(unsigned delay_us) { read_delay_us_ = delay_us; }
+  void set_write_delay_us(unsigned delay_us) { write_delay_us_ = delay_us; }
+  void set_erase_delay_us_per_kib(unsigned delay_us) {
+    erase_delay_us_per_kib_ = delay_us;
+  }
+  // Hides the geometry of the backend from users, so that they do not align
+  // their writes to it.
+  void hide_geometry() { ops_.get_geometry = nullptr; }
+
+  void Reset() {
+    reads = writes = erases = syncs = 0;
+    read_bytes = write_bytes = 0;
+  }
+
+  std::atomic<size_t> reads;
+  std::atomic<size_t> writes;
+  std::atomic<size_t> erases;
+  std::atomic<size_t> syncs;
+  std::atomic<size_t> read_bytes;
+  std::atomic<size_t> write_bytes;
+
+ private:
+  static CountingFlash *Self(pblog_flash_ops *ops) {
+    return static_cast<CountingFlash *>(ops->priv);
+  }
+
+  static int Read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
+    CountingFlash *self = Self(ops);
+    self->reads++;
+    self->read_bytes += len;
+    if (self->read_delay_us_ != 0) {
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(self->read_delay_us_));
+    }
+    return self->backend_->read(self->backend_, offset, len, data);
+  }
+
+  static int Write(pblog_flash_ops *ops, int offset, size_t len,
+                   const void *data) {
+    CountingFlash *self = Self(ops);
+    self->writes++;
+    self->write_bytes += len;
+    self->WriteDelay();
+    return self->backend_->write(self->backend_, offset, len, data);
+  }
+
+  static int Writev(pblog_flash_ops *ops, int offset,
+                    const pblog_flash_iovec *iov, int iovcnt) {
+    CountingFlash *self = Self(ops);
+    self->writes++;
+    for (int i = 0; i < iovcnt; ++i) {
+      self->write_bytes += iov[i].len;
+    }
+    self->WriteDelay();
+    return self->backend_->writev(self->backend_, offset, iov, iovcnt);
+  }
+
+  static int Erase(pblog_flash_ops *ops, int offset, size_t len) {
+    CountingFlash *self = Self(ops);
+    self->erases++;
+    if (self->erase_delay_us_per_kib_ != 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(
+          self->erase_delay_us_per_kib_ * len / 1024));
+    }
+    return self->backend_->erase(self->backend_, offset, len);
+  }
+
+  static int Sync(pblog_flash_ops *ops) {
+    CountingFlash *self = Self(ops);
+    self->syncs++;
+    return self->backend_->sync(self->backend_);
+  }
+
+  static int Prefetch(pblog_flash_ops *ops, int offset, size_t len) {
+    CountingFlash *self = Self(ops);
+    return self->backend_->prefetch(self->backend_, offset, len);
+  }
+
+  static int GetGeometry(pblog_flash_ops *ops,
+                         pblog_flash_geometry *geometry) {
+    CountingFlash *self = Self(ops);
+    return self->backend_->get_geometry(self->backend_, geometry);
+  }
+
+  void WriteDelay() {
+    if (write_delay_us_ != 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(write_delay_us_));
+    }
+  }
+
+  pblog_flash_ops *backend_;
+  unsigned read_delay_us_;
+  unsigned write_delay_us_;
+  unsigned erase_delay_us_per_kib_;
+  pblog_flash_ops ops_;
+};
+
+}  // namespace pblog_test
+
+#endif
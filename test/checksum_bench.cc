@@ -0,0 +1,83 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <pblog/checksum.h>
+
+#include "bench.hh"
+
+namespace {
+
+using pblog_test::NowNs;
+using std::string;
+
+// Keeps the compiler from optimizing away the checksum calls.
+volatile uint32_t sink;
+
+uint32_t Sum8(uint32_t crc, const void *buf, size_t len) {
+  return crc + record_checksum(buf, len);
+}
+
+uint32_t Sum8Portable(uint32_t crc, const void *buf, size_t len) {
+  return crc + record_checksum_portable(buf, len);
+}
+
+// The byte at a time loop record_checksum() used to be.
+uint32_t Sum8Bytewise(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *p = static_cast<const unsigned char *>(buf);
+  unsigned char csum = 0;
+  for (size_t i = 0; i < len; ++i) {
+    csum += p[i];
+  }
+  return crc + csum;
+}
+
+void BenchChecksum(const char *name,
+                   uint32_t (*checksum)(uint32_t, const void *, size_t),
+                   size_t size) {
+  const size_t kTotalBytes = 256 * 1024 * 1024;
+  const string data(size, '\x5a');
+  const size_t iterations = kTotalBytes / size;
+
+  uint32_t crc = 0;
+  uint64_t start = NowNs();
+  for (size_t i = 0; i < iterations; ++i) {
+    crc = checksum(crc, data.data(), data.size());
+  }
+  uint64_t elapsed_ns = NowNs() - start;
+  sink = crc;
+
+  printf("checksum/%s/%zu: %.2f GB/s, %.1f ns/call\n", name, size,
+         static_cast<double>(iterations * size) / elapsed_ns,
+         static_cast<double>(elapsed_ns) / iterations);
+}
+
+}  // namespace
+
+int main() {
+  const size_t kSizes[] = {16, 32, 64, 128, 256, 512, 1024, 4096};
+  for (size_t size : kSizes) {
+    BenchChecksum("sum8", Sum8, size);
+    BenchChecksum("sum8_portable", Sum8Portable, size);
+    BenchChecksum("sum8_bytewise", Sum8Bytewise, size);
+    BenchChecksum("crc32c", pblog_crc32c, size);
+    BenchChecksum("crc32c_portable", pblog_crc32c_portable, size);
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdint>
+#include <string>
+
+#include <gtest/gtest.h>
+#include <pblog/checksum.h>
+
+namespace {
+
+using std::string;
+
+// Byte at a time reference for record_checksum().
+unsigned char Sum8(const string &data) {
+  unsigned char sum = 0;
+  for (char c : data) {
+    sum += static_cast<unsigned char>(c);
+  }
+  return sum;
+}
+
+TEST(RecordChecksumTest, MatchesReference) {
+  string data;
+  for (int i = 0; i < 1000; ++i) {
+    data.push_back(static_cast<char>(0xff - i * 3));
+  }
+
+  // Cover every alignment and tail length of the vector loops.
+  for (size_t start = 0; start < 32; ++start) {
+    for (size_t len = 0; start + len <= data.size(); len += 7) {
+      const string part = data.substr(start, len);
+      EXPECT_EQ(Sum8(part), record_checksum(part.data(), part.size()))
+          << "start " << start << " len " << len;
+      EXPECT_EQ(Sum8(part),
+                record_checksum_portable(part.data(), part.size()))
+          << "start " << start << " len " << len;
+    }
+  }
+}
+
+TEST(Crc32cTest, KnownValues) {
+  const string check("123456789");
+  EXPECT_EQ(0xe3069283u, pblog_crc32c(0, check.data(), check.size()));
+  EXPECT_EQ(0xe3069283u, pblog_crc32c_portable(0, check.data(), check.size()));
+
+  // Test vectors from RFC 3720, B.4.
+  const string zeros(32, '\0');
+  EXPECT_EQ(0x8a9136aau, pblog_crc32c(0, zeros.data(), zeros.size()));
+  const string ones(32, '\xff');
+  EXPECT_EQ(0x62a8ab43u, pblog_crc32c(0, ones.data(), ones.size()));
+
+  EXPECT_EQ(0u, pblog_crc32c(0, nullptr, 0));
+}
+
+TEST(Crc32cTest, MatchesPortable) {
+  string data;
+  for (int i = 0; i < 1000; ++i) {
+    data.push_back(static_cast<char>(i * 7 + (i >> 3)));
+  }
+
+  // Cover every alignment and tail length of the word-at-a-time loops.
+  for (size_t start = 0; start < 16; ++start) {
+    for (size_t len = 0; start + len <= data.size(); len += 13) {
+      EXPECT_EQ(pblog_crc32c_portable(0, &data[start], len),
+                pblog_crc32c(0, &data[start], len))
+          << "start " << start << " len " << len;
+    }
+  }
+}
+
+TEST(Crc32cTest, Continues) {
+  const string data("The quick brown fox jumps over the lazy dog");
+  uint32_t crc = pblog_crc32c(0, data.data(), data.size());
+  for (size_t split = 0; split <= data.size(); ++split) {
+    uint32_t partial = pblog_crc32c(0, data.data(), split);
+    EXPECT_EQ(crc, pblog_crc32c(partial, &data[split], data.size() - split));
+    partial = pblog_crc32c_portable(0, data.data(), split);
+    EXPECT_EQ(crc, pblog_crc32c_portable(partial, &data[split],
+                                         data.size() - split));
+  }
+}
+
+}  // namespace
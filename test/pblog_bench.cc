@@ -0,0 +1,640 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <pblog/common.h>
+#include <pblog/event.h>
+#include <pblog/mem.h>
+#include <pblog/pblog.h>
+#include <pblog/record.h>
+#include <pblog/sim.h>
+
+#include "bench.hh"
+
+#ifdef __GLIBC__
+// Counts every call to malloc, including those from the library, on top of
+// the glibc allocator.
+static std::atomic<size_t> g_mallocs(0);
+
+extern "C" void *__libc_malloc(size_t size);
+
+extern "C" void *malloc(size_t size) noexcept {
+  g_mallocs++;
+  return __libc_malloc(size);
+}
+#endif
+
+namespace {
+
+using pblog_test::CountingFlash;
+using pblog_test::LatencyHistogram;
+using pblog_test::NowNs;
+using std::string;
+
+const int kNumRegions = 8;
+const uint32_t kRegionSize = 16 * 1024;
+// Models NOR flash, scaled down: erasing a region takes ~1.6 ms.
+const unsigned kEraseDelayUsPerKib = 100;
+
+// Measures the latency of pblog_add_event() over several compactions of a
+// flash log.  log_options, if set, adds a memory log and may make the log
+// asynchronous.
+void BenchAddEvent(const char *name, const record_intf_options &options,
+                   const pblog_options *log_options = nullptr,
+                   unsigned write_delay_us = 0) {
+  const int kNumEvents = 20000;
+  string mem(kNumRegions * kRegionSize, '\xff');
+  pblog_flash_ops mem_ops;
+  pblog_mem_ops_init(&mem_ops, &mem[0]);
+  CountingFlash counting(&mem_ops, true);
+
+  record_region regions[kNumRegions];
+  for (int i = 0; i < kNumRegions; ++i) {
+    regions[i] = record_region();
+    regions[i].offset = i * kRegionSize;
+    regions[i].size = kRegionSize;
+  }
+  record_intf ri;
+  record_intf_init_options(&ri, regions, kNumRegions, counting.ops(),
+                           &options);
+  pblog log;
+  log.get_current_bootnum = nullptr;
+  log.get_time_now = nullptr;
+  string mem_log(kNumRegions * kRegionSize, '\xff');
+  if (log_options != nullptr) {
+    pblog_options init_options = *log_options;
+    init_options.allow_clear_on_add = 1;
+    init_options.mem_addr = &mem_log[0];
+    init_options.mem_size = mem_log.size();
+    pblog_init_options(&log, &ri, &init_options);
+  } else {
+    pblog_init(&log, 1, &ri, nullptr, 0);
+  }
+  counting.set_erase_delay_us_per_kib(kEraseDelayUsPerKib);
+  counting.set_write_delay_us(write_delay_us);
+
+  LatencyHistogram histogram;
+  for (int i = 0; i < kNumEvents; ++i) {
+    pblog_Event event;
+    event_init(&event);
+    event.has_type = true;
+    event.type = pblog_TYPE_BOOT_UP;
+    event.has_boot_number = true;
+    event.boot_number = i;
+    uint64_t start = NowNs();
+    log.add_event(&log, &event);
+    histogram.Add(NowNs() - start);
+    event_free(&event);
+  }
+  uint64_t start = NowNs();
+  pblog_flush(&log);
+  uint64_t flush_ns = NowNs() - start;
+  histogram.Print(name);
+  if (log_options != nullptr && log_options->async_queue_size > 0) {
+    printf("%s: final pblog_flush %.1fus\n", name,
+           static_cast<double>(flush_ns) / 1000);
+  }
+
+  pblog_free(&log);
+  record_intf_free(&ri);
+  pblog_mem_ops_free(&mem_ops);
+}
+
+// Measures logging groups of events with a loop of add_event (batch 0) or
+// with add_events, with a memory log and writes that take write_delay_us.
+void BenchAddEvents(const char *name, size_t batch, unsigned write_delay_us) {
+  const size_t kNumEvents = 20000;
+  const size_t kGroupSize = 32;
+  string mem(kNumRegions * kRegionSize, '\xff');
+  pblog_flash_ops mem_ops;
+  pblog_mem_ops_init(&mem_ops, &mem[0]);
+  CountingFlash counting(&mem_ops, true);
+
+  record_region regions[kNumRegions];
+  for (int i = 0; i < kNumRegions; ++i) {
+    regions[i] = record_region();
+    regions[i].offset = i * kRegionSize;
+    regions[i].size = kRegionSize;
+  }
+  record_intf ri;
+  record_intf_init(&ri, regions, kNumRegions, counting.ops());
+  pblog log;
+  log.get_current_bootnum = nullptr;
+  log.get_time_now = nullptr;
+  string mem_log(kNumRegions * kRegionSize, '\xff');
+  pblog_init(&log, 1, &ri, &mem_log[0], mem_log.size());
+  counting.set_write_delay_us(write_delay_us);
+  counting.Reset();
+
+  std::vector<pblog_Event> events(kGroupSize);
+  uint64_t total_ns = 0;
+  for (size_t n = 0; n < kNumEvents; n += kGroupSize) {
+    for (size_t i = 0; i < kGroupSize; ++i) {
+      event_init(&events[i]);
+      events[i].has_type = true;
+      events[i].type = pblog_TYPE_BOOT_UP;
+      events[i].has_boot_number = true;
+      events[i].boot_number = n + i;
+    }
+    uint64_t start = NowNs();
+    if (batch == 0) {
+      for (size_t i = 0; i < kGroupSize; ++i) {
+        log.add_event(&log, &events[i]);
+      }
+    } else {
+      for (size_t i = 0; i < kGroupSize; i += batch) {
+        log.add_events(&log, &events[i], std::min(batch, kGroupSize - i));
+      }
+    }
+    total_ns += NowNs() - start;
+    for (size_t i = 0; i < kGroupSize; ++i) {
+      event_free(&events[i]);
+    }
+  }
+  printf("%s: %.2fus/event, %.3f flash writes/event\n", name,
+         static_cast<double>(total_ns) / kNumEvents / 1000,
+         static_cast<double>(counting.writes) / kNumEvents);
+
+  pblog_free(&log);
+  record_intf_free(&ri);
+  pblog_mem_ops_free(&mem_ops);
+}
+
+pblog_status CountThermalTrips(int valid, const pblog_Event *event,
+                               void *priv) {
+  if (valid && event->type == pblog_TYPE_THERMAL_TRIP) {
+    (*static_cast<size_t *>(priv))++;
+  }
+  return PBLOG_SUCCESS;
+}
+
+// Measures finding the 1% of events of one type in a full log with a memory
+// copy, decoding every event or filtering on the encoded type.
+void BenchMatchingEvents() {
+  const int kNumScans = 50;
+  string mem(kNumRegions * kRegionSize, '\xff');
+  pblog_flash_ops mem_ops;
+  pblog_mem_ops_init(&mem_ops, &mem[0]);
+  record_region regions[kNumRegions];
+  for (int i = 0; i < kNumRegions; ++i) {
+    regions[i] = record_region();
+    regions[i].offset = i * kRegionSize;
+    regions[i].size = kRegionSize;
+  }
+  record_intf ri;
+  record_intf_init(&ri, regions, kNumRegions, &mem_ops);
+  pblog log;
+  log.get_current_bootnum = nullptr;
+  log.get_time_now = nullptr;
+  string mem_log(kNumRegions * kRegionSize, '\xff');
+  pblog_init(&log, 0, &ri, &mem_log[0], mem_log.size());
+
+  size_t num_events = 0;
+  while (true) {
+    pblog_Event event;
+    event_init(&event);
+    event.has_type = true;
+    event.type = num_events % 100 == 0 ? pblog_TYPE_THERMAL_TRIP
+                                       : pblog_TYPE_MEMORY_RUNTIME_ERROR;
+    event.has_timestamp = true;
+    event.timestamp = 1500000000 + num_events;
+    event.has_boot_number = true;
+    event.boot_number = num_events / 100;
+    event_add_kv_data(&event, "dimm", "DIMM_A1");
+    event_add_kv_data(&event, "address", "0x0000001234567000");
+    int rc = log.add_event(&log, &event);
+    event_free(&event);
+    if (rc != 0) {
+      break;
+    }
+    num_events++;
+  }
+
+  const pblog_event_type kThermal[] = {pblog_TYPE_THERMAL_TRIP};
+  pblog_filter filter = {};
+  filter.types = kThermal;
+  filter.num_types = 1;
+  for (int filtered = 0; filtered < 2; ++filtered) {
+    size_t matches = 0;
+    pblog_Event event;
+    event_init(&event);
+    uint64_t start = NowNs();
+    for (int i = 0; i < kNumScans; ++i) {
+      if (filtered) {
+        log.for_each_matching_event(&log, &filter, CountThermalTrips, &event,
+                                    &matches);
+      } else {
+        log.for_each_event(&log, CountThermalTrips, &event, &matches);
+      }
+    }
+    uint64_t scan_ns = (NowNs() - start) / kNumScans;
+    event_free(&event);
+    printf("matching_events/%s: %zu events, %zu matches, %.1fus/scan\n",
+           filtered ? "filter" : "decode_all", num_events,
+           matches / kNumScans, static_cast<double>(scan_ns) / 1000);
+  }
+
+  pblog_free(&log);
+  record_intf_free(&ri);
+  pblog_mem_ops_free(&mem_ops);
+}
+
+pblog_status CountEvents(int valid, const pblog_Event *event, void *priv) {
+  (void)valid;
+  (void)event;
+  (*static_cast<size_t *>(priv))++;
+  return PBLOG_SUCCESS;
+}
+
+// Measures finding the events of one boot in a full flash log of many
+// regions on a simulated SPI NOR device, without a memory log.
+void BenchBootQuery(bool summaries) {
+  const int kManyRegions = 256;
+  const int kNumQueries = 20;
+  pblog_sim_options sim_options = {};
+  sim_options.size = kManyRegions * 4096;
+  sim_options.read_ns = 2000;
+  sim_options.read_ns_per_byte = 40;
+  pblog_flash_ops sim;
+  pblog_sim_ops_init(&sim, &sim_options);
+  pblog_flash_geometry geometry;
+  sim.get_geometry(&sim, &geometry);
+  record_region regions[kManyRegions];
+  record_regions_from_geometry(&geometry, 0, sim_options.size, kManyRegions,
+                               regions);
+  record_intf_options options = {};
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  if (summaries) {
+    pblog_summary_options(&options);
+  }
+  record_intf ri;
+  record_intf_init_options(&ri, regions, kManyRegions, &sim, &options);
+  pblog log;
+  log.get_current_bootnum = nullptr;
+  log.get_time_now = nullptr;
+  pblog_init(&log, 0, &ri, nullptr, 0);
+
+  uint32_t num_events = 0;
+  while (true) {
+    pblog_Event event;
+    event_init(&event);
+    event.has_type = true;
+    event.type = pblog_TYPE_BOOT_UP;
+    event.has_timestamp = true;
+    event.timestamp = 1500000000 + num_events;
+    event.has_boot_number = true;
+    event.boot_number = num_events / 200;
+    if (log.add_event(&log, &event) != 0) {
+      break;
+    }
+    num_events++;
+  }
+
+  pblog_filter filter = {};
+  filter.has_boot_range = 1;
+  filter.boot_min = filter.boot_max = num_events / 200 / 2;
+  size_t matches = 0;
+  pblog_Event event;
+  event_init(&event);
+  pblog_sim_reset_stats(&sim);
+  uint64_t start = NowNs();
+  for (int i = 0; i < kNumQueries; ++i) {
+    log.for_each_matching_event(&log, &filter, CountEvents, &event, &matches);
+  }
+  uint64_t query_ns = (NowNs() - start) / kNumQueries;
+  pblog_sim_stats stats;
+  pblog_sim_get_stats(&sim, &stats);
+  printf("boot_query/%s: %u events, %zu matches, %.1fus/query, "
+         "%llu bytes read/query, simulated %.1fus/query\n",
+         summaries ? "summaries" : "scan", num_events, matches / kNumQueries,
+         static_cast<double>(query_ns) / 1000,
+         static_cast<unsigned long long>(stats.bytes_read / kNumQueries),
+         static_cast<double>(stats.time_ns) / kNumQueries / 1000);
+
+  pblog_free(&log);
+  record_intf_free(&ri);
+  pblog_sim_ops_free(&sim);
+}
+
+// Measures pblog_init() on a full flash log on a simulated SPI NOR device,
+// for events carrying key/value data.
+void BenchStartup(const char *name, bool fast_init) {
+  const int kManyRegions = 256;
+  const int kNumInits = 10;
+  pblog_sim_options sim_options = {};
+  sim_options.size = kManyRegions * 4096;
+  sim_options.read_ns = 2000;
+  sim_options.read_ns_per_byte = 40;
+  pblog_flash_ops sim;
+  pblog_sim_ops_init(&sim, &sim_options);
+  pblog_flash_geometry geometry;
+  sim.get_geometry(&sim, &geometry);
+  record_region regions[kManyRegions];
+  record_regions_from_geometry(&geometry, 0, sim_options.size, kManyRegions,
+                               regions);
+  record_intf_options options = {};
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  record_intf ri;
+  record_intf_init_options(&ri, regions, kManyRegions, &sim, &options);
+  pblog log;
+  log.get_current_bootnum = nullptr;
+  log.get_time_now = nullptr;
+  pblog_init(&log, 0, &ri, nullptr, 0);
+  int num_events = 1;
+  while (true) {
+    pblog_Event event;
+    event_init(&event);
+    event.has_type = true;
+    event.type = pblog_TYPE_MEMORY_RUNTIME_ERROR;
+    event.has_boot_number = true;
+    event.boot_number = num_events;
+    event_add_kv_data(&event, "dimm", "DIMM_A1");
+    int rc = log.add_event(&log, &event);
+    event_free(&event);
+    if (rc != 0) {
+      break;
+    }
+    num_events++;
+  }
+  pblog_free(&log);
+  record_intf_free(&ri);
+
+  pblog_options log_options = {};
+  log_options.fast_init = fast_init;
+  uint64_t init_ns = 0;
+  int found = 0;
+  pblog_sim_reset_stats(&sim);
+  for (int i = 0; i < kNumInits; ++i) {
+    record_intf_init_options(&ri, regions, kManyRegions, &sim, &options);
+    uint64_t start = NowNs();
+    found = pblog_init_options(&log, &ri, &log_options);
+    init_ns += NowNs() - start;
+    pblog_free(&log);
+    record_intf_free(&ri);
+  }
+  pblog_sim_stats stats;
+  pblog_sim_get_stats(&sim, &stats);
+  printf("%s: %d events, pblog_init returned %d, %.1fus/init, "
+         "simulated %.1fus/init including record_intf_init\n",
+         name, num_events, found,
+         static_cast<double>(init_ns) / kNumInits / 1000,
+         static_cast<double>(stats.time_ns) / kNumInits / 1000);
+  pblog_sim_ops_free(&sim);
+}
+
+// Measures pblog_init() with a memory log after a warm reboot, on a full
+// flash log on a simulated SPI NOR device.  Without reuse the memory log
+// starts out erased and is copied again from flash on every boot.
+void BenchWarmBoot(const char *name, bool reuse) {
+  const int kManyRegions = 64;
+  const int kNumInits = 10;
+  pblog_sim_options sim_options = {};
+  sim_options.size = kManyRegions * 4096;
+  sim_options.read_ns = 2000;
+  sim_options.read_ns_per_byte = 40;
+  pblog_flash_ops sim;
+  pblog_sim_ops_init(&sim, &sim_options);
+  pblog_flash_geometry geometry;
+  sim.get_geometry(&sim, &geometry);
+  record_region regions[kManyRegions];
+  record_regions_from_geometry(&geometry, 0, sim_options.size, kManyRegions,
+                               regions);
+  record_intf_options options = {};
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  string mem_log(sim_options.size + 1024, '\xff');
+  pblog_options log_options = {};
+  log_options.mem_addr = &mem_log[0];
+  log_options.mem_size = mem_log.size();
+  log_options.mem_reuse = reuse;
+  record_intf ri;
+  record_intf_init_options(&ri, regions, kManyRegions, &sim, &options);
+  pblog log;
+  log.get_current_bootnum = nullptr;
+  log.get_time_now = nullptr;
+  pblog_init_options(&log, &ri, &log_options);
+  int num_events = 1;
+  while (true) {
+    pblog_Event event;
+    event_init(&event);
+    event.has_type = true;
+    event.type = pblog_TYPE_MEMORY_RUNTIME_ERROR;
+    event.has_boot_number = true;
+    event.boot_number = num_events;
+    event_add_kv_data(&event, "dimm", "DIMM_A1");
+    int rc = log.add_event(&log, &event);
+    event_free(&event);
+    if (rc != 0) {
+      break;
+    }
+    num_events++;
+  }
+  pblog_free(&log);
+  record_intf_free(&ri);
+
+  uint64_t init_ns = 0;
+  int found = 0;
+  pblog_sim_stats stats = {};
+  for (int i = 0; i < kNumInits; ++i) {
+    if (!reuse) {
+      mem_log.assign(mem_log.size(), '\xff');
+    }
+    record_intf_init_options(&ri, regions, kManyRegions, &sim, &options);
+    pblog_sim_reset_stats(&sim);
+    uint64_t start = NowNs();
+    found = pblog_init_options(&log, &ri, &log_options);
+    init_ns += NowNs() - start;
+    pblog_sim_stats init_stats;
+    pblog_sim_get_stats(&sim, &init_stats);
+    stats.bytes_read += init_stats.bytes_read;
+    stats.time_ns += init_stats.time_ns;
+    pblog_free(&log);
+    record_intf_free(&ri);
+  }
+  printf("%s: %d events, pblog_init returned %d, %.1fus/init, "
+         "%llu bytes read/init, simulated %.1fus/init\n",
+         name, num_events, found,
+         static_cast<double>(init_ns) / kNumInits / 1000,
+         static_cast<unsigned long long>(stats.bytes_read / kNumInits),
+         static_cast<double>(stats.time_ns) / kNumInits / 1000);
+  pblog_sim_ops_free(&sim);
+}
+
+// Returns the number of calls to malloc so far, or 0 if they are not
+// counted.
+size_t MallocCount() {
+#ifdef __GLIBC__
+  return g_mallocs;
+#else
+  return 0;
+#endif
+}
+
+// Measures the heap allocations and time of decoding events with two
+// key/value pairs, one at a time and in full scans of a log in memory.
+void BenchDecodeAllocations() {
+  const int kNumDecodes = 100000;
+  const int kNumScans = 50;
+  pblog_Event event;
+  event_init(&event);
+  event.has_type = true;
+  event.type = pblog_TYPE_MEMORY_RUNTIME_ERROR;
+  event_add_kv_data(&event, "dimm", "DIMM_A1");
+  event_add_kv_data(&event, "address", "0x0000001234567000");
+  char buf[PBLOG_MAX_EVENT_SIZE];
+  int len = event_encode(&event, buf, sizeof(buf));
+  event_free(&event);
+
+  for (int use_arena = 0; use_arena < 2; ++use_arena) {
+    char arena_buf[PBLOG_MAX_EVENT_SIZE];
+    event_arena arena;
+    event_arena_init(&arena, arena_buf, sizeof(arena_buf));
+    event_init(&event);
+    size_t mallocs = MallocCount();
+    uint64_t start = NowNs();
+    for (int i = 0; i < kNumDecodes; ++i) {
+      if (use_arena) {
+        event_arena_reset(&arena);
+        event_decode_arena(buf, len, &event, &arena);
+      } else {
+        event_decode(buf, len, &event);
+      }
+    }
+    uint64_t decode_ns = NowNs() - start;
+    mallocs = MallocCount() - mallocs;
+    event_free(&event);
+    printf("decode/%s: %.1fns/event, %.2f mallocs/event\n",
+           use_arena ? "arena" : "heap",
+           static_cast<double>(decode_ns) / kNumDecodes,
+           static_cast<double>(mallocs) / kNumDecodes);
+  }
+
+  string mem(kNumRegions * kRegionSize, '\xff');
+  pblog_flash_ops mem_ops;
+  pblog_mem_ops_init(&mem_ops, &mem[0]);
+  record_region regions[kNumRegions];
+  for (int i = 0; i < kNumRegions; ++i) {
+    regions[i] = record_region();
+    regions[i].offset = i * kRegionSize;
+    regions[i].size = kRegionSize;
+  }
+  record_intf ri;
+  record_intf_init(&ri, regions, kNumRegions, &mem_ops);
+  pblog log;
+  log.get_current_bootnum = nullptr;
+  log.get_time_now = nullptr;
+  string mem_log(kNumRegions * kRegionSize, '\xff');
+  pblog_init(&log, 0, &ri, &mem_log[0], mem_log.size());
+  while (true) {
+    event_init(&event);
+    event_add_kv_data(&event, "dimm", "DIMM_A1");
+    event_add_kv_data(&event, "address", "0x0000001234567000");
+    int rc = log.add_event(&log, &event);
+    event_free(&event);
+    if (rc != 0) {
+      break;
+    }
+  }
+
+  size_t num_events = 0;
+  event_init(&event);
+  size_t mallocs = MallocCount();
+  uint64_t start = NowNs();
+  for (int i = 0; i < kNumScans; ++i) {
+    log.for_each_event(&log, CountEvents, &event, &num_events);
+  }
+  uint64_t scan_ns = NowNs() - start;
+  mallocs = MallocCount() - mallocs;
+  event_free(&event);
+  printf("for_each_event: %zu events, %.1fus/scan, %zu mallocs/scan\n",
+         num_events / kNumScans, static_cast<double>(scan_ns) / kNumScans / 1000,
+         mallocs / kNumScans);
+
+  pblog_free(&log);
+  record_intf_free(&ri);
+  pblog_mem_ops_free(&mem_ops);
+}
+
+}  // namespace
+
+int main() {
+  record_intf_options options = {};
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  BenchAddEvent("add_event/sync_erase", options);
+
+  // Nothing erases the spare region in the background, so the append that
+  // needs it finishes the erase.
+  options.spare_regions = 1;
+  BenchAddEvent("add_event/spare", options);
+
+  options.erase_chunk_size = 1024;
+  options.erase_chunks_per_append = 1;
+  BenchAddEvent("add_event/spare+1KiB_per_append", options);
+
+  // Writes that take 20us, with a memory log mirrored synchronously or by
+  // the background writer.
+  options = record_intf_options();
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.spare_regions = 1;
+  options.erase_chunk_size = 1024;
+  options.erase_chunks_per_append = 1;
+  pblog_options log_options = {};
+  BenchAddEvent("add_event/slow_write/sync", options, &log_options, 20);
+  log_options.async_queue_size = 64 * 1024;
+  log_options.async_batch = 16;
+  BenchAddEvent("add_event/slow_write/async", options, &log_options, 20);
+  log_options.async_queue_size = 1024;
+  BenchAddEvent("add_event/slow_write/async_small_queue", options,
+                &log_options, 20);
+
+  // Compactions of a memory log copied back from flash or mirroring the
+  // flash regions.  The region erase is spread over the appends.
+  log_options = pblog_options();
+  BenchAddEvent("add_event/memlog/resync", options, &log_options);
+  log_options.mem_mirror_regions = 1;
+  BenchAddEvent("add_event/memlog/mirror", options, &log_options);
+
+  // Groups of 32 events logged one by one or in batches.
+  BenchAddEvents("add_events/loop", 0, 0);
+  BenchAddEvents("add_events/batch8", 8, 0);
+  BenchAddEvents("add_events/batch32", 32, 0);
+  BenchAddEvents("add_events/slow_write/loop", 0, 20);
+  BenchAddEvents("add_events/slow_write/batch8", 8, 20);
+  BenchAddEvents("add_events/slow_write/batch32", 32, 20);
+
+  BenchMatchingEvents();
+
+  BenchBootQuery(false);
+  BenchBootQuery(true);
+
+  BenchStartup("startup/count", false);
+  BenchStartup("startup/fast_init", true);
+
+  BenchWarmBoot("warm_boot/resync", false);
+  BenchWarmBoot("warm_boot/reuse", true);
+
+  BenchDecodeAllocations();
+  return 0;
+}
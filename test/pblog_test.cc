@@ -14,14 +14,18 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
 #include <pblog/event.h>
 #include <pblog/file.h>
+#include <pblog/mem.h>
 #include <pblog/pblog.h>
 #include <pblog/record.h>
+#include <pblog/sim.h>
 
 #include "common.hh"
 
@@ -38,10 +42,12 @@ class PblogFileTest : public ::testing::Test {
     mem_log_ = nullptr;
     pblog_ = nullptr;
     events = new vector<pblog_Event *>;
+    pblog_file_ops_init(&flash_, filename_.c_str());
   }
 
   ~PblogFileTest() override {
     clear_state();
+    pblog_file_ops_free(&flash_);
     delete events;
 
     unlink(filename_.c_str());
@@ -58,11 +64,9 @@ class PblogFileTest : public ::testing::Test {
 
     flash_ri_ =
         static_cast<struct record_intf *>(malloc(sizeof(struct record_intf)));
-    pblog_file_ops.priv = static_cast<void *>(
-        const_cast<char *>(filename_.c_str()));
     record_intf_init(flash_ri_,
                      static_cast<struct record_region *>(file_regions), 2,
-                     &pblog_file_ops);
+                     &flash_);
 
     mem_log_ = malloc(size0 + size1);
 
@@ -89,6 +93,7 @@ class PblogFileTest : public ::testing::Test {
     free(mem_log_);
   }
 
+  pblog_flash_ops flash_;
   record_intf *flash_ri_;
   void *mem_log_;
   pblog *pblog_;
@@ -180,6 +185,31 @@ TEST_F(PblogFileTest, LogSecondRegion) {
   ASSERT_EQ(static_cast<size_t>(1 + num_events), events->size());
 }
 
+TEST_F(PblogFileTest, LogReverse) {
+  // First region is small so that events span both regions.
+  init_2regions(0, 30, 0x100, 0xff);
+  pblog_Event event;
+
+  size_t num_events = 10;
+  for (size_t i = 0; i < num_events; ++i) {
+    pblog_Event event;
+    event_init(&event);
+    event.type = pblog_TYPE_BOOT_UP;
+    event.has_boot_number = true;
+    event.boot_number = i;
+    EXPECT_EQ(0, pblog_->add_event(pblog_, &event));
+    event_free(&event);
+  }
+
+  EXPECT_EQ(0, pblog_->for_each_event_reverse(pblog_, collect_events_cb,
+                                              &event, nullptr));
+  ASSERT_EQ(1 + num_events, events->size());
+  for (size_t i = 0; i < num_events; ++i) {
+    EXPECT_EQ(num_events - 1 - i, events->at(i)->boot_number);
+  }
+  EXPECT_EQ(pblog_TYPE_LOG_CLEARED, events->at(num_events)->type);
+}
+
 TEST_F(PblogFileTest, LogFull) {
   // Both regions are small.
   init_2regions(0, 30, 0x100, 30);
@@ -246,4 +276,870 @@ TEST_F(PblogFileTest, LogPersists) {
   ASSERT_EQ(static_cast<size_t>(1), events->size());
 }
 
+pblog_status count_boot_events_cb(int valid, const pblog_Event *event,
+                                  void *priv) {  // NOLINT
+  if (valid && event->type == pblog_TYPE_BOOT_UP) {
+    (*static_cast<size_t *>(priv))++;
+  }
+  return PBLOG_SUCCESS;
+}
+
+pblog_status count_clear_events_cb(int valid, const pblog_Event *event,
+                                   void *priv) {  // NOLINT
+  if (valid && event->type == pblog_TYPE_LOG_CLEARED) {
+    (*static_cast<size_t *>(priv))++;
+  }
+  return PBLOG_SUCCESS;
+}
+
+// Logs with their own backends do not share state and can run in parallel.
+TEST(PblogMemTest, IndependentLogs) {
+  const int kNumLogs = 4;
+  const size_t kRegionSize = 0x400;
+  const size_t kNumEvents = 200;
+  vector<size_t> counts(kNumLogs);
+  vector<std::thread> threads;
+  for (int i = 0; i < kNumLogs; ++i) {
+    threads.emplace_back([&counts, i, kRegionSize, kNumEvents] {
+      string flash_mem(2 * kRegionSize, '\xff');
+      string mem_log(2 * kRegionSize, '\xff');
+      pblog_flash_ops flash;
+      ASSERT_EQ(0, pblog_mem_ops_init(&flash, &flash_mem[0]));
+      record_region regions[2] = {};
+      regions[0].size = kRegionSize;
+      regions[1].offset = kRegionSize;
+      regions[1].size = kRegionSize;
+      record_intf flash_ri;
+      ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 2, &flash));
+
+      pblog log = {};
+      pblog_init(&log, 1, &flash_ri, &mem_log[0], mem_log.size());
+      for (size_t n = 0; n < kNumEvents; ++n) {
+        pblog_Event event;
+        event_init(&event);
+        event.has_type = true;
+        event.type = pblog_TYPE_BOOT_UP;
+        EXPECT_EQ(0, log.add_event(&log, &event));
+        event_free(&event);
+      }
+      pblog_Event event;
+      EXPECT_EQ(0, log.for_each_event(&log, count_boot_events_cb, &event,
+                                      &counts[i]));
+
+      pblog_free(&log);
+      record_intf_free(&flash_ri);
+      pblog_mem_ops_free(&flash);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int i = 0; i < kNumLogs; ++i) {
+    // Old events are cleared to make room, but every log keeps its newest.
+    EXPECT_LT(0u, counts[i]);
+    EXPECT_EQ(counts[0], counts[i]);
+  }
+}
+
+TEST(PblogMemTest, AddEventsMatchesAddEvent) {
+  const size_t kRegionSize = 0x400;
+  const size_t kNumEvents = 300;
+  // Logs the same events one by one and in batches of several sizes.  Both
+  // compact at the same events and end up with the same flash contents.
+  string expected_flash;
+  for (size_t batch : {0, 1, 7, 100}) {
+    string flash_mem(2 * kRegionSize, '\xff');
+    string mem_log(2 * kRegionSize, '\xff');
+    pblog_flash_ops flash;
+    ASSERT_EQ(0, pblog_mem_ops_init(&flash, &flash_mem[0]));
+    record_region regions[2] = {};
+    regions[0].size = kRegionSize;
+    regions[1].offset = kRegionSize;
+    regions[1].size = kRegionSize;
+    record_intf flash_ri;
+    ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 2, &flash));
+    pblog log = {};
+    pblog_init(&log, 1, &flash_ri, &mem_log[0], mem_log.size());
+
+    vector<pblog_Event> events(kNumEvents);
+    for (size_t n = 0; n < kNumEvents; ++n) {
+      event_init(&events[n]);
+      events[n].has_type = true;
+      events[n].type = pblog_TYPE_BOOT_UP;
+      events[n].has_boot_number = true;
+      events[n].boot_number = n;
+    }
+    for (size_t n = 0; n < kNumEvents; n += batch > 0 ? batch : 1) {
+      if (batch == 0) {
+        EXPECT_EQ(0, log.add_event(&log, &events[n]));
+      } else {
+        size_t count = std::min(batch, kNumEvents - n);
+        EXPECT_EQ(0, log.add_events(&log, &events[n], count)) << batch;
+      }
+    }
+    for (pblog_Event &event : events) {
+      event_free(&event);
+    }
+
+    size_t in_memory = 0;
+    pblog_Event event;
+    EXPECT_EQ(0, log.for_each_event(&log, count_boot_events_cb, &event,
+                                    &in_memory));
+    EXPECT_LT(0u, in_memory);
+    if (batch == 0) {
+      expected_flash = flash_mem;
+    } else {
+      EXPECT_EQ(expected_flash, flash_mem) << batch;
+    }
+
+    pblog_free(&log);
+    record_intf_free(&flash_ri);
+    pblog_mem_ops_free(&flash);
+  }
+}
+
+pblog_status collect_boot_numbers_cb(int valid, const pblog_Event *event,
+                                    void *priv) {  // NOLINT
+  if (valid && event->type == pblog_TYPE_BOOT_UP) {
+    static_cast<vector<uint32_t> *>(priv)->push_back(event->boot_number);
+  }
+  return PBLOG_SUCCESS;
+}
+
+TEST(PblogMemTest, MirrorRegions) {
+  const size_t kRegionSize = 0x400;
+  const int kNumRegions = 4;
+  // Flash records may have larger headers than those of the memory log, so
+  // the memory regions do not fill up at the same events.
+  for (record_format format : {RECORD_FORMAT_SUM8, RECORD_FORMAT_CRC32C}) {
+    for (int spare_regions : {0, 1}) {
+      string flash_mem(kNumRegions * kRegionSize, '\xff');
+      string mem_log(kNumRegions * kRegionSize, '\xff');
+      pblog_flash_ops flash;
+      ASSERT_EQ(0, pblog_mem_ops_init(&flash, &flash_mem[0]));
+      record_region regions[kNumRegions] = {};
+      for (int i = 0; i < kNumRegions; ++i) {
+        regions[i].offset = i * kRegionSize;
+        regions[i].size = kRegionSize;
+      }
+      record_intf_options ri_options = {};
+      ri_options.format = format;
+      ri_options.spare_regions = spare_regions;
+      ri_options.erase_chunks_per_append = spare_regions;
+      record_intf flash_ri;
+      ASSERT_EQ(0, record_intf_init_options(&flash_ri, regions, kNumRegions,
+                                            &flash, &ri_options));
+
+      pblog_options options = {};
+      options.allow_clear_on_add = 1;
+      options.mem_addr = &mem_log[0];
+      options.mem_size = kRegionSize;
+      options.mem_mirror_regions = 1;
+      pblog log = {};
+      EXPECT_EQ(PBLOG_ERR_INVALID,
+                pblog_init_options(&log, &flash_ri, &options));
+      options.mem_size = mem_log.size();
+      ASSERT_LT(0, pblog_init_options(&log, &flash_ri, &options));
+
+      vector<pblog_Event> events(10);
+      for (uint32_t n = 0; n < 1000; n += events.size()) {
+        for (size_t i = 0; i < events.size(); ++i) {
+          event_init(&events[i]);
+          events[i].has_type = true;
+          events[i].type = pblog_TYPE_BOOT_UP;
+          events[i].has_boot_number = true;
+          events[i].boot_number = n + i;
+        }
+        if (n % 20 == 0) {
+          EXPECT_EQ(0, log.add_events(&log, events.data(), events.size()));
+        } else {
+          for (pblog_Event &event : events) {
+            EXPECT_EQ(0, log.add_event(&log, &event));
+          }
+        }
+        for (pblog_Event &event : events) {
+          event_free(&event);
+        }
+      }
+
+      // The memory log still holds exactly the events on flash.
+      vector<uint32_t> in_memory;
+      pblog_Event event;
+      EXPECT_EQ(0, log.for_each_event(&log, collect_boot_numbers_cb, &event,
+                                      &in_memory));
+      pblog_free(&log);
+      pblog flash_log = {};
+      EXPECT_LT(0, pblog_init(&flash_log, 0, &flash_ri, nullptr, 0));
+      vector<uint32_t> on_flash;
+      EXPECT_EQ(0, flash_log.for_each_event(
+                       &flash_log, collect_boot_numbers_cb, &event,
+                       &on_flash));
+      pblog_free(&flash_log);
+      EXPECT_LT(100u, on_flash.size());
+      EXPECT_GT(1000u, on_flash.size());
+      EXPECT_EQ(on_flash, in_memory) << format << " " << spare_regions;
+
+      record_intf_free(&flash_ri);
+      pblog_mem_ops_free(&flash);
+    }
+  }
+}
+
+pblog_status collect_matching_cb(int valid, const pblog_Event *event,
+                                 void *priv) {  // NOLINT
+  EXPECT_EQ(1, valid);
+  static_cast<vector<uint32_t> *>(priv)->push_back(event->timestamp);
+  return PBLOG_SUCCESS;
+}
+
+TEST(PblogMemTest, WarmRebootReusesMemoryLog) {
+  pblog_sim_options sim_options = {};
+  sim_options.size = 4 * 0x1000;
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_sim_ops_init(&flash, &sim_options));
+  pblog_flash_geometry geometry;
+  ASSERT_EQ(0, flash.get_geometry(&flash, &geometry));
+  record_region regions[4];
+  ASSERT_EQ(0, record_regions_from_geometry(&geometry, 0, sim_options.size, 4,
+                                            regions));
+  string mem_log(64 + sim_options.size, '\xff');
+  record_intf flash_ri;
+  pblog log = {};
+
+  // Restarts the log as after a warm reboot, returning the bytes of flash
+  // read by pblog_init_options().
+  auto reboot = [&](const pblog_options &options) -> uint64_t {
+    pblog_free(&log);
+    record_intf_free(&flash_ri);
+    EXPECT_EQ(0, record_intf_init(&flash_ri, regions, 4, &flash));
+    pblog_sim_reset_stats(&flash);
+    EXPECT_LT(0, pblog_init_options(&log, &flash_ri, &options));
+    pblog_sim_stats stats;
+    pblog_sim_get_stats(&flash, &stats);
+    return stats.bytes_read;
+  };
+  auto timestamps = [&log]() {
+    vector<uint32_t> found;
+    pblog_Event event;
+    event_init(&event);
+    EXPECT_EQ(0, log.for_each_event(&log, collect_matching_cb, &event,
+                                    &found));
+    event_free(&event);
+    return found;
+  };
+
+  for (int mirror = 0; mirror < 2; ++mirror) {
+    SCOPED_TRACE(mirror);
+    ASSERT_GE(0, flash.erase(&flash, 0, sim_options.size));
+    mem_log.assign(mem_log.size(), '\xff');
+    pblog_options options = {};
+    options.mem_addr = &mem_log[0];
+    options.mem_size = mem_log.size();
+    options.mem_mirror_regions = mirror;
+    options.mem_reuse = 1;
+    options.allow_clear_on_add = 1;
+    ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 4, &flash));
+    ASSERT_EQ(1, pblog_init_options(&log, &flash_ri, &options));
+    for (uint32_t i = 0; i < 1000; ++i) {
+      pblog_Event event;
+      event_init(&event);
+      event.has_timestamp = true;
+      event.timestamp = i;
+      ASSERT_EQ(0, i % 2 ? log.add_event(&log, &event)
+                         : log.add_events(&log, &event, 1));
+    }
+    const vector<uint32_t> expected = timestamps();
+    const int count = pblog_event_count(&log);
+
+    // The memory log is adopted without reading flash.
+    EXPECT_EQ(0u, reboot(options));
+    EXPECT_EQ(expected, timestamps());
+    EXPECT_EQ(count, pblog_event_count(&log));
+
+    // Events added to flash alone make the log copy flash again.
+    pblog_Event event;
+    event_init(&event);
+    event.has_timestamp = true;
+    event.timestamp = 5000;
+    char buf[PBLOG_MAX_EVENT_SIZE];
+    int len = event_encode(&event, buf, sizeof(buf));
+    ASSERT_LT(0, flash_ri.append(&flash_ri, len, buf));
+    EXPECT_LT(0u, reboot(options));
+    vector<uint32_t> with_flash_event = expected;
+    with_flash_event.push_back(5000);
+    EXPECT_EQ(with_flash_event, timestamps());
+    EXPECT_EQ(count + 1, pblog_event_count(&log));
+    EXPECT_EQ(0u, reboot(options));
+
+    // So does a damaged stamp.
+    mem_log[10] ^= 1;
+    EXPECT_LT(0u, reboot(options));
+    EXPECT_EQ(with_flash_event, timestamps());
+    EXPECT_EQ(0u, reboot(options));
+    EXPECT_EQ(with_flash_event, timestamps());
+
+    pblog_free(&log);
+    record_intf_free(&flash_ri);
+  }
+
+  // The stamp must fit and the log must be synchronous.
+  ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 4, &flash));
+  pblog_options options = {};
+  options.mem_addr = &mem_log[0];
+  options.mem_size = 16;
+  options.mem_reuse = 1;
+  EXPECT_EQ(PBLOG_ERR_INVALID, pblog_init_options(&log, &flash_ri, &options));
+  options.mem_size = sim_options.size;
+  options.mem_mirror_regions = 1;
+  EXPECT_EQ(PBLOG_ERR_INVALID, pblog_init_options(&log, &flash_ri, &options));
+  options.mem_mirror_regions = 0;
+  options.async_queue_size = 1024;
+  EXPECT_EQ(PBLOG_ERR_INVALID, pblog_init_options(&log, &flash_ri, &options));
+  record_intf_free(&flash_ri);
+  pblog_sim_ops_free(&flash);
+}
+
+pblog_status count_valid_cb(int valid, const pblog_Event *event,
+                            void *priv) {  // NOLINT
+  (void)event;
+  *static_cast<int *>(priv) += valid;
+  return PBLOG_SUCCESS;
+}
+
+// Counts the valid events of a log by decoding all of them.
+int CountByDecoding(pblog *log) {
+  int count = 0;
+  pblog_Event event;
+  event_init(&event);
+  EXPECT_EQ(0, log->for_each_event(log, count_valid_cb, &event, &count));
+  event_free(&event);
+  return count;
+}
+
+TEST(PblogMemTest, EventCount) {
+  const size_t kRegionSize = 0x400;
+  string flash_mem(4 * kRegionSize, '\xff');
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_mem_ops_init(&flash, &flash_mem[0]));
+  record_region regions[4] = {};
+  for (int i = 0; i < 4; ++i) {
+    regions[i].offset = i * kRegionSize;
+    regions[i].size = kRegionSize;
+  }
+
+  for (int with_mem_log = 0; with_mem_log < 2; ++with_mem_log) {
+    SCOPED_TRACE(with_mem_log);
+    std::fill(flash_mem.begin(), flash_mem.end(), '\xff');
+    string mem_log(flash_mem.size(), '\xff');
+    pblog_options options = {};
+    options.allow_clear_on_add = 1;
+    if (with_mem_log) {
+      options.mem_addr = &mem_log[0];
+      options.mem_size = mem_log.size();
+    }
+    record_intf flash_ri;
+    ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 4, &flash));
+    pblog log = {};
+    EXPECT_EQ(1, pblog_init_options(&log, &flash_ri, &options));
+    EXPECT_EQ(1, pblog_event_count(&log));
+
+    // Enough events to compact the log several times.
+    for (uint32_t i = 0; i < 1000; ++i) {
+      pblog_Event event;
+      event_init(&event);
+      event.has_boot_number = true;
+      event.boot_number = i;
+      ASSERT_EQ(0, i % 7 ? log.add_event(&log, &event)
+                         : log.add_events(&log, &event, 1));
+      ASSERT_EQ(CountByDecoding(&log), pblog_event_count(&log)) << i;
+    }
+    const int count = pblog_event_count(&log);
+    pblog_free(&log);
+    record_intf_free(&flash_ri);
+
+    // A restart counts the events again, unless told not to.
+    std::fill(mem_log.begin(), mem_log.end(), '\xff');
+    ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 4, &flash));
+    EXPECT_EQ(count, pblog_init_options(&log, &flash_ri, &options));
+    pblog_free(&log);
+    record_intf_free(&flash_ri);
+
+    std::fill(mem_log.begin(), mem_log.end(), '\xff');
+    options.fast_init = 1;
+    ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 4, &flash));
+    EXPECT_EQ(with_mem_log ? count : 1,
+              pblog_init_options(&log, &flash_ri, &options));
+    EXPECT_EQ(count, pblog_event_count(&log));
+
+    EXPECT_EQ(0, log.clear(&log));
+    EXPECT_EQ(1, pblog_event_count(&log));
+    pblog_free(&log);
+    record_intf_free(&flash_ri);
+  }
+  pblog_mem_ops_free(&flash);
+}
+
+// The count only parses the leading fields of each event, so it includes
+// events whose body does not decode, which iteration reports as invalid.
+TEST(PblogMemTest, EventCountWithCorruptBody) {
+  const size_t kRegionSize = 0x400;
+  string flash_mem(2 * kRegionSize, '\xff');
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_mem_ops_init(&flash, &flash_mem[0]));
+  record_region regions[2] = {};
+  regions[0].size = kRegionSize;
+  regions[1].offset = kRegionSize;
+  regions[1].size = kRegionSize;
+  record_intf flash_ri;
+  ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 2, &flash));
+
+  pblog_Event event;
+  event_init(&event);
+  event.has_boot_number = true;
+  event.boot_number = 7;
+  event_add_kv_data(&event, "key", "value");
+  unsigned char buf[PBLOG_MAX_EVENT_SIZE];
+  const int len = event_encode(&event, buf, sizeof(buf));
+  event_free(&event);
+  ASSERT_LT(2, len);
+  // A whole event, one cut off in its key/value data and one whose leading
+  // fields do not parse.
+  const unsigned char garbage[] = {0xff, 0xff};
+  EXPECT_LT(0, flash_ri.append(&flash_ri, len, buf));
+  EXPECT_LT(0, flash_ri.append(&flash_ri, len - 2, buf));
+  EXPECT_LT(0, flash_ri.append(&flash_ri, sizeof(garbage), garbage));
+
+  pblog log = {};
+  pblog_options options = {};
+  EXPECT_EQ(2, pblog_init_options(&log, &flash_ri, &options));
+  EXPECT_EQ(2, pblog_event_count(&log));
+  EXPECT_EQ(1, CountByDecoding(&log));
+  pblog_free(&log);
+  record_intf_free(&flash_ri);
+  pblog_mem_ops_free(&flash);
+}
+
+TEST(PblogMemTest, MatchingEvents) {
+  const size_t kRegionSize = 0x1000;
+  string flash_mem(2 * kRegionSize, '\xff');
+  string mem_log(2 * kRegionSize, '\xff');
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_mem_ops_init(&flash, &flash_mem[0]));
+  record_region regions[2] = {};
+  regions[0].size = kRegionSize;
+  regions[1].offset = kRegionSize;
+  regions[1].size = kRegionSize;
+  record_intf flash_ri;
+  ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 2, &flash));
+  pblog log = {};
+  pblog_init(&log, 0, &flash_ri, &mem_log[0], mem_log.size());
+
+  // Event i has timestamp 1000 + i, boot number i / 10, and every tenth is
+  // a thermal trip with key/value data.
+  for (uint32_t i = 0; i < 100; ++i) {
+    pblog_Event event;
+    event_init(&event);
+    event.has_type = true;
+    event.type = i % 10 == 0 ? pblog_TYPE_THERMAL_TRIP : pblog_TYPE_BOOT_UP;
+    event.vendor =
+        i % 3 == 0 ? pblog_Event_VENDOR_GOOGLE : pblog_Event_VENDOR_GENERIC;
+    event.has_timestamp = true;
+    event.timestamp = 1000 + i;
+    event.has_boot_number = true;
+    event.boot_number = i / 10;
+    if (event.type == pblog_TYPE_THERMAL_TRIP) {
+      event_add_kv_data(&event, "sensor", "cpu0");
+    }
+    EXPECT_EQ(0, log.add_event(&log, &event));
+    event_free(&event);
+  }
+
+  auto matching = [&log](const pblog_filter &filter) {
+    vector<uint32_t> timestamps;
+    pblog_Event event;
+    event_init(&event);
+    EXPECT_EQ(0, log.for_each_matching_event(&log, &filter,
+                                             collect_matching_cb, &event,
+                                             &timestamps));
+    event_free(&event);
+    return timestamps;
+  };
+
+  const pblog_event_type kThermal[] = {pblog_TYPE_THERMAL_TRIP};
+  pblog_filter filter = {};
+  filter.types = kThermal;
+  filter.num_types = 1;
+  EXPECT_EQ(vector<uint32_t>({1000, 1010, 1020, 1030, 1040, 1050, 1060,
+                              1070, 1080, 1090}),
+            matching(filter));
+  filter.has_time_range = 1;
+  filter.time_min = 1015;
+  filter.time_max = 1040;
+  EXPECT_EQ(vector<uint32_t>({1020, 1030, 1040}), matching(filter));
+  filter.has_vendor = 1;
+  filter.vendor = pblog_Event_VENDOR_GOOGLE;
+  EXPECT_EQ(vector<uint32_t>({1030}), matching(filter));
+
+  filter = pblog_filter();
+  filter.has_boot_range = 1;
+  filter.boot_min = 9;
+  filter.boot_max = 20;
+  EXPECT_EQ(10u, matching(filter).size());
+  // The clear event logged at init has no timestamp or boot number.
+  const pblog_event_type kCleared[] = {pblog_TYPE_LOG_CLEARED,
+                                       pblog_TYPE_RESET};
+  filter = pblog_filter();
+  filter.types = kCleared;
+  filter.num_types = 2;
+  EXPECT_EQ(1u, matching(filter).size());
+  filter.has_time_range = 1;
+  filter.time_max = UINT32_MAX;
+  EXPECT_EQ(0u, matching(filter).size());
+
+  pblog_free(&log);
+  record_intf_free(&flash_ri);
+  pblog_mem_ops_free(&flash);
+}
+
+TEST(PblogMemTest, MatchingEventsSkipRegions) {
+  const int kNumRegions = 8;
+  pblog_sim_options sim_options = {};
+  sim_options.size = kNumRegions * 0x1000;
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_sim_ops_init(&flash, &sim_options));
+  pblog_flash_geometry geometry;
+  ASSERT_EQ(0, flash.get_geometry(&flash, &geometry));
+  record_region regions[kNumRegions];
+  ASSERT_EQ(0, record_regions_from_geometry(&geometry, 0, sim_options.size,
+                                            kNumRegions, regions));
+  record_intf_options options = {};
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  pblog_summary_options(&options);
+  record_intf flash_ri;
+  ASSERT_EQ(0, record_intf_init_options(&flash_ri, regions, kNumRegions,
+                                        &flash, &options));
+  pblog log = {};
+  pblog_init(&log, 0, &flash_ri, nullptr, 0);
+
+  // Boot i / 100 logs events with timestamps 1000 + i.
+  for (uint32_t i = 0; i < 1500; ++i) {
+    pblog_Event event;
+    event_init(&event);
+    event.has_type = true;
+    event.type = pblog_TYPE_BOOT_UP;
+    event.has_timestamp = true;
+    event.timestamp = 1000 + i;
+    event.has_boot_number = true;
+    event.boot_number = i / 100;
+    ASSERT_EQ(0, log.add_event(&log, &event));
+  }
+
+  // Returns the timestamps of the events of a boot and the bytes read to
+  // find them.
+  auto boot_events = [&](uint32_t boot, uint64_t *bytes_read) {
+    vector<uint32_t> timestamps;
+    pblog_filter filter = {};
+    filter.has_boot_range = 1;
+    filter.boot_min = boot;
+    filter.boot_max = boot;
+    pblog_Event event;
+    event_init(&event);
+    pblog_sim_reset_stats(&flash);
+    EXPECT_EQ(0, log.for_each_matching_event(&log, &filter,
+                                             collect_matching_cb, &event,
+                                             &timestamps));
+    pblog_sim_stats stats;
+    pblog_sim_get_stats(&flash, &stats);
+    *bytes_read = stats.bytes_read;
+    return timestamps;
+  };
+
+  vector<uint32_t> expected;
+  for (uint32_t t = 1700; t < 1800; ++t) {
+    expected.push_back(t);
+  }
+  uint64_t full_scan_bytes;
+  EXPECT_EQ(0u, boot_events(100, &full_scan_bytes).size());
+  uint64_t bytes_read;
+  EXPECT_EQ(expected, boot_events(7, &bytes_read));
+  EXPECT_LT(bytes_read * 2, sim_options.size);
+
+  // Summaries are rebuilt from flash after a restart.
+  pblog_free(&log);
+  record_intf_free(&flash_ri);
+  ASSERT_EQ(0, record_intf_init_options(&flash_ri, regions, kNumRegions,
+                                        &flash, &options));
+  EXPECT_EQ(1501, pblog_init(&log, 0, &flash_ri, nullptr, 0));
+  EXPECT_EQ(expected, boot_events(7, &bytes_read));
+  EXPECT_EQ(expected, boot_events(7, &bytes_read));
+  EXPECT_LT(bytes_read * 2, sim_options.size);
+
+  pblog_free(&log);
+  record_intf_free(&flash_ri);
+  pblog_sim_ops_free(&flash);
+}
+
+// A log in memory "flash" with a memory copy, optionally asynchronous.
+class PblogAsyncTest : public ::testing::Test {
+ public:
+  static const size_t kRegionSize = 0x400;
+
+  PblogAsyncTest()
+      : flash_mem_(2 * kRegionSize, '\xff'),
+        mem_log_(2 * kRegionSize, '\xff'),
+        log_() {
+    pblog_mem_ops_init(&flash_, &flash_mem_[0]);
+    record_region regions[2] = {};
+    regions[0].size = kRegionSize;
+    regions[1].offset = kRegionSize;
+    regions[1].size = kRegionSize;
+    record_intf_init(&flash_ri_, regions, 2, &flash_);
+  }
+
+  ~PblogAsyncTest() override {
+    record_intf_free(&flash_ri_);
+    pblog_mem_ops_free(&flash_);
+  }
+
+  int Init(size_t queue_size, int batch, pblog_async_overflow overflow,
+           int allow_clear_on_add) {
+    pblog_options options = {};
+    options.allow_clear_on_add = allow_clear_on_add;
+    options.mem_addr = &mem_log_[0];
+    options.mem_size = mem_log_.size();
+    options.async_queue_size = queue_size;
+    options.async_batch = batch;
+    options.async_overflow = overflow;
+    return pblog_init_options(&log_, &flash_ri_, &options);
+  }
+
+  void AddBootEvents(pblog *log, size_t num_events) {
+    for (size_t n = 0; n < num_events; ++n) {
+      pblog_Event event;
+      event_init(&event);
+      event.has_type = true;
+      event.type = pblog_TYPE_BOOT_UP;
+      EXPECT_EQ(0, log->add_event(log, &event));
+      event_free(&event);
+    }
+  }
+
+  static size_t CountBootEvents(pblog *log) {
+    size_t count = 0;
+    pblog_Event event;
+    EXPECT_EQ(0, log->for_each_event(log, count_boot_events_cb, &event,
+                                     &count));
+    return count;
+  }
+
+  // Counts the boot events on flash through a log without memory copy.
+  size_t CountBootEventsOnFlash() {
+    pblog log = {};
+    EXPECT_LT(0, pblog_init(&log, 0, &flash_ri_, nullptr, 0));
+    size_t count = CountBootEvents(&log);
+    pblog_free(&log);
+    return count;
+  }
+
+  size_t CountClearEventsOnFlash() {
+    pblog log = {};
+    EXPECT_LT(0, pblog_init(&log, 0, &flash_ri_, nullptr, 0));
+    size_t count = 0;
+    pblog_Event event;
+    EXPECT_EQ(0, log.for_each_event(&log, count_clear_events_cb, &event,
+                                    &count));
+    pblog_free(&log);
+    return count;
+  }
+
+  string flash_mem_;
+  string mem_log_;
+  pblog_flash_ops flash_;
+  record_intf flash_ri_;
+  pblog log_;
+};
+
+#ifdef PBLOG_USE_PTHREADS
+TEST_F(PblogAsyncTest, RequiresMemoryLog) {
+  pblog_options options = {};
+  options.async_queue_size = 1024;
+  EXPECT_EQ(PBLOG_ERR_INVALID, pblog_init_options(&log_, &flash_ri_, &options));
+  // Nothing is left to free.
+  EXPECT_EQ(nullptr, log_.priv);
+  pblog_free(&log_);
+}
+
+TEST_F(PblogAsyncTest, EventsReachFlash) {
+  ASSERT_EQ(1, Init(1024, 4, PBLOG_ASYNC_OVERFLOW_WRITE, 0));
+  AddBootEvents(&log_, 20);
+  // Reads see the events before they are on flash.
+  EXPECT_EQ(20u, CountBootEvents(&log_));
+  EXPECT_EQ(0, pblog_flush(&log_));
+  pblog_free(&log_);
+  EXPECT_EQ(20u, CountBootEventsOnFlash());
+}
+
+TEST_F(PblogAsyncTest, OverflowWritesOnCaller) {
+  // The worker never wakes, so the caller writes the full queue itself.
+  ASSERT_EQ(1, Init(64, 1000, PBLOG_ASYNC_OVERFLOW_WRITE, 0));
+  AddBootEvents(&log_, 20);
+  EXPECT_EQ(0, pblog_flush(&log_));
+  EXPECT_EQ(20u, CountBootEvents(&log_));
+  pblog_free(&log_);
+  EXPECT_EQ(20u, CountBootEventsOnFlash());
+}
+
+TEST_F(PblogAsyncTest, OverflowDrops) {
+  ASSERT_EQ(1, Init(64, 1000, PBLOG_ASYNC_OVERFLOW_DROP, 0));
+  AddBootEvents(&log_, 20);
+  EXPECT_EQ(20u, CountBootEvents(&log_));
+  EXPECT_EQ(PBLOG_ERR_NO_SPACE, pblog_flush(&log_));
+  EXPECT_EQ(0, pblog_flush(&log_));
+  pblog_free(&log_);
+  size_t on_flash = CountBootEventsOnFlash();
+  EXPECT_LT(0u, on_flash);
+  EXPECT_GT(20u, on_flash);
+}
+
+TEST_F(PblogAsyncTest, CompactsLikeSyncLog) {
+  // Overflowing the flash log clears its oldest region, and the memory log
+  // keeps mirroring it.
+  for (int batch : {1, 1000}) {
+    ASSERT_EQ(1, Init(256, batch, PBLOG_ASYNC_OVERFLOW_WRITE, 1));
+    AddBootEvents(&log_, 300);
+    EXPECT_EQ(0, pblog_flush(&log_)) << batch;
+    size_t in_memory = CountBootEvents(&log_);
+    EXPECT_EQ(CountByDecoding(&log_), pblog_event_count(&log_)) << batch;
+    pblog_free(&log_);
+    EXPECT_LT(0u, in_memory);
+    EXPECT_EQ(in_memory, CountBootEventsOnFlash()) << batch;
+    ASSERT_GE(flash_ri_.clear(&flash_ri_, 0), 0);
+    mem_log_.assign(mem_log_.size(), '\xff');
+  }
+}
+
+TEST_F(PblogAsyncTest, FreeLogsClearEvents) {
+  // Without a flush, pblog_free() writes the queue and a clear event for
+  // each region it cleared, as the synchronous log does as it goes.  The
+  // memory log holds more than flash, so that the queue overflows it.
+  mem_log_.assign(8 * kRegionSize, '\xff');
+  size_t sync_clears = 0;
+  for (size_t queue_size : {0, 8192}) {
+    ASSERT_EQ(1, Init(queue_size, 100000, PBLOG_ASYNC_OVERFLOW_WRITE, 1));
+    AddBootEvents(&log_, 300);
+    pblog_free(&log_);
+    size_t clears = CountClearEventsOnFlash();
+    if (queue_size == 0) {
+      sync_clears = clears;
+    }
+    EXPECT_EQ(sync_clears, clears) << queue_size;
+    EXPECT_LT(0u, CountBootEventsOnFlash()) << queue_size;
+    ASSERT_GE(flash_ri_.clear(&flash_ri_, 0), 0);
+    mem_log_.assign(mem_log_.size(), '\xff');
+  }
+  EXPECT_LT(0u, sync_clears);
+}
+#else
+TEST_F(PblogAsyncTest, AsyncUnavailable) {
+  EXPECT_EQ(PBLOG_ERR_INVALID, Init(1024, 1, PBLOG_ASYNC_OVERFLOW_WRITE, 0));
+}
+#endif
+
+string KeyValues(const pblog_Event &event) {
+  string kv;
+  for (uint32_t i = 0; i < event.data_count; ++i) {
+    kv += static_cast<const char *>(event.data[i].key.arg);
+    kv += "=";
+    kv += static_cast<const char *>(event.data[i].value.arg);
+    kv += ";";
+  }
+  return kv;
+}
+
+TEST(EventTest, DecodeArena) {
+  pblog_Event event;
+  event_init(&event);
+  event.has_type = true;
+  event.type = pblog_TYPE_THERMAL_TRIP;
+  event_add_kv_data(&event, "sensor", "cpu0");
+  event_add_kv_data(&event, "temp", "105");
+  char buf[PBLOG_MAX_EVENT_SIZE];
+  int len = event_encode(&event, buf, sizeof(buf));
+  ASSERT_LT(0, len);
+
+  // The strings fit in an arena of the encoded size, and replace the heap
+  // strings the event held.
+  string arena_buf(len, '\0');
+  event_arena arena;
+  event_arena_init(&arena, &arena_buf[0], arena_buf.size());
+  ASSERT_EQ(0, event_decode_arena(buf, len, &event, &arena));
+  EXPECT_EQ("sensor=cpu0;temp=105;", KeyValues(event));
+  EXPECT_EQ(strlen("sensor cpu0 temp 105 "), arena.used);
+  const char *key = static_cast<const char *>(event.data[0].key.arg);
+  EXPECT_LE(arena_buf.data(), key);
+  EXPECT_GT(arena_buf.data() + arena_buf.size(), key);
+
+  event_arena_reset(&arena);
+  ASSERT_EQ(0, event_decode_arena(buf, len, &event, &arena));
+  EXPECT_EQ("sensor=cpu0;temp=105;", KeyValues(event));
+  EXPECT_EQ(PBLOG_ERR_NO_SPACE, event_decode_arena(buf, len, &event, &arena));
+
+  // event_decode and event_free leave the arena strings alone.
+  ASSERT_EQ(0, event_decode(buf, len, &event));
+  EXPECT_EQ("sensor=cpu0;temp=105;", KeyValues(event));
+  event_free(&event);
+  event_arena_reset(&arena);
+  ASSERT_EQ(0, event_decode_arena(buf, len, &event, &arena));
+  event_free(&event);
+}
+
+pblog_status collect_kv_cb(int valid, const pblog_Event *event,
+                           void *priv) {  // NOLINT
+  EXPECT_EQ(1, valid);
+  *static_cast<string *>(priv) += KeyValues(*event);
+  return PBLOG_SUCCESS;
+}
+
+TEST(PblogMemTest, IterationDecodesKeyValueData) {
+  const size_t kRegionSize = 0x1000;
+  string flash_mem(2 * kRegionSize, '\xff');
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_mem_ops_init(&flash, &flash_mem[0]));
+  record_region regions[2] = {};
+  regions[0].size = kRegionSize;
+  regions[1].offset = kRegionSize;
+  regions[1].size = kRegionSize;
+  record_intf flash_ri;
+  ASSERT_EQ(0, record_intf_init(&flash_ri, regions, 2, &flash));
+  pblog log = {};
+  pblog_init(&log, 0, &flash_ri, nullptr, 0);
+
+  string expected;
+  for (int i = 0; i < 20; ++i) {
+    pblog_Event event;
+    event_init(&event);
+    for (int j = 0; j < i % 4; ++j) {
+      string key = "key" + std::to_string(j);
+      string value(i * 4, 'a' + j);
+      event_add_kv_data(&event, key.c_str(), value.c_str());
+      expected += key + "=" + value + ";";
+    }
+    ASSERT_EQ(0, log.add_event(&log, &event));
+    event_free(&event);
+  }
+
+  // Events with fewer key/value pairs than the one before them do not see
+  // its strings, and the strings of every event are valid in the callback.
+  string found;
+  pblog_Event event;
+  event_init(&event);
+  EXPECT_EQ(0, log.for_each_event(&log, collect_kv_cb, &event, &found));
+  EXPECT_EQ(expected, found);
+  event_free(&event);
+
+  pblog_free(&log);
+  record_intf_free(&flash_ri);
+  pblog_mem_ops_free(&flash);
+}
+
 }  // namespace
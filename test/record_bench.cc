@@ -0,0 +1,527 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <pblog/common.h>
+#include <pblog/file.h>
+#include <pblog/mem.h>
+#include <pblog/record.h>
+#include <pblog/sim.h>
+#include <pblog/uring.h>
+
+#include "bench.hh"
+
+namespace {
+
+using pblog_test::CountingFlash;
+using pblog_test::NowNs;
+using std::string;
+using std::vector;
+
+const int kNumRegions = 4;
+const uint32_t kRegionSize = 64 * 1024;
+const char kFilename[] = "/tmp/record_bench.tst";
+
+void MakeRegions(record_region *regions) {
+  for (int i = 0; i < kNumRegions; ++i) {
+    regions[i] = record_region();
+    regions[i].offset = i * kRegionSize;
+    regions[i].size = kRegionSize;
+  }
+}
+
+// Erased memory standing in for the flash, with its own backend instance.
+class MemFlash {
+ public:
+  MemFlash() : mem_(kNumRegions * kRegionSize, '\xff') {
+    pblog_mem_ops_init(&ops_, &mem_[0]);
+  }
+  ~MemFlash() { pblog_mem_ops_free(&ops_); }
+
+  pblog_flash_ops *ops() { return &ops_; }
+
+ private:
+  string mem_;
+  pblog_flash_ops ops_;
+};
+
+// A memory backed log with flash operation counters.
+class MemLog {
+ public:
+  explicit MemLog(bool with_writev, size_t write_buffer_size = 0)
+      : counting_(mem_.ops(), with_writev) {
+    record_region regions[kNumRegions];
+    record_intf_options options = {};
+    options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+    options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+    options.write_buffer_size = write_buffer_size;
+    MakeRegions(regions);
+    record_intf_init_options(&ri_, regions, kNumRegions, counting_.ops(),
+                             &options);
+    counting_.Reset();
+  }
+
+  ~MemLog() { record_intf_free(&ri_); }
+
+  record_intf *ri() { return &ri_; }
+  CountingFlash *counting() { return &counting_; }
+
+ private:
+  MemFlash mem_;
+  CountingFlash counting_;
+  record_intf ri_;
+};
+
+void BenchAppend(const char *name, bool with_writev, size_t record_size,
+                 size_t write_buffer_size = 0) {
+  const size_t kNumRecords = 100000;
+  MemLog log(with_writev, write_buffer_size);
+  record_intf *ri = log.ri();
+  string record(record_size, 'x');
+
+  size_t program_ops = 0;
+  uint64_t elapsed_ns = 0;
+  for (size_t i = 0; i < kNumRecords; ++i) {
+    uint64_t start = NowNs();
+    int rc = ri->append(ri, record.size(), record.data());
+    elapsed_ns += NowNs() - start;
+    if (rc == PBLOG_ERR_NO_SPACE) {
+      program_ops += log.counting()->writes;
+      ri->clear(ri, 0);
+      log.counting()->Reset();
+    }
+  }
+  program_ops += log.counting()->writes;
+
+  printf("append/%s/%zu/buffer:%zu: %.2f program ops/record, %.1f ns/record\n",
+         name, record_size, write_buffer_size,
+         static_cast<double>(program_ops) / kNumRecords,
+         static_cast<double>(elapsed_ns) / kNumRecords);
+}
+
+// Measures record_intf_init() on a completely full log.
+void BenchMount(const char *name, pblog_flash_ops *backend, size_t scan_size,
+                int init_threads = 0, unsigned read_delay_us = 0) {
+  const int kIterations = 20;
+  const string record(32, 'x');
+  CountingFlash counting(backend, true);
+  record_region regions[kNumRegions];
+  record_intf ri;
+
+  MakeRegions(regions);
+  record_intf_init(&ri, regions, kNumRegions, counting.ops());
+  ri.clear(&ri, 0);
+  size_t num_records = 0;
+  while (ri.append(&ri, record.size(), record.data()) > 0) {
+    num_records++;
+  }
+  record_intf_free(&ri);
+
+  record_intf_options options = {};
+  options.scan_buffer_size = scan_size;
+  options.init_threads = init_threads;
+  counting.set_read_delay_us(read_delay_us);
+  counting.Reset();
+  uint64_t start = NowNs();
+  for (int i = 0; i < kIterations; ++i) {
+    record_intf_init_options(&ri, regions, kNumRegions, counting.ops(),
+                             &options);
+    record_intf_free(&ri);
+  }
+  uint64_t elapsed_ns = NowNs() - start;
+
+  printf(
+      "mount/%s/%zu/threads:%d: %zu records, %.1f us/mount, %zu "
+      "reads/mount\n",
+      name, scan_size, init_threads, num_records,
+      static_cast<double>(elapsed_ns) / kIterations / 1000,
+      counting.reads / kIterations);
+}
+
+// Measures a full forward scan of a full log with read_next().
+void BenchScan(const char *name, pblog_flash_ops *backend,
+               size_t read_ahead_size) {
+  const int kIterations = 20;
+  const string record(32, 'x');
+  CountingFlash counting(backend, true);
+  record_region regions[kNumRegions];
+  record_intf_options options = {};
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = read_ahead_size;
+  record_intf ri;
+
+  MakeRegions(regions);
+  record_intf_init_options(&ri, regions, kNumRegions, counting.ops(),
+                           &options);
+  ri.clear(&ri, 0);
+  size_t num_records = 0;
+  while (ri.append(&ri, record.size(), record.data()) > 0) {
+    num_records++;
+  }
+
+  string data(4096, '\0');
+  record_cursor cursor;
+  int next_offset = 0;
+  counting.Reset();
+  uint64_t start = NowNs();
+  for (int i = 0; i < kIterations; ++i) {
+    ri.seek(&ri, &cursor, 0);
+    do {
+      size_t len = data.size();
+      ri.read_next(&ri, &cursor, &next_offset, &len, &data[0]);
+    } while (next_offset != 0);
+  }
+  uint64_t elapsed_ns = NowNs() - start;
+  record_intf_free(&ri);
+
+  printf("scan/%s/%zu: %zu records, %.1f us/scan, %.2f reads/record\n", name,
+         read_ahead_size, num_records,
+         static_cast<double>(elapsed_ns) / kIterations / 1000,
+         static_cast<double>(counting.reads) / kIterations / num_records);
+}
+
+// Measures appends to a file backed log, calling flush() every sync_every
+// records when it is not 0.
+void BenchFileAppend(const char *name, pblog_flash_ops *backend,
+                     int sync_every, bool aligned = true) {
+  const size_t kNumRecords = 20000;
+  const string record(32, 'x');
+  CountingFlash counting(backend, true);
+  record_region regions[kNumRegions];
+  record_intf ri;
+
+  if (!aligned) {
+    counting.hide_geometry();
+  }
+  MakeRegions(regions);
+  record_intf_init(&ri, regions, kNumRegions, counting.ops());
+  ri.clear(&ri, 0);
+  counting.Reset();
+  uint64_t start = NowNs();
+  for (size_t i = 0; i < kNumRecords; ++i) {
+    if (ri.append(&ri, record.size(), record.data()) == PBLOG_ERR_NO_SPACE) {
+      ri.clear(&ri, 1);
+    }
+    if (sync_every != 0 && (i + 1) % sync_every == 0) {
+      ri.flush(&ri);
+    }
+  }
+  uint64_t elapsed_ns = NowNs() - start;
+  record_intf_free(&ri);
+
+  printf(
+      "file_append/%s%s/sync_every:%d: %.2f us/record, %zu syncs, %zu "
+      "reads\n",
+      name, aligned ? "" : "/unaligned", sync_every,
+      static_cast<double>(elapsed_ns) / kNumRecords / 1000,
+      static_cast<size_t>(counting.syncs), static_cast<size_t>(counting.reads));
+}
+
+// Erases a region of size bytes, as compaction does.
+void BenchFileErase(const char *name, pblog_flash_ops *backend, size_t size) {
+  const int kIterations = 20;
+  uint64_t start = NowNs();
+  for (int i = 0; i < kIterations; ++i) {
+    backend->erase(backend, 0, size);
+  }
+  uint64_t elapsed_ns = NowNs() - start;
+  printf("file_erase/%s/%zu: %.1f us/erase\n", name, size,
+         static_cast<double>(elapsed_ns) / kIterations / 1000);
+}
+
+// Reads the newest num_tail records of a full log, walking forward from the
+// start as callers had to before, and backwards from the end.
+void BenchTail(size_t num_tail) {
+  const int kIterations = 20;
+  const string record(32, 'x');
+  MemLog log(true);
+  record_intf *ri = log.ri();
+  while (ri->append(ri, record.size(), record.data()) > 0) {
+  }
+
+  string data(4096, '\0');
+  record_cursor cursor;
+  int step = 0;
+  size_t num_records = 0;
+  log.counting()->Reset();
+  uint64_t start = NowNs();
+  for (int i = 0; i < kIterations; ++i) {
+    ri->seek(ri, &cursor, 0);
+    num_records = 0;
+    do {
+      size_t len = data.size();
+      ri->read_next(ri, &cursor, &step, &len, &data[0]);
+      num_records++;
+    } while (step != 0);
+  }
+  uint64_t forward_ns = NowNs() - start;
+  size_t forward_reads = log.counting()->reads;
+
+  log.counting()->Reset();
+  start = NowNs();
+  for (int i = 0; i < kIterations; ++i) {
+    ri->seek_end(ri, &cursor);
+    for (size_t j = 0; j < num_tail; ++j) {
+      size_t len = data.size();
+      ri->read_prev(ri, &cursor, &step, &len, &data[0]);
+    }
+  }
+  uint64_t reverse_ns = NowNs() - start;
+  size_t reverse_reads = log.counting()->reads;
+
+  printf(
+      "tail/%zu of %zu: forward %.1f us %zu reads, reverse %.1f us %zu "
+      "reads\n",
+      num_tail, num_records - 1,
+      static_cast<double>(forward_ns) / kIterations / 1000,
+      forward_reads / kIterations,
+      static_cast<double>(reverse_ns) / kIterations / 1000,
+      reverse_reads / kIterations);
+}
+
+// Appends records to a log on a simulated device, clearing the oldest region
+// when it fills, and reports the simulated device time and wear per record.
+void BenchSimPolicy(const char *device, const pblog_sim_options &sim_options,
+                    size_t write_buffer_size, int spare_regions) {
+  const size_t kNumRecords = 20000;
+  const string record(32, 'x');
+  pblog_flash_ops sim;
+  pblog_flash_geometry geometry;
+  record_region regions[kNumRegions];
+  record_intf_options options = {};
+  record_intf ri;
+
+  pblog_sim_ops_init(&sim, &sim_options);
+  sim.get_geometry(&sim, &geometry);
+  record_regions_from_geometry(&geometry, 0, sim_options.size, kNumRegions,
+                               regions);
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.write_buffer_size = write_buffer_size;
+  options.spare_regions = spare_regions;
+  record_intf_init_options(&ri, regions, kNumRegions, &sim, &options);
+  pblog_sim_reset_stats(&sim);
+  for (size_t i = 0; i < kNumRecords; ++i) {
+    if (ri.append(&ri, record.size(), record.data()) == PBLOG_ERR_NO_SPACE) {
+      ri.clear(&ri, 1);
+      ri.erase_pending(&ri, 0);
+      ri.append(&ri, record.size(), record.data());
+    }
+  }
+  record_intf_free(&ri);
+
+  pblog_sim_stats stats;
+  pblog_sim_get_stats(&sim, &stats);
+  printf(
+      "sim/%s/write_buffer:%zu/spare:%d: %.1f us/record, %.2f bytes "
+      "programmed/byte, %llu disturbs, max erase count %u\n",
+      device, write_buffer_size, spare_regions,
+      static_cast<double>(stats.time_ns) / kNumRecords / 1000,
+      static_cast<double>(stats.bytes_programmed) /
+          (kNumRecords * (record.size() + sizeof(record_header))),
+      static_cast<unsigned long long>(stats.disturbs), stats.max_erase_count);
+  pblog_sim_ops_free(&sim);
+}
+
+}  // namespace
+
+#ifdef PBLOG_USE_PTHREADS
+// Measures appends on a thread safe log while readers scan it continuously.
+void BenchConcurrentAppend(int num_readers) {
+  const size_t kNumRecords = 200000;
+  MemFlash mem;
+  record_region regions[kNumRegions];
+  record_intf_options options = {};
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  options.thread_safe = 1;
+  record_intf ri;
+  MakeRegions(regions);
+  record_intf_init_options(&ri, regions, kNumRegions, mem.ops(), &options);
+
+  std::atomic<bool> done(false);
+  std::atomic<size_t> records_read(0);
+  vector<std::thread> readers;
+  for (int i = 0; i < num_readers; ++i) {
+    readers.emplace_back([&] {
+      string data(64, '\0');
+      while (!done) {
+        record_cursor cursor;
+        ri.seek(&ri, &cursor, 0);
+        size_t len = data.size();
+        int next_offset;
+        while (!done &&
+               ri.read_next(&ri, &cursor, &next_offset, &len, &data[0]) == 0 &&
+               len != 0) {
+          records_read++;
+          len = data.size();
+        }
+      }
+    });
+  }
+
+  const string record(32, 'x');
+  uint64_t start = NowNs();
+  for (size_t i = 0; i < kNumRecords; ++i) {
+    if (ri.append(&ri, record.size(), record.data()) == PBLOG_ERR_NO_SPACE) {
+      ri.clear(&ri, 1);
+    }
+  }
+  uint64_t elapsed_ns = NowNs() - start;
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  record_intf_free(&ri);
+
+  printf("concurrent_append/readers:%d: %.0f appends/s, %.0f reads/s\n",
+         num_readers, kNumRecords * 1e9 / elapsed_ns,
+         records_read * 1e9 / elapsed_ns);
+}
+#endif
+
+int main() {
+  const size_t kRecordSizes[] = {32, 128, 1024};
+  for (size_t size : kRecordSizes) {
+    BenchAppend("writev", true, size);
+    BenchAppend("write", false, size);
+    for (size_t write_buffer_size : {512, 4096}) {
+      BenchAppend("writev", true, size, write_buffer_size);
+    }
+  }
+
+  const size_t kScanSizes[] = {0, 512, RECORD_DEFAULT_SCAN_BUFFER_SIZE,
+                               kRegionSize};
+  MemFlash mem;
+  for (size_t scan_size : kScanSizes) {
+    BenchMount("mem", mem.ops(), scan_size);
+  }
+  pblog_flash_ops file_ops;
+  pblog_file_ops_init(&file_ops, kFilename);
+  for (size_t scan_size : kScanSizes) {
+    BenchMount("file", &file_ops, scan_size);
+  }
+  // Parallel init helps when every read waits on the device.
+  for (int threads : {1, 2, 4}) {
+    BenchMount("file+100us", &file_ops, RECORD_DEFAULT_SCAN_BUFFER_SIZE,
+               threads, 100);
+  }
+  const size_t kReadAheadSizes[] = {0, 512, RECORD_DEFAULT_READ_AHEAD_SIZE,
+                                    kRegionSize};
+  for (size_t read_ahead_size : kReadAheadSizes) {
+    BenchScan("mem", mem.ops(), read_ahead_size);
+  }
+  for (size_t read_ahead_size : kReadAheadSizes) {
+    BenchScan("file", &file_ops, read_ahead_size);
+  }
+  pblog_file_ops_free(&file_ops);
+  unlink(kFilename);
+
+  // The plain file backend opens the file for every operation, the others
+  // keep it open.
+  enum FileBackend { kOpenClose, kFd, kMmap, kDirect, kUring };
+  const struct {
+    const char *name;
+    FileBackend backend;
+  } kFileBackends[] = {{"open_close", kOpenClose},
+                       {"fd", kFd},
+                       {"mmap", kMmap},
+                       {"direct", kDirect},
+                       {"uring", kUring}};
+  for (const auto &backend : kFileBackends) {
+    const size_t size = kNumRegions * kRegionSize;
+    switch (backend.backend) {
+      case kOpenClose:
+        pblog_file_ops_init(&file_ops, kFilename);
+        break;
+      case kFd:
+        pblog_file_ops_open(&file_ops, kFilename, size, 0);
+        break;
+      case kMmap:
+        pblog_file_ops_open(&file_ops, kFilename, size, PBLOG_FILE_MMAP);
+        break;
+      case kDirect:
+        if (pblog_file_ops_open(&file_ops, kFilename, size,
+                                PBLOG_FILE_DIRECT) != PBLOG_SUCCESS) {
+          printf("file_append/direct: O_DIRECT unsupported\n");
+          continue;
+        }
+        break;
+      case kUring:
+        pblog_uring_ops_open(&file_ops, kFilename, size, nullptr);
+        break;
+    }
+    BenchFileErase(backend.name, &file_ops, kRegionSize);
+    BenchFileErase(backend.name, &file_ops, size);
+    BenchFileAppend(backend.name, &file_ops, 0);
+    BenchFileAppend(backend.name, &file_ops, 100);
+    if (backend.backend == kDirect) {
+      BenchFileAppend(backend.name, &file_ops, 0, false);
+    }
+    BenchMount(backend.name, &file_ops, RECORD_DEFAULT_SCAN_BUFFER_SIZE);
+    BenchScan(backend.name, &file_ops, 0);
+    BenchScan(backend.name, &file_ops, RECORD_DEFAULT_READ_AHEAD_SIZE);
+    if (backend.backend == kUring) {
+      pblog_uring_ops_free(&file_ops);
+    } else {
+      pblog_file_ops_free(&file_ops);
+    }
+    unlink(kFilename);
+  }
+
+  for (size_t num_tail : {1, 10, 100}) {
+    BenchTail(num_tail);
+  }
+
+  // Typical SPI NOR: 256 byte pages, 4 KiB sectors.
+  pblog_sim_options nor = {};
+  nor.size = kNumRegions * 16 * 1024;
+  nor.program_size = 256;
+  nor.erase_block_size = 4096;
+  nor.read_ns = 1000;
+  nor.read_ns_per_byte = 20;
+  nor.program_ns = 700000;
+  nor.erase_ns = 45000000;
+  // Typical SLC NAND: 2 KiB pages, 128 KiB blocks, 4 programs per page.
+  pblog_sim_options nand = {};
+  nand.size = kNumRegions * 128 * 1024;
+  nand.program_size = 2048;
+  nand.erase_block_size = 128 * 1024;
+  nand.read_ns = 25000;
+  nand.read_ns_per_byte = 10;
+  nand.program_ns = 250000;
+  nand.erase_ns = 2000000;
+  nand.max_programs = 4;
+  for (size_t write_buffer_size : {0, 256, 2048}) {
+    BenchSimPolicy("nor", nor, write_buffer_size, 0);
+    BenchSimPolicy("nand", nand, write_buffer_size, 0);
+  }
+  BenchSimPolicy("nor", nor, 256, 1);
+
+#ifdef PBLOG_USE_PTHREADS
+  for (int num_readers : {0, 1, 4}) {
+    BenchConcurrentAppend(num_readers);
+  }
+#endif
+  return 0;
+}
@@ -14,17 +14,22 @@
  * limitations under the License.
  */
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 #include <pblog/common.h>
 #include <pblog/file.h>
+#include <pblog/mem.h>
 #include <pblog/record.h>
+#include <pblog/sim.h>
 
 #include "common.hh"
 
@@ -41,15 +46,18 @@ class RecordFileTest : public ::testing::Test {
   RecordFileTest() {
     filename_ = "/tmp/record.tst";
     ri_ = nullptr;
+    pblog_file_ops_init(&flash_, filename_.c_str());
   }
 
   ~RecordFileTest() override {
     ClearState();
+    pblog_file_ops_free(&flash_);
 
     unlink(filename_.c_str());
   }
 
-  void InitRegions(const vector<pair<uint32_t, uint32_t> > &regions) {
+  void InitRegions(const vector<pair<uint32_t, uint32_t> > &regions,
+                   const record_intf_options *options = nullptr) {
     auto region_structs = new struct record_region[regions.size()];
 
     for (size_t i = 0; i < regions.size(); ++i) {
@@ -59,14 +67,21 @@ class RecordFileTest : public ::testing::Test {
     }
 
     ri_ = new struct record_intf;
-    pblog_file_ops.priv = static_cast<void *>(
-            const_cast<char *>(filename_.c_str()));
-    ASSERT_EQ(0, record_intf_init(ri_, region_structs, regions.size(),
-                                  &pblog_file_ops));
+    if (options != nullptr) {
+      ASSERT_EQ(0, record_intf_init_options(ri_, region_structs,
+                                            regions.size(), &flash_,
+                                            options));
+    } else {
+      ASSERT_EQ(0, record_intf_init(ri_, region_structs, regions.size(),
+                                    &flash_));
+    }
     delete[] region_structs;
   }
 
   void ClearState() {
+    if (ri_ == nullptr) {
+      return;
+    }
     record_intf_free(ri_);
     delete ri_;
     ri_ = nullptr;
@@ -130,6 +145,7 @@ class RecordFileTest : public ::testing::Test {
   }
 
   record_intf *ri_;
+  pblog_flash_ops flash_;
 
   string filename_;
 };
@@ -283,7 +299,7 @@ TEST_F(RecordFileTest, CorruptRecordData) {
   size_t offset = sizeof(record_header) + sizeof(region_header);
   unsigned char val = 0;
   EXPECT_EQ(static_cast<ssize_t>(sizeof(val)),
-            pblog_file_ops.write(&pblog_file_ops, offset, sizeof(val), &val));
+            flash_.write(&flash_, offset, sizeof(val), &val));
 
   EXPECT_EQ(static_cast<size_t>(1), NumValidRecords());
   string data;
@@ -329,7 +345,7 @@ TEST_F(RecordFileTest, CorruptRecordLength) {
     uint8_t val[] = {static_cast<uint8_t>((i >> 8) & 0xff),
                      static_cast<uint8_t>(i & 0xff)};
     EXPECT_EQ(static_cast<ssize_t>(sizeof(val)),
-              pblog_file_ops.write(&pblog_file_ops, offset, sizeof(val), &val));
+              flash_.write(&flash_, offset, sizeof(val), &val));
 
     ASSERT_EQ(static_cast<size_t>(0), NumValidRecords()) << "for value " << i;
     string data;
@@ -361,4 +377,1269 @@ TEST_F(RecordFileTest, BigLog) {
   EXPECT_EQ(num_written, NumValidRecords());
 }
 
+TEST_F(RecordFileTest, MountScanBufferSizes) {
+  const vector<pair<uint32_t, uint32_t> > regions = {
+      make_pair(0, 4096), make_pair(4096, 4096), make_pair(8192, 4096)};
+  InitRegions(regions);
+
+  // Fill most of the log with records of varying sizes.
+  size_t num_written = 0;
+  while (ri_->get_free_space(ri_) > 512) {
+    string data(1 + (num_written * 37) % 200, 'a' + num_written % 26);
+    ASSERT_GT(ri_->append(ri_, data.size(), &data[0]), 0);
+    num_written++;
+  }
+  int free_space = ri_->get_free_space(ri_);
+
+  const size_t kScanSizes[] = {0, 2, 3, 7, 64, 4096, 65536};
+  for (size_t scan_size : kScanSizes) {
+    record_intf_options options = {};
+    options.scan_buffer_size = scan_size;
+    ClearState();
+    InitRegions(regions, &options);
+
+    EXPECT_EQ(num_written, NumValidRecords()) << "for size " << scan_size;
+    EXPECT_EQ(free_space, ri_->get_free_space(ri_))
+        << "for size " << scan_size;
+  }
+
+  // Appends continue after the last record found.
+  const string expected_data("asdfjkl1111000");
+  EXPECT_GE(ri_->append(ri_, expected_data.size(), &expected_data[0]),
+            static_cast<ssize_t>(expected_data.size()));
+  EXPECT_EQ(num_written + 1, NumValidRecords());
+}
+
+TEST_F(RecordFileTest, ParallelInit) {
+  vector<pair<uint32_t, uint32_t> > regions;
+  for (uint32_t i = 0; i < 16; ++i) {
+    regions.push_back(make_pair(i * 0x100, 0xff));
+  }
+  InitRegions(regions);
+
+  // Wrap around so that the head is not the first region.
+  FillWithRecords();
+  EXPECT_GT(ri_->clear(ri_, 3), 0);
+  FillWithRecords();
+  size_t num_records = NumValidRecords();
+  int free_space = ri_->get_free_space(ri_);
+  vector<string> records(num_records);
+  for (size_t i = 0; i < num_records; ++i) {
+    EXPECT_EQ(0, GetRecord(i, &records[i]));
+  }
+
+  for (int threads : {2, 4, 32}) {
+    record_intf_options options = {};
+    options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+    options.init_threads = threads;
+    ClearState();
+    InitRegions(regions, &options);
+
+    ASSERT_EQ(num_records, NumValidRecords()) << "for threads " << threads;
+    EXPECT_EQ(free_space, ri_->get_free_space(ri_));
+    for (size_t i = 0; i < num_records; ++i) {
+      string data;
+      EXPECT_EQ(0, GetRecord(i, &data));
+      EXPECT_EQ(records[i], data);
+    }
+  }
+}
+
+TEST_F(RecordFileTest, AppendWithoutWritev) {
+  // Hide writev so appends go through the write() fallbacks.
+  pblog_flash_ops ops = flash_;
+  ops.writev = nullptr;
+  struct record_region regions[1] = {};
+  regions[0].offset = 0;
+  regions[0].size = 4096;
+  ri_ = new struct record_intf;
+  ASSERT_EQ(0, record_intf_init(ri_, regions, 1, &ops));
+
+  const string small_data("asdfjkl1111000");
+  const string large_data(1000, 'x');
+  EXPECT_GE(ri_->append(ri_, small_data.size(), &small_data[0]),
+            static_cast<ssize_t>(small_data.size()));
+  EXPECT_GE(ri_->append(ri_, large_data.size(), &large_data[0]),
+            static_cast<ssize_t>(large_data.size()));
+
+  EXPECT_EQ(static_cast<size_t>(2), NumValidRecords());
+  record_cursor cursor;
+  ASSERT_EQ(0, ri_->seek(ri_, &cursor, 0));
+  for (const string &expected_data : {small_data, large_data}) {
+    int next_offset = 0;
+    size_t len = 4096;
+    string data(len, '\0');
+    EXPECT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len, &data[0]));
+    EXPECT_EQ(expected_data, data.substr(0, len));
+  }
+}
+
+TEST_F(RecordFileTest, OpenFileBackends) {
+  // Records written through a descriptor kept open or through a mapping are
+  // read back by the plain file backend.
+  for (int flags : {0, PBLOG_FILE_MMAP}) {
+    unlink(filename_.c_str());
+    pblog_flash_ops ops;
+    ASSERT_EQ(0, pblog_file_ops_open(&ops, filename_.c_str(), 0x200, flags));
+    struct record_region regions[2] = {};
+    regions[0].size = 0x100;
+    regions[1].offset = 0x100;
+    regions[1].size = 0x100;
+    ri_ = new struct record_intf;
+    ASSERT_EQ(0, record_intf_init(ri_, regions, 2, &ops));
+    size_t num_written = FillWithRecords();
+    EXPECT_EQ(num_written, NumValidRecords());
+    EXPECT_EQ(0, ri_->flush(ri_));
+    ClearState();
+    pblog_file_ops_free(&ops);
+
+    InitRegions({make_pair(0, 0x100), make_pair(0x100, 0x100)});
+    EXPECT_EQ(num_written, NumValidRecords()) << "flags " << flags;
+    ClearState();
+  }
+}
+
+TEST_F(RecordFileTest, FileEraseLargeRange) {
+  // Erases larger than the backends' erased page, at an unaligned offset.
+  const size_t kSize = 3 * 64 * 1024;
+  const int kOffset = 100;
+  const size_t kLen = kSize - 2 * kOffset;
+  pblog_flash_ops ops;
+  ASSERT_EQ(0, pblog_file_ops_open(&ops, filename_.c_str(), kSize, 0));
+  for (pblog_flash_ops *erase_ops : {&flash_, &ops}) {
+    const string zeros(kSize, '\0');
+    ASSERT_EQ(kSize, ops.write(&ops, 0, zeros.size(), zeros.data()));
+    ASSERT_EQ(0, erase_ops->erase(erase_ops, kOffset, kLen));
+
+    string data(kSize, '\0');
+    ASSERT_EQ(kSize, ops.read(&ops, 0, data.size(), &data[0]));
+    EXPECT_EQ(string(kOffset, '\0'), data.substr(0, kOffset));
+    EXPECT_EQ(string(kLen, '\xff'), data.substr(kOffset, kLen));
+    EXPECT_EQ(string(kOffset, '\0'), data.substr(kOffset + kLen));
+  }
+  pblog_file_ops_free(&ops);
+}
+
+TEST_F(RecordFileTest, DirectFileBackend) {
+  pblog_flash_ops ops;
+  int rc = pblog_file_ops_open(&ops, filename_.c_str(), 0x4000,
+                               PBLOG_FILE_DIRECT);
+  if (rc == PBLOG_ERR_INVALID) {
+    GTEST_SKIP() << "O_DIRECT unsupported on " << filename_;
+  }
+  ASSERT_EQ(0, rc);
+  pblog_flash_geometry geometry;
+  ASSERT_EQ(0, ops.get_geometry(&ops, &geometry));
+  record_region regions[2];
+  ASSERT_EQ(0, record_regions_from_geometry(&geometry, 0, 0x4000, 2, regions));
+  EXPECT_EQ(0x2000, regions[1].offset);
+
+  ri_ = new struct record_intf;
+  ASSERT_EQ(0, record_intf_init(ri_, regions, 2, &ops));
+  size_t num_written = FillWithRecords();
+  EXPECT_EQ(num_written, NumValidRecords());
+  ClearState();
+  pblog_file_ops_free(&ops);
+
+  InitRegions({make_pair(0, 0x2000), make_pair(0x2000, 0x2000)});
+  EXPECT_EQ(num_written, NumValidRecords());
+}
+
+// Memory flash reporting a geometry, counting the writes and erases that do
+// not respect it.
+class GeometryFlash {
+ public:
+  static const uint32_t kProgramSize = 64;
+  static const uint32_t kEraseBlockSize = 256;
+
+  explicit GeometryFlash(size_t size) : misaligned(0), mem_(size, '\xff') {
+    geometry.program_size = kProgramSize;
+    geometry.erase_block_size = kEraseBlockSize;
+    geometry.alignment = kProgramSize;
+    pblog_mem_ops_init(&mem_ops_, &mem_[0]);
+    ops_ = pblog_flash_ops();
+    ops_.read = &Read;
+    ops_.write = &Write;
+    ops_.erase = &Erase;
+    ops_.get_geometry = &GetGeometry;
+    ops_.priv = this;
+  }
+  ~GeometryFlash() { pblog_mem_ops_free(&mem_ops_); }
+
+  pblog_flash_ops *ops() { return &ops_; }
+
+  int misaligned;
+  // The geometry reported by get_geometry().
+  pblog_flash_geometry geometry;
+
+ private:
+  static GeometryFlash *Self(pblog_flash_ops *ops) {
+    return static_cast<GeometryFlash *>(ops->priv);
+  }
+
+  static int Read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
+    GeometryFlash *self = Self(ops);
+    return self->mem_ops_.read(&self->mem_ops_, offset, len, data);
+  }
+
+  static int Write(pblog_flash_ops *ops, int offset, size_t len,
+                   const void *data) {
+    GeometryFlash *self = Self(ops);
+    if (offset % kProgramSize != 0 || len % kProgramSize != 0) {
+      self->misaligned++;
+    }
+    return self->mem_ops_.write(&self->mem_ops_, offset, len, data);
+  }
+
+  static int Erase(pblog_flash_ops *ops, int offset, size_t len) {
+    GeometryFlash *self = Self(ops);
+    if (offset % kEraseBlockSize != 0 || len % kEraseBlockSize != 0) {
+      self->misaligned++;
+    }
+    return self->mem_ops_.erase(&self->mem_ops_, offset, len);
+  }
+
+  static int GetGeometry(pblog_flash_ops *ops,
+                         pblog_flash_geometry *geometry) {
+    *geometry = Self(ops)->geometry;
+    return 0;
+  }
+
+  string mem_;
+  pblog_flash_ops mem_ops_;
+  pblog_flash_ops ops_;
+};
+
+TEST(RecordGeometryTest, AlignsWritesToGeometry) {
+  GeometryFlash flash(0x1000);
+  pblog_flash_geometry geometry;
+  ASSERT_EQ(0, flash.ops()->get_geometry(flash.ops(), &geometry));
+  record_intf ri;
+  record_region regions[3];
+
+  // Regions must be made of whole erase blocks.
+  ASSERT_EQ(0, record_regions_from_geometry(&geometry, 0x10, 0x1000, 3,
+                                            regions));
+  EXPECT_EQ(0x100, regions[0].offset);
+  EXPECT_EQ(0x500, regions[0].size);
+  regions[0].offset = 0x10;
+  EXPECT_EQ(PBLOG_ERR_INVALID, record_intf_init(&ri, regions, 3, flash.ops()));
+  regions[0].offset = 0x100;
+
+  for (size_t write_buffer_size : {0, 200}) {
+    record_intf_options options = {};
+    options.write_buffer_size = write_buffer_size;
+    options.erase_chunk_size = 100;
+    ASSERT_EQ(0, record_intf_init_options(&ri, regions, 3, flash.ops(),
+                                          &options));
+    ASSERT_GE(ri.clear(&ri, 0), 0);
+    size_t num_written = 0;
+    for (; num_written < 200; ++num_written) {
+      const string data(1 + num_written % 23, 'a' + num_written % 26);
+      if (ri.append(&ri, data.size(), data.data()) == PBLOG_ERR_NO_SPACE) {
+        break;
+      }
+    }
+    record_intf_free(&ri);
+    EXPECT_EQ(0, flash.misaligned);
+
+    // The padding after the last record is taken over by the next append.
+    ASSERT_EQ(0, record_intf_init(&ri, regions, 3, flash.ops()));
+    const string data("tail");
+    EXPECT_GT(ri.append(&ri, data.size(), data.data()), 0);
+    record_cursor cursor;
+    ASSERT_EQ(0, ri.seek(&ri, &cursor, 0));
+    size_t num_read = 0;
+    string last;
+    while (true) {
+      int next_offset = 0;
+      size_t len = 64;
+      string record(len, '\0');
+      ASSERT_EQ(0, ri.read_next(&ri, &cursor, &next_offset, &len, &record[0]));
+      if (next_offset == 0) {
+        break;
+      }
+      last = record.substr(0, len);
+      num_read++;
+    }
+    EXPECT_EQ(num_written + 1, num_read) << write_buffer_size;
+    EXPECT_EQ(data, last);
+    record_intf_free(&ri);
+    EXPECT_EQ(0, flash.misaligned);
+  }
+}
+
+TEST(RecordGeometryTest, RejectsInvalidGeometry) {
+  GeometryFlash flash(0x1000);
+  record_region regions[2] = {};
+  regions[0].size = 0x800;
+  regions[1].offset = 0x800;
+  regions[1].size = 0x800;
+  record_intf ri;
+
+  flash.geometry.erase_block_size = 0;
+  EXPECT_EQ(PBLOG_ERR_INVALID, record_intf_init(&ri, regions, 2, flash.ops()));
+  flash.geometry.erase_block_size = 96;
+  EXPECT_EQ(PBLOG_ERR_INVALID, record_intf_init(&ri, regions, 2, flash.ops()));
+
+  // A program size of 0 is taken as 1.
+  flash.geometry.program_size = 0;
+  flash.geometry.erase_block_size = GeometryFlash::kEraseBlockSize;
+  ASSERT_EQ(0, record_intf_init(&ri, regions, 2, flash.ops()));
+  const string data("record");
+  EXPECT_LT(0, ri.append(&ri, data.size(), data.data()));
+  record_intf_free(&ri);
+}
+
+TEST_F(RecordFileTest, CursorManyRegions) {
+  vector<pair<uint32_t, uint32_t> > regions;
+  for (uint32_t i = 0; i < 64; ++i) {
+    regions.push_back(make_pair(i * 0x40, 0x40));
+  }
+  InitRegions(regions);
+
+  size_t num_written = FillWithRecords();
+  ASSERT_GT(num_written, regions.size());
+
+  // Walk the whole log with a cursor.
+  vector<int> offsets;
+  record_cursor cursor;
+  ASSERT_EQ(0, ri_->seek(ri_, &cursor, 0));
+  while (true) {
+    int offset = cursor.offset;
+    int next_offset = 0;
+    size_t len = 4096;
+    string data(len, '\0');
+    EXPECT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len, &data[0]));
+    if (next_offset == 0) {
+      break;
+    }
+    EXPECT_EQ(StringPrintf("%08x", offsets.size()), data.substr(0, len));
+    offsets.push_back(offset);
+  }
+  EXPECT_EQ(num_written, offsets.size());
+
+  // Seek to each record, newest first.
+  for (size_t i = offsets.size(); i-- > 0;) {
+    int next_offset = 0;
+    size_t len = 4096;
+    string data(len, '\0');
+    ASSERT_EQ(0, ri_->seek(ri_, &cursor, offsets[i]));
+    EXPECT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len, &data[0]));
+    EXPECT_GT(next_offset, 0);
+    EXPECT_EQ(StringPrintf("%08x", i), data.substr(0, len));
+
+    // read_record must agree with the cursor.
+    EXPECT_EQ(0, ri_->read_record(ri_, offsets[i], &next_offset, &len,
+                                  &data[0]));
+    EXPECT_EQ(StringPrintf("%08x", i), data.substr(0, len));
+  }
+}
+
+TEST_F(RecordFileTest, CursorAfterClear) {
+  InitRegions({make_pair(0, 0x7f), make_pair(0x100, 0xff)});
+
+  size_t num_written = FillWithRecords();
+
+  record_cursor cursor;
+  int next_offset = 0;
+  size_t len = 4096;
+  string data(len, '\0');
+  ASSERT_EQ(0, ri_->seek(ri_, &cursor, 0));
+  ASSERT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len, &data[0]));
+  EXPECT_EQ(StringPrintf("%08x", 0), data.substr(0, len));
+
+  EXPECT_EQ(0x7f, ri_->clear(ri_, 1));
+  size_t num_cleared = num_written - NumValidRecords();
+
+  // The cursor's record was cleared, so it moves to the oldest record.
+  uint32_t generation = cursor.generation;
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len, &data[0]));
+  EXPECT_EQ(StringPrintf("%08x", num_cleared), data.substr(0, len));
+  EXPECT_NE(generation, cursor.generation);
+}
+
+TEST_F(RecordFileTest, CursorFollowsRecordAfterClear) {
+  InitRegions({make_pair(0, 0x7f), make_pair(0x100, 0xff),
+               make_pair(0x200, 0xff)});
+
+  size_t num_written = FillWithRecords();
+  ASSERT_LT(0, ri_->clear(ri_, 1));
+  size_t first = num_written - NumValidRecords();
+
+  // Park one cursor in the second region and one at its end, going backwards.
+  record_cursor cursor;
+  record_cursor reverse;
+  int offset = 0;
+  size_t len = 4096;
+  string data(len, '\0');
+  size_t target = first + 1;
+  ASSERT_EQ(0, ri_->seek(ri_, &cursor, 0));
+  while (true) {
+    len = data.size();
+    ASSERT_EQ(0, ri_->read_next(ri_, &cursor, &offset, &len, &data[0]));
+    if (cursor.region == 1) {
+      break;
+    }
+    target++;
+  }
+  ASSERT_EQ(0, ri_->seek_end(ri_, &reverse));
+
+  EXPECT_LT(0, ri_->clear(ri_, 1));
+
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_next(ri_, &cursor, &offset, &len, &data[0]));
+  EXPECT_EQ(StringPrintf("%08x", target), data.substr(0, len));
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_prev(ri_, &reverse, &offset, &len, &data[0]));
+  EXPECT_EQ(StringPrintf("%08x", num_written - 1), data.substr(0, len));
+}
+
+TEST_F(RecordFileTest, CursorReverse) {
+  InitRegions({make_pair(0, 0x7f), make_pair(0x100, 0xff),
+               make_pair(0x200, 0xff)});
+
+  size_t num_written = FillWithRecords();
+  ASSERT_EQ(num_written, NumValidRecords());
+
+  // Read every record backwards, then forwards again from the start.
+  record_cursor cursor;
+  int prev_offset = 0;
+  size_t len = 4096;
+  string data(len, '\0');
+  ASSERT_EQ(0, ri_->seek_end(ri_, &cursor));
+  for (size_t i = num_written; i-- > 0;) {
+    len = data.size();
+    ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+    EXPECT_NE(0, prev_offset);
+    EXPECT_EQ(StringPrintf("%08x", i), data.substr(0, len));
+  }
+  len = data.size();
+  EXPECT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+  EXPECT_EQ(0, prev_offset);
+  EXPECT_EQ(0, cursor.offset);
+
+  int next_offset = 0;
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len, &data[0]));
+  EXPECT_EQ(StringPrintf("%08x", 0), data.substr(0, len));
+}
+
+TEST_F(RecordFileTest, CursorReverseAfterAppendAndClear) {
+  InitRegions({make_pair(0, 0x7f), make_pair(0x100, 0xff)});
+
+  const string first("first");
+  const string second("second");
+  ASSERT_LT(0, ri_->append(ri_, first.size(), &first[0]));
+
+  // Index the region, then append to it.
+  record_cursor cursor;
+  int prev_offset = 0;
+  size_t len = 4096;
+  string data(len, '\0');
+  ASSERT_EQ(0, ri_->seek_end(ri_, &cursor));
+  ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+  EXPECT_EQ(first, data.substr(0, len));
+  ASSERT_LT(0, ri_->append(ri_, second.size(), &second[0]));
+
+  ASSERT_EQ(0, ri_->seek_end(ri_, &cursor));
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+  EXPECT_EQ(second, data.substr(0, len));
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+  EXPECT_EQ(first, data.substr(0, len));
+
+  // Cleared regions start with an empty index.
+  EXPECT_LT(0, ri_->clear(ri_, 0));
+  ASSERT_LT(0, ri_->append(ri_, second.size(), &second[0]));
+  ASSERT_EQ(0, ri_->seek_end(ri_, &cursor));
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+  EXPECT_EQ(second, data.substr(0, len));
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+  EXPECT_EQ(0, prev_offset);
+}
+
+TEST_F(RecordFileTest, ReadAheadSizes) {
+  for (size_t read_ahead_size : {0, 5, 64, RECORD_DEFAULT_READ_AHEAD_SIZE}) {
+    SCOPED_TRACE(read_ahead_size);
+    record_intf_options options;
+    memset(&options, 0, sizeof(options));
+    options.read_ahead_size = read_ahead_size;
+    if (ri_ != nullptr) {
+      ClearState();
+    }
+    InitRegions({make_pair(0, 0x7f), make_pair(0x100, 0xff),
+                 make_pair(0x200, 0xff)}, &options);
+    ri_->clear(ri_, 0);
+
+    // Records appended after the window was loaded are read too.
+    record_cursor cursor;
+    int step = 0;
+    size_t len = 4096;
+    string data(len, '\0');
+    ASSERT_EQ(0, ri_->seek(ri_, &cursor, 0));
+    size_t num_written = 0;
+    while (true) {
+      const string expected = StringPrintf("%08x", num_written);
+      if (ri_->append(ri_, expected.size(), &expected[0]) < 0) {
+        break;
+      }
+      num_written++;
+      len = data.size();
+      ASSERT_EQ(0, ri_->read_next(ri_, &cursor, &step, &len, &data[0]));
+      EXPECT_EQ(expected, data.substr(0, len));
+    }
+
+    ASSERT_EQ(0, ri_->seek_end(ri_, &cursor));
+    for (size_t i = num_written; i-- > 0;) {
+      len = data.size();
+      ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &step, &len, &data[0]));
+      EXPECT_EQ(StringPrintf("%08x", i), data.substr(0, len));
+    }
+  }
+}
+
+// Returns the number of records on flash, as seen by a new record_intf.
+size_t NumRecordsOnFlash(pblog_flash_ops *flash,
+                         const vector<pair<uint32_t, uint32_t> > &regions) {
+  vector<record_region> region_structs(regions.size());
+  for (size_t i = 0; i < regions.size(); ++i) {
+    memset(&region_structs[i], 0, sizeof(region_structs[i]));
+    region_structs[i].offset = regions[i].first;
+    region_structs[i].size = regions[i].second;
+  }
+  record_intf ri;
+  EXPECT_EQ(0, record_intf_init(&ri, &region_structs[0], regions.size(),
+                                flash));
+  size_t num_records = 0;
+  record_cursor cursor;
+  int next_offset = 0;
+  ri.seek(&ri, &cursor, 0);
+  while (ri.read_next(&ri, &cursor, &next_offset, nullptr, nullptr) == 0 &&
+         next_offset != 0) {
+    num_records++;
+  }
+  record_intf_free(&ri);
+  return num_records;
+}
+
+TEST_F(RecordFileTest, WriteBuffer) {
+  const vector<pair<uint32_t, uint32_t> > regions = {make_pair(0, 0x7f),
+                                                     make_pair(0x100, 0xff)};
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.write_buffer_size = 64;
+  options.flush_records = 3;
+  InitRegions(regions, &options);
+
+  // Buffered records can be read before they reach flash.
+  const string expected_data("asdfjkl1111000");
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(static_cast<int>(expected_data.size() + sizeof(record_header)),
+              ri_->append(ri_, expected_data.size(), &expected_data[0]));
+  }
+  EXPECT_EQ(static_cast<size_t>(2), NumValidRecords());
+  string data;
+  EXPECT_EQ(0, GetRecord(1, &data));
+  EXPECT_EQ(expected_data, data);
+  EXPECT_EQ(static_cast<size_t>(0), NumRecordsOnFlash(&flash_, regions));
+
+  // The record count policy flushes the buffer.
+  EXPECT_LT(0, ri_->append(ri_, expected_data.size(), &expected_data[0]));
+  EXPECT_EQ(static_cast<size_t>(3), NumRecordsOnFlash(&flash_, regions));
+
+  EXPECT_LT(0, ri_->append(ri_, expected_data.size(), &expected_data[0]));
+  EXPECT_EQ(static_cast<size_t>(3), NumRecordsOnFlash(&flash_, regions));
+  EXPECT_EQ(0, ri_->flush(ri_));
+  EXPECT_EQ(static_cast<size_t>(4), NumRecordsOnFlash(&flash_, regions));
+
+  // Fill both regions, reading back through the buffer.
+  size_t num_written = 4 + FillWithRecords();
+  EXPECT_EQ(num_written, NumValidRecords());
+  record_cursor cursor;
+  int prev_offset = 0;
+  size_t len = 4096;
+  data.resize(len);
+  ASSERT_EQ(0, ri_->seek_end(ri_, &cursor));
+  len = data.size();
+  ASSERT_EQ(0, ri_->read_prev(ri_, &cursor, &prev_offset, &len, &data[0]));
+  EXPECT_EQ(StringPrintf("%08x", num_written - 5), data.substr(0, len));
+
+  // Freeing the record_intf flushes the buffer.
+  ClearState();
+  InitRegions(regions);
+  EXPECT_EQ(num_written, NumValidRecords());
+}
+
+// Memory flash whose writes fail on demand.
+class FailingFlash {
+ public:
+  explicit FailingFlash(size_t size) : fail_writes(false), mem_(size, '\xff') {
+    pblog_mem_ops_init(&mem_ops_, &mem_[0]);
+    ops_ = pblog_flash_ops();
+    ops_.read = &Read;
+    ops_.write = &Write;
+    ops_.erase = &Erase;
+    ops_.priv = this;
+  }
+  ~FailingFlash() { pblog_mem_ops_free(&mem_ops_); }
+
+  pblog_flash_ops *ops() { return &ops_; }
+
+  bool fail_writes;
+
+ private:
+  static FailingFlash *Self(pblog_flash_ops *ops) {
+    return static_cast<FailingFlash *>(ops->priv);
+  }
+
+  static int Read(pblog_flash_ops *ops, int offset, size_t len, void *data) {
+    FailingFlash *self = Self(ops);
+    return self->mem_ops_.read(&self->mem_ops_, offset, len, data);
+  }
+
+  static int Write(pblog_flash_ops *ops, int offset, size_t len,
+                   const void *data) {
+    FailingFlash *self = Self(ops);
+    if (self->fail_writes) {
+      return PBLOG_ERR_IO;
+    }
+    return self->mem_ops_.write(&self->mem_ops_, offset, len, data);
+  }
+
+  static int Erase(pblog_flash_ops *ops, int offset, size_t len) {
+    FailingFlash *self = Self(ops);
+    return self->mem_ops_.erase(&self->mem_ops_, offset, len);
+  }
+
+  string mem_;
+  pblog_flash_ops mem_ops_;
+  pblog_flash_ops ops_;
+};
+
+TEST(RecordFailureTest, WriteBufferFlushFailsAtRegionSwitch) {
+  FailingFlash flash(0x200);
+  record_region regions[2] = {};
+  regions[0].size = 0x70;
+  regions[1].offset = 0x100;
+  regions[1].size = 0x70;
+  record_intf_options options = {};
+  options.write_buffer_size = 64;
+  record_intf ri;
+  ASSERT_EQ(0, record_intf_init_options(&ri, regions, 2, flash.ops(),
+                                        &options));
+
+  // Eight records fill the first region, the last four of them in the write
+  // buffer.  The append that moves to the second region fails to flush them.
+  for (int i = 0; i < 8; ++i) {
+    const string data = StringPrintf("record%04d", i);
+    ASSERT_LT(0, ri.append(&ri, data.size(), data.data()));
+  }
+  flash.fail_writes = true;
+  const string failed("record0008");
+  EXPECT_EQ(PBLOG_ERR_IO, ri.append(&ri, failed.size(), failed.data()));
+  flash.fail_writes = false;
+  vector<string> expected;
+  for (int i = 0; i < 4; ++i) {
+    expected.push_back(StringPrintf("record%04d", i));
+  }
+  for (int i = 9; i < 12; ++i) {
+    expected.push_back(StringPrintf("record%04d", i));
+    ASSERT_LT(0, ri.append(&ri, expected.back().size(),
+                           expected.back().data()));
+  }
+
+  // Cursors, seek_end and offsets agree on the records left.
+  record_cursor cursor;
+  ASSERT_EQ(0, ri.seek(&ri, &cursor, 0));
+  vector<string> by_cursor;
+  vector<int> offsets;
+  while (true) {
+    int next_offset = 0;
+    size_t len = 64;
+    string record(len, '\0');
+    offsets.push_back(cursor.offset);
+    ASSERT_EQ(0, ri.read_next(&ri, &cursor, &next_offset, &len, &record[0]));
+    if (next_offset == 0) {
+      offsets.pop_back();
+      break;
+    }
+    by_cursor.push_back(record.substr(0, len));
+  }
+  EXPECT_EQ(expected, by_cursor);
+  record_cursor end;
+  ASSERT_EQ(0, ri.seek_end(&ri, &end));
+  EXPECT_EQ(static_cast<int>(expected.size() * (failed.size() + 3)),
+            end.offset);
+
+  vector<string> by_offset;
+  for (int offset : offsets) {
+    int next_offset = 0;
+    size_t len = 64;
+    string record(len, '\0');
+    ASSERT_EQ(0, ri.read_record(&ri, offset, &next_offset, &len, &record[0]));
+    by_offset.push_back(record.substr(0, len));
+  }
+  EXPECT_EQ(expected, by_offset);
+  record_intf_free(&ri);
+}
+
+TEST(RecordFailureTest, FailedFlushEmptiesRegionThenRemount) {
+  FailingFlash flash(0x300);
+  record_region regions[3] = {};
+  for (int i = 0; i < 3; ++i) {
+    regions[i].offset = i * 0x100;
+    regions[i].size = 0x70;
+  }
+  record_intf_options options = {};
+  options.write_buffer_size = 128;
+  record_intf ri;
+  ASSERT_EQ(0, record_intf_init_options(&ri, regions, 3, flash.ops(),
+                                        &options));
+
+  // All records of the first region are still in the write buffer when the
+  // append that moves to the second region fails to flush them, leaving the
+  // first region empty.
+  for (int i = 0; i < 8; ++i) {
+    const string data = StringPrintf("record%04d", i);
+    ASSERT_LT(0, ri.append(&ri, data.size(), data.data()));
+  }
+  flash.fail_writes = true;
+  const string failed("record0008");
+  EXPECT_EQ(PBLOG_ERR_IO, ri.append(&ri, failed.size(), failed.data()));
+  flash.fail_writes = false;
+  vector<string> expected;
+  for (int i = 9; i < 19; ++i) {
+    expected.push_back(StringPrintf("record%04d", i));
+    ASSERT_LT(0, ri.append(&ri, expected.back().size(),
+                           expected.back().data()));
+  }
+  record_intf_free(&ri);
+
+  // The regions after the empty one are still in the log after a remount.
+  ASSERT_EQ(0, record_intf_init_options(&ri, regions, 3, flash.ops(),
+                                        &options));
+  record_cursor cursor;
+  ASSERT_EQ(0, ri.seek(&ri, &cursor, 0));
+  vector<string> records;
+  while (true) {
+    int next_offset = 0;
+    size_t len = 64;
+    string record(len, '\0');
+    ASSERT_EQ(0, ri.read_next(&ri, &cursor, &next_offset, &len, &record[0]));
+    if (next_offset == 0) {
+      break;
+    }
+    records.push_back(record.substr(0, len));
+  }
+  EXPECT_EQ(expected, records);
+  record_intf_free(&ri);
+}
+
+TEST_F(RecordFileTest, AppendBatch) {
+  const vector<pair<uint32_t, uint32_t> > regions = {make_pair(0, 0x7f),
+                                                     make_pair(0x100, 0xff)};
+  // Batches are written directly and through a write buffer.
+  for (size_t write_buffer_size : {0, 64}) {
+    record_intf_options options;
+    memset(&options, 0, sizeof(options));
+    options.write_buffer_size = write_buffer_size;
+    InitRegions(regions, &options);
+
+    string data;
+    vector<size_t> lens;
+    for (int i = 0; i < 100; ++i) {
+      string record = StringPrintf("%d", i * 997);
+      data += record;
+      lens.push_back(record.size());
+    }
+    EXPECT_EQ(3, ri_->append_batch(ri_, 3, lens.data(), data.data()));
+
+    // Batches stop at the end of a region, then when the log is full.
+    int appended = 3;
+    const char *next = data.data() + lens[0] + lens[1] + lens[2];
+    vector<int> counts;
+    while (true) {
+      int rc = ri_->append_batch(ri_, 100 - appended, &lens[appended], next);
+      if (rc < 0) {
+        EXPECT_EQ(PBLOG_ERR_NO_SPACE, rc);
+        break;
+      }
+      counts.push_back(rc);
+      for (int i = appended; i < appended + rc; ++i) {
+        next += lens[i];
+      }
+      appended += rc;
+    }
+    ASSERT_EQ(static_cast<size_t>(2), counts.size());
+    EXPECT_GT(100, appended);
+    EXPECT_EQ(0, ri_->flush(ri_));
+
+    ASSERT_EQ(static_cast<size_t>(appended), NumValidRecords());
+    EXPECT_EQ(static_cast<size_t>(appended),
+              NumRecordsOnFlash(&flash_, regions));
+    record_cursor cursor;
+    ASSERT_EQ(0, ri_->seek(ri_, &cursor, 0));
+    for (int i = 0; i < appended; ++i) {
+      int next_offset = 0;
+      size_t len = 4096;
+      string record(len, '\0');
+      EXPECT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len,
+                                  &record[0]));
+      EXPECT_EQ(StringPrintf("%d", i * 997), record.substr(0, len));
+    }
+
+    ASSERT_GE(ri_->clear(ri_, 0), 0);
+    ClearState();
+  }
+}
+
+TEST_F(RecordFileTest, SkipToRegion) {
+  InitRegions({make_pair(0, 0x80), make_pair(0x80, 0x80),
+               make_pair(0x100, 0x80)});
+  const string record("asdfjkl1111000");
+  EXPECT_LT(0, ri_->append(ri_, record.size(), &record[0]));
+  EXPECT_EQ(0, ri_->skip_to_region(ri_, 2));
+  // Skipping back does nothing.
+  EXPECT_EQ(0, ri_->skip_to_region(ri_, 1));
+  EXPECT_LT(0, ri_->append(ri_, record.size(), &record[0]));
+  EXPECT_EQ(PBLOG_ERR_NO_SPACE, ri_->skip_to_region(ri_, 3));
+
+  record_cursor cursor;
+  ASSERT_EQ(0, ri_->seek_end(ri_, &cursor));
+  EXPECT_EQ(2, cursor.region);
+  EXPECT_EQ(static_cast<size_t>(2), NumValidRecords());
+
+  // Clearing the first region drops its record only.
+  ASSERT_LT(0, ri_->clear(ri_, 1));
+  EXPECT_EQ(static_cast<size_t>(1), NumValidRecords());
+}
+
+// Summarizes records by the set of their first letters.
+void SummarizeLetters(void *summary, const void *data, size_t len,
+                      void *priv) {
+  if (len > 0) {
+    *static_cast<uint32_t *>(summary) |=
+        1u << (static_cast<const char *>(data)[0] - 'a');
+  }
+  ++*static_cast<int *>(priv);
+}
+
+int SkipWithoutLetter(const void *summary, void *priv) {
+  return !(*static_cast<const uint32_t *>(summary) &
+           (1u << (*static_cast<char *>(priv) - 'a')));
+}
+
+TEST_F(RecordFileTest, SkipRegions) {
+  const vector<pair<uint32_t, uint32_t> > regions = {
+      make_pair(0, 0x80), make_pair(0x80, 0x80), make_pair(0x100, 0x80)};
+  int summarized = 0;
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.summary_size = sizeof(uint32_t);
+  options.summarize = SummarizeLetters;
+  options.summary_priv = &summarized;
+  InitRegions(regions, &options);
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(0, ri_->skip_to_region(ri_, i));
+    for (int j = 0; j < 3; ++j) {
+      string data = StringPrintf("%c%d", 'a' + i, j);
+      ASSERT_LT(0, ri_->append(ri_, data.size(), &data[0]));
+    }
+  }
+  EXPECT_EQ(9, summarized);
+
+  // Returns the records read by a scan for a letter.
+  auto scan = [this](char letter) {
+    string found;
+    record_cursor cursor;
+    EXPECT_EQ(0, ri_->seek(ri_, &cursor, 0));
+    while (true) {
+      EXPECT_LE(0, ri_->skip_regions(ri_, &cursor, SkipWithoutLetter,
+                                     &letter));
+      size_t len = 16;
+      char data[16];
+      int next_offset;
+      EXPECT_EQ(0, ri_->read_next(ri_, &cursor, &next_offset, &len, data));
+      if (next_offset == 0) {
+        return found;
+      }
+      found += string(data, len) + " ";
+    }
+  };
+  EXPECT_EQ("b0 b1 b2 ", scan('b'));
+  EXPECT_EQ("c0 c1 c2 ", scan('c'));
+  EXPECT_EQ("", scan('d'));
+
+  // A cursor in the middle of a region stays there.
+  record_cursor cursor;
+  char letter = 'c';
+  ASSERT_EQ(0, ri_->seek(ri_, &cursor, 5));
+  EXPECT_EQ(0, ri_->skip_regions(ri_, &cursor, SkipWithoutLetter, &letter));
+  EXPECT_EQ(5, cursor.offset);
+
+  // Summaries of the records found at init are built when first needed.
+  ClearState();
+  summarized = 0;
+  InitRegions(regions, &options);
+  EXPECT_EQ(0, summarized);
+  EXPECT_EQ("a0 a1 a2 ", scan('a'));
+  EXPECT_EQ(9, summarized);
+  EXPECT_EQ("b0 b1 b2 ", scan('b'));
+  EXPECT_EQ(9, summarized);
+
+  // Cleared regions are empty.
+  ASSERT_LT(0, ri_->clear(ri_, 1));
+  EXPECT_EQ("", scan('a'));
+  EXPECT_EQ("c0 c1 c2 ", scan('c'));
+
+  // Summaries need a summarize function.
+  ClearState();
+  options.summarize = nullptr;
+  record_intf ri;
+  record_region region = {0, 0x80, 0, 0};
+  EXPECT_EQ(PBLOG_ERR_INVALID,
+            record_intf_init_options(&ri, &region, 1, &flash_, &options));
+}
+
+TEST_F(RecordFileTest, SpareRegions) {
+  const vector<pair<uint32_t, uint32_t> > regions = {
+      make_pair(0, 0x80), make_pair(0x100, 0x80), make_pair(0x200, 0x80)};
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.spare_regions = 1;
+  options.erase_chunk_size = 0x40;
+  InitRegions(regions, &options);
+
+  // The spare region is not filled.
+  size_t num_written = FillWithRecords();
+  size_t per_region = num_written / 2;
+  EXPECT_EQ(per_region * 2, num_written);
+  EXPECT_EQ(0, ri_->erase_pending(ri_, 1));
+
+  // Clearing a region only drops it from the log.
+  EXPECT_EQ(0x80, ri_->clear(ri_, 1));
+  EXPECT_EQ(per_region, NumValidRecords());
+  EXPECT_EQ(1, ri_->erase_pending(ri_, 0));
+
+  // Appends move on to the spare region while the old one is erased.
+  const string expected_data("asdfjkl1111000");
+  EXPECT_LT(0, ri_->append(ri_, expected_data.size(), &expected_data[0]));
+  EXPECT_EQ(1, ri_->erase_pending(ri_, 1));
+  EXPECT_EQ(0, ri_->erase_pending(ri_, 1));
+  EXPECT_EQ(per_region + 1, NumValidRecords());
+
+  // A partially erased region is recreated at init.
+  EXPECT_EQ(0x80, ri_->clear(ri_, 1));
+  EXPECT_EQ(1, ri_->erase_pending(ri_, 1));
+  ClearState();
+  InitRegions(regions, &options);
+  EXPECT_EQ(static_cast<size_t>(1), NumValidRecords());
+  string data;
+  EXPECT_EQ(0, GetRecord(0, &data));
+  EXPECT_EQ(expected_data, data);
+}
+
+TEST_F(RecordFileTest, SpareRegionsRemountBeforeErase) {
+  const vector<pair<uint32_t, uint32_t> > regions = {
+      make_pair(0, 0x80), make_pair(0x100, 0x80), make_pair(0x200, 0x80)};
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.spare_regions = 1;
+  InitRegions(regions, &options);
+
+  size_t num_written = FillWithRecords();
+  size_t per_region = num_written / 2;
+  EXPECT_EQ(0x80, ri_->clear(ri_, 1));
+  EXPECT_EQ(per_region, NumValidRecords());
+  string first;
+  ASSERT_EQ(0, GetRecord(0, &first));
+
+  // The cleared records stay cleared if the region was never erased.
+  ClearState();
+  InitRegions(regions, &options);
+  EXPECT_EQ(per_region, NumValidRecords());
+  string data;
+  ASSERT_EQ(0, GetRecord(0, &data));
+  EXPECT_EQ(first, data);
+}
+
+TEST_F(RecordFileTest, InvalidSpareRegions) {
+  record_region regions[2] = {};
+  regions[0].size = 0x80;
+  regions[1].offset = 0x100;
+  regions[1].size = 0x80;
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  record_intf ri;
+  for (int spare_regions : {-1, 2, 3}) {
+    options.spare_regions = spare_regions;
+    EXPECT_EQ(PBLOG_ERR_INVALID,
+              record_intf_init_options(&ri, regions, 2, &flash_, &options))
+        << spare_regions;
+  }
+  options.spare_regions = 1;
+  ASSERT_EQ(0, record_intf_init_options(&ri, regions, 2, &flash_, &options));
+  uint32_t max_region_size;
+  EXPECT_EQ(1, record_intf_num_regions(&ri, &max_region_size));
+  record_intf_free(&ri);
+}
+
+TEST_F(RecordFileTest, SpareRegionsEraseBehind) {
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.spare_regions = 1;
+  InitRegions({make_pair(0, 0x80), make_pair(0x100, 0x80),
+               make_pair(0x200, 0x80)}, &options);
+
+  // Appends finish the erase of the next region if nothing else did.
+  for (int i = 0; i < 10; ++i) {
+    size_t num_written = FillWithRecords();
+    EXPECT_LT(0u, num_written);
+    EXPECT_EQ(0x80, ri_->clear(ri_, 1));
+  }
+  EXPECT_LT(0u, NumValidRecords());
+}
+
+TEST_F(RecordFileTest, Crc32cRecordsPersist) {
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.format = RECORD_FORMAT_CRC32C;
+  InitRegions({make_pair(0, 0xff), make_pair(0x100, 0xff)}, &options);
+
+  const string expected_data("asdfjkl1111000");
+  EXPECT_EQ(static_cast<int>(expected_data.size() +
+                             sizeof(record_header_crc32c)),
+            ri_->append(ri_, expected_data.size(), &expected_data[0]));
+
+  // The format is kept by the region, whatever the options on re-init.
+  ClearState();
+  InitRegions({make_pair(0, 0xff), make_pair(0x100, 0xff)});
+
+  EXPECT_EQ(static_cast<size_t>(1), NumValidRecords());
+  string data;
+  EXPECT_EQ(0, GetRecord(0, &data));
+  EXPECT_EQ(expected_data, data);
+
+  // Corrupt the last byte of the record data.
+  size_t offset = sizeof(region_header) + sizeof(record_header_crc32c) +
+                  expected_data.size() - 1;
+  unsigned char val = 0;
+  EXPECT_EQ(static_cast<ssize_t>(sizeof(val)),
+            flash_.write(&flash_, offset, sizeof(val), &val));
+  EXPECT_EQ(PBLOG_ERR_CHECKSUM, GetRecord(0, &data));
+}
+
+TEST_F(RecordFileTest, LegacyRegionsConvertOnClear) {
+  InitRegions({make_pair(0, 0xff), make_pair(0x100, 0xff)});
+
+  const string expected_data("asdfjkl1111000");
+  EXPECT_EQ(static_cast<int>(expected_data.size() + sizeof(record_header)),
+            ri_->append(ri_, expected_data.size(), &expected_data[0]));
+
+  // Existing records stay readable and new ones are appended in the format
+  // of their region until it is cleared.
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.format = RECORD_FORMAT_CRC32C;
+  ClearState();
+  InitRegions({make_pair(0, 0xff), make_pair(0x100, 0xff)}, &options);
+
+  string data;
+  EXPECT_EQ(0, GetRecord(0, &data));
+  EXPECT_EQ(expected_data, data);
+  EXPECT_EQ(static_cast<int>(expected_data.size() + sizeof(record_header)),
+            ri_->append(ri_, expected_data.size(), &expected_data[0]));
+
+  EXPECT_EQ(0xff * 2, ri_->clear(ri_, 0));
+  EXPECT_EQ(static_cast<int>(expected_data.size() +
+                             sizeof(record_header_crc32c)),
+            ri_->append(ri_, expected_data.size(), &expected_data[0]));
+  EXPECT_EQ(0, GetRecord(0, &data));
+  EXPECT_EQ(expected_data, data);
+}
+
+#ifdef PBLOG_USE_PTHREADS
+// One thread appends and clears while others scan the log with cursors.  A
+// scan must see consecutive records except where a clear moved its cursor.
+TEST(RecordThreadTest, ConcurrentReaders) {
+  const int kNumRegions = 4;
+  const int kRegionSize = 4096;
+  const int kNumReaders = 4;
+  const size_t kNumRecords = 20000;
+
+  string mem(kNumRegions * kRegionSize, '\xff');
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_mem_ops_init(&flash, &mem[0]));
+  vector<record_region> regions(kNumRegions);
+  for (int i = 0; i < kNumRegions; ++i) {
+    memset(&regions[i], 0, sizeof(regions[i]));
+    regions[i].offset = i * kRegionSize;
+    regions[i].size = kRegionSize;
+  }
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.scan_buffer_size = RECORD_DEFAULT_SCAN_BUFFER_SIZE;
+  options.read_ahead_size = 256;
+  options.write_buffer_size = 128;
+  options.thread_safe = 1;
+  record_intf ri;
+  ASSERT_EQ(0, record_intf_init_options(&ri, &regions[0], kNumRegions,
+                                        &flash, &options));
+
+  std::atomic<bool> done(false);
+  vector<std::thread> readers;
+  for (int i = 0; i < kNumReaders; ++i) {
+    readers.emplace_back([&ri, &done] {
+      string data(64, '\0');
+      while (!done) {
+        record_cursor cursor;
+        ASSERT_EQ(0, ri.seek(&ri, &cursor, 0));
+        long prev = -1;
+        while (true) {
+          const uint32_t generation = cursor.generation;
+          int next_offset = 0;
+          size_t len = data.size();
+          ASSERT_EQ(0, ri.read_next(&ri, &cursor, &next_offset, &len,
+                                    &data[0]));
+          if (len == 0) {
+            break;
+          }
+          const long value = strtol(data.substr(0, len).c_str(), nullptr, 16);
+          if (prev >= 0 && generation == cursor.generation) {
+            ASSERT_EQ(prev + 1, value);
+          }
+          prev = value;
+        }
+      }
+    });
+  }
+
+  for (size_t i = 0; i < kNumRecords; ++i) {
+    const string record = StringPrintf("%08x", i);
+    int rc = ri.append(&ri, record.size(), &record[0]);
+    if (rc == PBLOG_ERR_NO_SPACE) {
+      EXPECT_LT(0, ri.clear(&ri, 1));
+      rc = ri.append(&ri, record.size(), &record[0]);
+    }
+    EXPECT_LT(0, rc);
+    if (rc < 0) {
+      break;
+    }
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  record_intf_free(&ri);
+  pblog_mem_ops_free(&flash);
+}
+
+// Two cursors reading different regions in turn each read their records once,
+// rather than reloading a read-ahead window the other one evicted.
+TEST(RecordThreadTest, InterleavedReadersInDifferentRegions) {
+  const int kRegionSize = 4096;
+  const int kRecordSize = 8 + 3;
+  const int kPerRegion = (kRegionSize - 8) / kRecordSize;
+  const int kNumReads = 200;
+  pblog_sim_options sim_options = {};
+  sim_options.size = 2 * kRegionSize;
+  pblog_flash_ops sim;
+  ASSERT_EQ(0, pblog_sim_ops_init(&sim, &sim_options));
+  record_region regions[2] = {};
+  regions[1].offset = kRegionSize;
+  regions[0].size = regions[1].size = kRegionSize;
+  record_intf_options options = {};
+  options.read_ahead_size = RECORD_DEFAULT_READ_AHEAD_SIZE;
+  options.thread_safe = 1;
+  record_intf ri;
+  ASSERT_EQ(0, record_intf_init_options(&ri, regions, 2, &sim, &options));
+  for (int i = 0; i < kPerRegion + kNumReads; ++i) {
+    const string record = StringPrintf("%08x", i);
+    ASSERT_LT(0, ri.append(&ri, record.size(), record.data()));
+  }
+
+  record_cursor cursors[2];
+  ASSERT_EQ(0, ri.seek(&ri, &cursors[0], 0));
+  ASSERT_EQ(0, ri.seek(&ri, &cursors[1], kPerRegion * kRecordSize));
+  pblog_sim_reset_stats(&sim);
+  for (int i = 0; i < kNumReads; ++i) {
+    for (int c = 0; c < 2; ++c) {
+      int next_offset = 0;
+      size_t len = 64;
+      string data(len, '\0');
+      ASSERT_EQ(0, ri.read_next(&ri, &cursors[c], &next_offset, &len,
+                                &data[0]));
+      EXPECT_EQ(StringPrintf("%08x", c * kPerRegion + i), data.substr(0, len));
+    }
+  }
+  pblog_sim_stats stats;
+  pblog_sim_get_stats(&sim, &stats);
+  EXPECT_GE(2u * 2 * kNumReads, stats.reads);
+  EXPECT_GE(2u * kNumReads * kRecordSize, stats.bytes_read);
+  record_intf_free(&ri);
+  pblog_sim_ops_free(&sim);
+}
+
+// Reads through a direct I/O file from several threads at once all see the
+// file contents, although they share the buffer of the file operations.
+TEST(RecordThreadTest, DirectFileConcurrentReads) {
+  const int kSize = 0x10000;
+  const int kNumReaders = 4;
+  const string filename = "/tmp/record_direct.tst";
+  pblog_flash_ops ops;
+  int rc = pblog_file_ops_open(&ops, filename.c_str(), kSize,
+                               PBLOG_FILE_DIRECT);
+  if (rc == PBLOG_ERR_INVALID) {
+    unlink(filename.c_str());
+    GTEST_SKIP() << "O_DIRECT unsupported on " << filename;
+  }
+  ASSERT_EQ(0, rc);
+  string contents(kSize, '\0');
+  for (int i = 0; i < kSize; ++i) {
+    contents[i] = static_cast<char>(i * 7 / 3);
+  }
+  ASSERT_EQ(kSize, ops.write(&ops, 0, contents.size(), contents.data()));
+
+  vector<std::thread> readers;
+  for (int i = 0; i < kNumReaders; ++i) {
+    readers.emplace_back([&ops, &contents, i] {
+      string data(0x3000, '\0');
+      for (int n = 0; n < 200; ++n) {
+        const int offset = (n * 4099 + i * 1021) % (kSize - 0x3000);
+        const size_t len = 1 + (n * 577 + i * 131) % data.size();
+        ASSERT_EQ(static_cast<int>(len), ops.read(&ops, offset, len, &data[0]));
+        ASSERT_EQ(contents.substr(offset, len), data.substr(0, len))
+            << offset << " " << len;
+      }
+    });
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  pblog_file_ops_free(&ops);
+  unlink(filename.c_str());
+}
+
+#else
+TEST(RecordThreadTest, ThreadSafeUnavailable) {
+  string mem(4096, '\xff');
+  pblog_flash_ops flash;
+  ASSERT_EQ(0, pblog_mem_ops_init(&flash, &mem[0]));
+  record_region region;
+  memset(&region, 0, sizeof(region));
+  region.size = mem.size();
+  record_intf_options options;
+  memset(&options, 0, sizeof(options));
+  options.thread_safe = 1;
+  record_intf ri;
+  EXPECT_EQ(PBLOG_ERR_INVALID,
+            record_intf_init_options(&ri, &region, 1, &flash, &options));
+}
+#endif
+
 }  // namespace
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <gtest/gtest.h>
+#include <pblog/common.h>
+#include <pblog/record.h>
+#include <pblog/sim.h>
+
+#include "common.hh"
+
+namespace {
+
+using pblog_test::StringPrintf;
+using std::string;
+
+const uint32_t kProgramSize = 256;
+const uint32_t kEraseBlockSize = 4096;
+
+class SimTest : public ::testing::Test {
+ public:
+  SimTest() : ops_() {}
+  ~SimTest() override { pblog_sim_ops_free(&ops_); }
+
+  void Init(uint32_t max_programs, int strict) {
+    pblog_sim_options options = {};
+    options.size = 4 * kEraseBlockSize;
+    options.program_size = kProgramSize;
+    options.erase_block_size = kEraseBlockSize;
+    options.read_ns = 100;
+    options.program_ns = 1000;
+    options.erase_ns = 100000;
+    options.max_programs = max_programs;
+    options.strict = strict;
+    ASSERT_EQ(0, pblog_sim_ops_init(&ops_, &options));
+  }
+
+  pblog_sim_stats Stats() {
+    pblog_sim_stats stats;
+    pblog_sim_get_stats(&ops_, &stats);
+    return stats;
+  }
+
+  pblog_flash_ops ops_;
+};
+
+TEST_F(SimTest, InvalidGeometry) {
+  pblog_sim_options options = {};
+  options.size = 1000;
+  EXPECT_EQ(PBLOG_ERR_INVALID, pblog_sim_ops_init(&ops_, &options));
+  options.size = kEraseBlockSize;
+  options.program_size = 3000;
+  EXPECT_EQ(PBLOG_ERR_INVALID, pblog_sim_ops_init(&ops_, &options));
+}
+
+TEST_F(SimTest, ProgramOnlyClearsBits) {
+  Init(0, 0);
+  string data(2, '\0');
+  ASSERT_EQ(2, ops_.read(&ops_, 10, data.size(), &data[0]));
+  EXPECT_EQ("\xff\xff", data);
+
+  // Programming 0x0f over 0xf0 leaves the AND of both.
+  ASSERT_EQ(1, ops_.write(&ops_, 10, 1, "\xf0"));
+  ASSERT_EQ(1, ops_.write(&ops_, 10, 1, "\x0f"));
+  ASSERT_EQ(1, ops_.read(&ops_, 10, 1, &data[0]));
+  EXPECT_EQ('\0', data[0]);
+  EXPECT_EQ(1, Stats().program_errors);
+
+  // Programming erased bytes or the same bits again is fine.
+  ASSERT_EQ(2, ops_.write(&ops_, 10, 2, "\x00\xff"));
+  EXPECT_EQ(1, Stats().program_errors);
+
+  EXPECT_EQ(PBLOG_ERR_INVALID,
+            ops_.write(&ops_, 4 * kEraseBlockSize - 1, 2, "ab"));
+}
+
+TEST_F(SimTest, StrictRejectsProgramOfZeroBits) {
+  Init(0, 1);
+  ASSERT_EQ(2, ops_.write(&ops_, 0, 2, "\x0f\x0f"));
+  EXPECT_EQ(PBLOG_ERR_IO, ops_.write(&ops_, 0, 2, "\x0f\xf0"));
+  string data(2, '\0');
+  ASSERT_EQ(2, ops_.read(&ops_, 0, data.size(), &data[0]));
+  EXPECT_EQ("\x0f\x0f", data);
+}
+
+TEST_F(SimTest, EraseCountsAndTime) {
+  Init(0, 0);
+  EXPECT_EQ(PBLOG_ERR_INVALID, ops_.erase(&ops_, 100, kEraseBlockSize));
+  EXPECT_EQ(PBLOG_ERR_INVALID, ops_.erase(&ops_, 0, 100));
+
+  ASSERT_EQ(0, ops_.erase(&ops_, 0, 2 * kEraseBlockSize));
+  ASSERT_EQ(0, ops_.erase(&ops_, kEraseBlockSize, kEraseBlockSize));
+  EXPECT_EQ(1, pblog_sim_erase_count(&ops_, 0));
+  EXPECT_EQ(2, pblog_sim_erase_count(&ops_, 1));
+  EXPECT_EQ(0, pblog_sim_erase_count(&ops_, 2));
+
+  // A write touching two program units and a read.
+  string data(kProgramSize, 'x');
+  ASSERT_EQ(kProgramSize, ops_.write(&ops_, 10, data.size(), data.data()));
+  ASSERT_EQ(kProgramSize, ops_.read(&ops_, 0, data.size(), &data[0]));
+  pblog_sim_stats stats = Stats();
+  EXPECT_EQ(3, stats.erases);
+  EXPECT_EQ(2, stats.programs);
+  EXPECT_EQ(kProgramSize, stats.bytes_programmed);
+  EXPECT_EQ(2, stats.max_erase_count);
+  EXPECT_EQ(3 * 100000 + 2 * 1000 + 100, stats.time_ns);
+
+  // Wear survives a reset of the counters.
+  pblog_sim_reset_stats(&ops_);
+  EXPECT_EQ(0, Stats().time_ns);
+  EXPECT_EQ(2, Stats().max_erase_count);
+  EXPECT_EQ(2, pblog_sim_erase_count(&ops_, 1));
+}
+
+TEST_F(SimTest, WriteDisturb) {
+  Init(2, 0);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_EQ(1, ops_.write(&ops_, i, 1, "a"));
+  }
+  EXPECT_EQ(2, Stats().disturbs);
+  // An erase makes the unit programmable again.
+  ASSERT_EQ(0, ops_.erase(&ops_, 0, kEraseBlockSize));
+  ASSERT_EQ(1, ops_.write(&ops_, 0, 1, "a"));
+  EXPECT_EQ(2, Stats().disturbs);
+}
+
+TEST_F(SimTest, RecordLogWearsRegionsEvenly) {
+  Init(0, 1);
+  pblog_flash_geometry geometry;
+  ASSERT_EQ(0, ops_.get_geometry(&ops_, &geometry));
+  record_region regions[4];
+  ASSERT_EQ(0, record_regions_from_geometry(&geometry, 0, 4 * kEraseBlockSize,
+                                            4, regions));
+  record_intf_options options = {};
+  options.write_buffer_size = 512;
+  record_intf ri;
+  ASSERT_EQ(0, record_intf_init_options(&ri, regions, 4, &ops_, &options));
+
+  for (int i = 0; i < 5000; ++i) {
+    string data = StringPrintf("record %d", i);
+    int rc = ri.append(&ri, data.size(), data.data());
+    if (rc == PBLOG_ERR_NO_SPACE) {
+      ASSERT_GE(ri.clear(&ri, 1), 0);
+      rc = ri.append(&ri, data.size(), data.data());
+    }
+    ASSERT_GT(rc, 0) << i;
+  }
+  record_intf_free(&ri);
+
+  // Records are only ever programmed over erased bytes, and the log erases
+  // its regions in turn.
+  pblog_sim_stats stats = Stats();
+  EXPECT_EQ(0, stats.program_errors);
+  EXPECT_GT(stats.erases, 4);
+  for (uint32_t block = 0; block < 4; ++block) {
+    EXPECT_LE(stats.max_erase_count - pblog_sim_erase_count(&ops_, block), 1)
+        << block;
+  }
+}
+
+}  // namespace
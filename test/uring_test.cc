@@ -0,0 +1,137 @@
+/*
+ * Copyright 2014-2016 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <pblog/common.h>
+#include <pblog/file.h>
+#include <pblog/record.h>
+#include <pblog/uring.h>
+
+#include "common.hh"
+
+namespace {
+
+using pblog_test::StringPrintf;
+using std::string;
+
+const char kFilename[] = "/tmp/uring.tst";
+const size_t kRegionSize = 0x1000;
+
+// Runs every test with io_uring and with the synchronous fallback.
+class UringTest : public ::testing::TestWithParam<unsigned> {
+ public:
+  UringTest() {
+    unlink(kFilename);
+    pblog_uring_options options = {};
+    options.queue_depth = GetParam();
+    options.submit_batch = 4;
+    EXPECT_EQ(0, pblog_uring_ops_open(&ops_, kFilename, 2 * kRegionSize,
+                                      &options));
+  }
+
+  ~UringTest() override {
+    pblog_uring_ops_free(&ops_);
+    unlink(kFilename);
+  }
+
+  pblog_flash_ops ops_;
+};
+
+TEST_P(UringTest, ReadsSeeQueuedWrites) {
+  EXPECT_EQ(GetParam() != 0, pblog_uring_ops_is_async(&ops_) != 0);
+
+  // The file starts out erased.
+  string data(16, '\0');
+  EXPECT_EQ(16, ops_.read(&ops_, 0, data.size(), &data[0]));
+  EXPECT_EQ(string(16, '\xff'), data);
+
+  // An erase followed by a write to the same bytes completes in order.
+  const string expected("0123456789abcdef");
+  EXPECT_EQ(16, ops_.write(&ops_, 0, expected.size(), expected.data()));
+  EXPECT_EQ(0, ops_.erase(&ops_, 0, kRegionSize));
+  EXPECT_EQ(16, ops_.write(&ops_, 8, expected.size(), expected.data()));
+  EXPECT_EQ(16, ops_.read(&ops_, 0, data.size(), &data[0]));
+  EXPECT_EQ(string(8, '\xff') + expected.substr(0, 8), data);
+  EXPECT_EQ(0, ops_.sync(&ops_));
+}
+
+// Writes to the same bytes land in the order they were issued, while
+// writes elsewhere stay in flight.
+TEST_P(UringTest, OverlappingWritesCompleteInOrder) {
+  string expected(kRegionSize, '\xff');
+  srand(1);
+  for (int i = 0; i < 1000; ++i) {
+    const size_t offset = rand() % (kRegionSize - 64);
+    const string data(1 + rand() % 64, static_cast<char>('a' + i % 26));
+    EXPECT_EQ(static_cast<int>(data.size()),
+              ops_.write(&ops_, offset, data.size(), data.data()));
+    expected.replace(offset, data.size(), data);
+  }
+  string data(kRegionSize, '\0');
+  EXPECT_EQ(static_cast<int>(kRegionSize),
+            ops_.read(&ops_, 0, data.size(), &data[0]));
+  EXPECT_EQ(expected, data);
+  EXPECT_EQ(0, ops_.sync(&ops_));
+}
+
+TEST_P(UringTest, RecordsPersist) {
+  record_region regions[2] = {};
+  regions[0].size = kRegionSize;
+  regions[1].offset = kRegionSize;
+  regions[1].size = kRegionSize;
+  record_intf_options options = {};
+  options.read_ahead_size = 256;
+  record_intf ri;
+  ASSERT_EQ(0, record_intf_init_options(&ri, regions, 2, &ops_, &options));
+
+  size_t num_written = 0;
+  while (true) {
+    const string record = StringPrintf("%08x", num_written);
+    if (ri.append(&ri, record.size(), record.data()) < 0) {
+      break;
+    }
+    num_written++;
+  }
+  EXPECT_EQ(0, ri.flush(&ri));
+  record_intf_free(&ri);
+
+  // Read back through the plain file backend, then with read-ahead through
+  // io_uring, which prefetches the next window.
+  pblog_flash_ops file_ops;
+  ASSERT_EQ(0, pblog_file_ops_init(&file_ops, kFilename));
+  for (pblog_flash_ops *ops : {&file_ops, &ops_}) {
+    ASSERT_EQ(0, record_intf_init_options(&ri, regions, 2, ops, &options));
+    record_cursor cursor;
+    ASSERT_EQ(0, ri.seek(&ri, &cursor, 0));
+    string data(64, '\0');
+    for (size_t i = 0; i < num_written; ++i) {
+      int next_offset = 0;
+      size_t len = data.size();
+      ASSERT_EQ(0, ri.read_next(&ri, &cursor, &next_offset, &len, &data[0]));
+      ASSERT_EQ(StringPrintf("%08x", i), data.substr(0, len));
+    }
+    record_intf_free(&ri);
+  }
+  pblog_file_ops_free(&file_ops);
+}
+
+INSTANTIATE_TEST_SUITE_P(QueueDepths, UringTest, ::testing::Values(0u, 8u));
+
+}  // namespace